@@ -0,0 +1,121 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2019 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCOPE_PROFILE_H
+#define SCOPE_PROFILE_H
+
+#include <stdint.h>
+
+/*
+ * Scope profiles describe how to drive one family of scopes: the command for
+ * each state, the state query, and rules mapping the fields of the query's
+ * response to a state. They hold no pointers, so a table of them can be
+ * built separately from the firmware and written to the profile flash region
+ * (sector 3, 0x0800C000) on its own. The firmware image carries the default
+ * table in that region, so flashing the firmware restores the defaults.
+ */
+
+#define SCOPE_PROFILE_MAGIC_INIT                                               \
+    { 'S', 'P', 'R', 'F' }
+#define SCOPE_PROFILE_VERSION 2
+
+#define SCOPE_PROFILE_VENDOR_LEN 16
+#define SCOPE_PROFILE_MODEL_LEN 32
+#define SCOPE_PROFILE_FW_LEN 12
+#define SCOPE_PROFILE_CMD_LEN 48
+#define SCOPE_PROFILE_TOKEN_LEN 12
+#define SCOPE_PROFILE_MAX_RULES 10
+#define SCOPE_PROFILE_MAX_FIELDS 8
+
+/* The end of the region is left erased for the firmware's cache of which
+ * profile each scope used, so the table must end before it */
+#define SCOPE_PROFILE_CACHE_SIZE 2048
+
+/* States in scope_state_t order */
+enum {
+    SCOPE_PROFILE_STOPPED,
+    SCOPE_PROFILE_RUNNING,
+    SCOPE_PROFILE_SINGLE,
+    SCOPE_PROFILE_NUM_STATES,
+    /* Rule result that leaves the state as earlier rules set it */
+    SCOPE_PROFILE_KEEP = 0xFF
+};
+
+/* How a state command is confirmed */
+enum {
+    /* Write only, the next poll reads the state */
+    SCOPE_PROFILE_CONFIRM_NONE,
+    /* Send "<cmd>;:<state_query>" and parse the answer as a state */
+    SCOPE_PROFILE_CONFIRM_STATE,
+    /* Send "<cmd>;*OPC?", an answer of 1 means the state was entered */
+    SCOPE_PROFILE_CONFIRM_OPC
+};
+
+/* Token matching any field value */
+#define SCOPE_PROFILE_ANY "*"
+
+/* Rules are applied in order and the first match for each field counts, so a
+ * later field can override the state picked by an earlier one. Every field
+ * must be matched by some rule for the response to parse. */
+struct scope_profile_rule {
+    uint8_t field; /* Response field, 0 based */
+    uint8_t state; /* State to select, or SCOPE_PROFILE_KEEP */
+    char    token[SCOPE_PROFILE_TOKEN_LEN];
+};
+
+/* A scope matches the first profile for its vendor whose model and firmware
+ * version match, else the first matching profile for any vendor. */
+struct scope_profile {
+    /* *IDN? manufacturer after the firmware's vendor aliases are applied, so
+     * "KEYSIGHT" also matches Agilent scopes. Unknown manufacturers are
+     * matched as they are. Empty matches any. */
+    char vendor[SCOPE_PROFILE_VENDOR_LEN];
+    /* *IDN? model, '|' separated globs using '*' and '?'; empty matches any */
+    char model[SCOPE_PROFILE_MODEL_LEN];
+    /* *IDN? firmware version range [fw_min, fw_max), compared a numeric
+     * component at a time so "7.10" is above "7.9"; empty for no bound */
+    char fw_min[SCOPE_PROFILE_FW_LEN];
+    char fw_max[SCOPE_PROFILE_FW_LEN];
+    /* Command entering each state */
+    char state_cmds[SCOPE_PROFILE_NUM_STATES][SCOPE_PROFILE_CMD_LEN];
+    /* Query answered by the state, without a leading ':' */
+    char state_query[SCOPE_PROFILE_CMD_LEN];
+    /* Command latching run state changes into the status byte, or empty.
+     * Used to raise SRQs on state changes and for status byte polls. */
+    char status_setup[SCOPE_PROFILE_CMD_LEN];
+    /* Status byte bits set by a latched state change until *CLS, 0 if not
+     * supported */
+    uint8_t stb_run_mask;
+    /* Fields in the state query response */
+    uint8_t num_fields;
+    uint8_t num_rules;
+    /* SCOPE_PROFILE_CONFIRM_*, to set and confirm a state in one exchange */
+    uint8_t confirm;
+    struct scope_profile_rule rules[SCOPE_PROFILE_MAX_RULES];
+};
+
+struct scope_profile_table {
+    uint8_t  magic[4];
+    uint8_t  version;
+    uint8_t  count;
+    uint16_t record_size; /* sizeof(struct scope_profile) */
+    struct scope_profile profiles[];
+};
+
+#endif
@@ -0,0 +1,209 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host CPU cost of parsing scope answers, from the firmware source. For each
+ * answer captured in doc/captures, and a long synthetic one, it reports the
+ * time to split the answer into fields, per call and per byte, and to match
+ * one field against one mnemonic. Then the time to find the profile for each
+ * captured *IDN? answer and to parse each captured state answer.
+ *
+ *   bench_scpi [-q]        -q runs a few iterations only
+ */
+
+#include "scope.c"
+
+#include "captures.h"
+#include "fake_flash.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#define MAX_MSGS 64
+#define MAX_ANSWERS 32
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static const char *const captures[] = {
+    "dpo3034_idn.pcapng", "dpo3034_runstop.pcapng", "dso9404a_idn.pcapng",
+    "dso9404a_runstop.pcapng"};
+
+/* Distinct answers, with the query each answered */
+static struct {
+    const char *capture;
+    char        query[CAPTURE_MSG_LEN];
+    char        text[CAPTURE_MSG_LEN];
+    size_t      len;
+} answers[MAX_ANSWERS];
+static size_t num_answers;
+
+static capture_msg_t msgs[MAX_MSGS];
+
+/* Keeps the compiler from dropping the work being timed */
+static volatile size_t sink;
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void add_answer(const char *capture, const char *query,
+                       const char *text, size_t len) {
+    for (size_t i = 0; i < num_answers; i++) {
+        if (answers[i].len == len && !memcmp(answers[i].text, text, len)) {
+            return;
+        }
+    }
+    if (num_answers < MAX_ANSWERS) {
+        answers[num_answers].capture = capture;
+        snprintf(answers[num_answers].query, CAPTURE_MSG_LEN, "%s", query);
+        memcpy(answers[num_answers].text, text, len + 1);
+        answers[num_answers].len = len;
+        num_answers++;
+    }
+}
+
+/* A full state answer buffer of short fields */
+static void add_long_answer(void) {
+    char   text[SCOPE_STATE_BUF_SIZE * 4];
+    size_t len = 0;
+
+    while (len + 8 < sizeof(text) - 1) {
+        len += snprintf(&text[len], sizeof(text) - len, "%sFIELD%zu",
+                        len ? "," : "", len % 10);
+    }
+    len += snprintf(&text[len], sizeof(text) - len, "\n");
+    add_answer("synthetic", "", text, len);
+}
+
+static double time_split(size_t i, unsigned iterations, size_t *count) {
+    scpi_span_t    fields[SCOPE_PROFILE_MAX_FIELDS];
+    const uint64_t start = wall_ns();
+
+    for (unsigned n = 0; n < iterations; n++) {
+        *count = scpi_split(answers[i].text, answers[i].len, fields,
+                            ARRAY_LEN(fields));
+        sink += fields[0].len;
+    }
+    return (double)(wall_ns() - start) / iterations;
+}
+
+/* Per call of scpi_match(), each field against each rule token */
+static double time_match(size_t i, unsigned iterations) {
+    const struct scope_profile_table *table = scope_profiles();
+    scpi_span_t fields[SCOPE_PROFILE_MAX_FIELDS];
+    size_t      count = scpi_split(answers[i].text, answers[i].len, fields,
+                              ARRAY_LEN(fields));
+    size_t      calls = 0;
+
+    const uint64_t start = wall_ns();
+    for (unsigned n = 0; n < iterations; n++) {
+        for (size_t p = 0; p < table->count; p++) {
+            const scope_config_t *cfg = &table->profiles[p];
+            for (size_t r = 0; r < cfg->num_rules; r++) {
+                for (size_t f = 0; f < count; f++) {
+                    sink += scpi_match(cfg->rules[r].token, fields[f]);
+                    calls++;
+                }
+            }
+        }
+    }
+    return (double)(wall_ns() - start) / calls;
+}
+
+int main(int argc, char **argv) {
+    const unsigned iterations =
+        argc > 1 && !strcmp(argv[1], "-q") ? 100 : 200000;
+    const struct scope_profile_table *table;
+    int                               failed = 0;
+
+    fake_flash_init();
+    if (!load_profiles() || !(table = scope_profiles())) {
+        printf("no profile table\n");
+        return 1;
+    }
+    for (size_t c = 0; c < ARRAY_LEN(captures); c++) {
+        size_t count = capture_read(captures[c], msgs, MAX_MSGS);
+        if (!count) {
+            failed = 1;
+        }
+        for (size_t i = 1; i < count; i++) {
+            if (msgs[i].answer && !msgs[i - 1].answer) {
+                add_answer(captures[c], msgs[i - 1].text, msgs[i].text,
+                           msgs[i].len);
+            }
+        }
+    }
+    add_long_answer();
+
+    printf("%u iterations each\n\n", iterations);
+    printf("%-28s %6s %6s %9s %8s %9s\n", "answer", "bytes", "fields",
+           "split ns", "ns/byte", "match ns");
+    for (size_t i = 0; i < num_answers; i++) {
+        size_t count, shown = strcspn(answers[i].text, "\r\n");
+        double split = time_split(i, iterations, &count);
+        double match = time_match(i, iterations);
+
+        printf("%-28.*s %6zu %6zu %9.1f %8.2f %9.1f\n",
+               (int)(shown < 28 ? shown : 28), answers[i].text,
+               answers[i].len, count, split, split / answers[i].len, match);
+    }
+
+    /* Whole lookups, as scope_match_idn() and scope_parse_state() do them */
+    printf("\n%-28s %-24s %9s\n", "query", "capture", "ns");
+    for (size_t i = 0; i < num_answers; i++) {
+        const scope_config_t *cfg = NULL;
+        bool                  idn = !strcmp(answers[i].query, "*IDN?");
+
+        for (size_t p = 0; !idn && p < table->count; p++) {
+            if (!strcmp(table->profiles[p].state_query, answers[i].query)) {
+                cfg = &table->profiles[p];
+            }
+        }
+        if (!idn && !cfg) {
+            continue;
+        }
+
+        const uint64_t start = wall_ns();
+        for (unsigned n = 0; n < iterations; n++) {
+            scpi_span_t   fields[4];
+            scope_state_t state;
+            if (idn) {
+                if (scpi_split(answers[i].text, answers[i].len, fields, 4) !=
+                        4 ||
+                    !match_profile(fields)) {
+                    printf("%s: no profile\n", answers[i].capture);
+                    failed = 1;
+                    break;
+                }
+            } else if (!scope_parse_state(cfg, answers[i].text,
+                                          answers[i].len, &state)) {
+                printf("%s: cannot parse '%s'\n", answers[i].capture,
+                       answers[i].text);
+                failed = 1;
+                break;
+            } else {
+                sink += state;
+            }
+        }
+        printf("%-28s %-24s %9.1f\n", answers[i].query, answers[i].capture,
+               (double)(wall_ns() - start) / iterations);
+    }
+    return failed;
+}
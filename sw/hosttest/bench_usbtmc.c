@@ -0,0 +1,170 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cost of a query through each of the driver's read paths, by answer size.
+ * For every path and size it reports the bus transactions per query, the
+ * simulated bus time per query, and the host CPU time per query and per
+ * answer byte. The per byte figure is the slope against the smallest
+ * answer, so it is the parse and copy cost the answer size adds; it
+ * includes the fake device building the answer, one copy per byte, and is
+ * only shown from 1 KiB up, where it is above the noise.
+ *
+ *   bench_usbtmc [-q]      -q runs a few iterations only
+ */
+
+#include "fake_tmc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum {
+    PATH_ASK = 0,
+    PATH_IN_PLACE,
+    PATH_ASYNC,
+    PATH_BLOCK,
+    PATH_COUNT
+} path_t;
+
+static const char *const path_names[PATH_COUNT] = {"ask", "in place", "async",
+                                                   "block"};
+
+static const size_t sizes[] = {16, 64, 240, 1024, 4096, 16384};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static fake_tmc_t     dev;
+static USBHTmcDriver *tmcp;
+
+static char    answer[32768];
+static uint8_t rx[USBH_TMC_RX_BUF_SIZE(sizeof(answer))]
+    __attribute__((aligned(4)));
+
+static size_t async_len;
+static volatile bool async_done;
+
+static void async_cb(USBHTmcDriver *drv, size_t len) {
+    (void)drv;
+    async_len  = len;
+    async_done = true;
+}
+
+static size_t block_len;
+
+static bool block_cb(void *user, const uint8_t *data, size_t n) {
+    (void)user;
+    (void)data;
+    block_len += n;
+    return true;
+}
+
+static size_t query(path_t path, const char *q, size_t n) {
+    const size_t    qlen = strlen(q);
+    const systime_t tout = TIME_MS2I(1000);
+
+    switch (path) {
+        case PATH_ASK:
+            return usbhtmcAsk(tmcp, q, qlen, answer, n, tout);
+        case PATH_IN_PLACE:
+            return usbhtmcAskInPlace(tmcp, q, qlen, rx, n, tout);
+        case PATH_ASYNC:
+            async_done = false;
+            if (!usbhtmcAskAsync(tmcp, q, qlen, answer, n, tout, async_cb))
+                return 0;
+            if (!fake_usbh_run_until(&async_done, 10000000))
+                return 0;
+            return async_len;
+        case PATH_BLOCK:
+            block_len = 0;
+            return usbhtmcAskBlock(tmcp, q, qlen, block_cb, NULL, tout);
+        default:
+            return 0;
+    }
+}
+
+static uint64_t wall_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    const unsigned iterations = argc > 1 && !strcmp(argv[1], "-q") ? 20 : 2000;
+    fake_tmc_config_t cfg;
+    static const USBHTmcConfig tmc_config = {NULL};
+    int               failed = 0;
+
+    fake_tmc_default_config(&cfg);
+    fake_tmc_init(&dev, &cfg);
+    tmcp = fake_tmc_attach(&dev, &tmc_config);
+    if (!tmcp) {
+        printf("attach failed\n");
+        return 1;
+    }
+
+    printf("%u queries each, %u byte packets, device answers after %u us\n\n",
+           iterations, cfg.bulk_mps, cfg.answer_us);
+    printf("%-9s %6s %9s %8s %8s %9s %10s %8s\n", "path", "bytes",
+           "bulk out", "bulk in", "control", "bus us", "host ns", "ns/byte");
+
+    for (path_t p = 0; p < PATH_COUNT; p++) {
+        double base_ns = 0;
+        for (unsigned s = 0; s < NUM_SIZES; s++) {
+            const size_t n = sizes[s];
+            char         q[32];
+
+            /* The text paths answer "DATA? n" with exactly n bytes; the
+             * block path counts the payload of an n byte block */
+            snprintf(q, sizeof(q), "%s %zu",
+                     p == PATH_BLOCK ? "CURVe?" : "DATA?", n);
+
+            const fake_usbh_stats_t before = fake_usbh_stats;
+            const uint64_t          sim    = fake_usbh_now();
+            const uint64_t          start  = wall_ns();
+            for (unsigned i = 0; i < iterations; i++) {
+                if (query(p, q, sizeof(answer) - 1) != n) {
+                    printf("%s: %zu byte query failed\n", path_names[p], n);
+                    failed = 1;
+                    break;
+                }
+            }
+            const double ns = (double)(wall_ns() - start) / iterations;
+            const double k  = 1.0 / iterations;
+
+            if (s == 0)
+                base_ns = ns;
+            printf("%-9s %6zu %9.2f %8.2f %8.2f %9.0f %10.0f", path_names[p],
+                   n, k * (fake_usbh_stats.bulk_out - before.bulk_out),
+                   k * (fake_usbh_stats.bulk_in - before.bulk_in),
+                   k * (fake_usbh_stats.control - before.control),
+                   k * (fake_usbh_now() - sim), ns);
+            if (n < 1024)
+                printf(" %8s\n", "-");
+            else
+                printf(" %8.2f\n", (ns - base_ns) / (n - sizes[0]));
+        }
+    }
+
+    printf("\ndriver: %u timeouts, %u errors, %u aborts\n",
+           tmcp->stats.timeouts, tmcp->stats.errors, tmcp->stats.aborts);
+    if (tmcp->stats.timeouts || tmcp->stats.errors || tmcp->stats.aborts)
+        failed = 1;
+    fake_tmc_detach(&dev, tmcp);
+    return failed;
+}
@@ -0,0 +1,153 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "captures.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SHB 0x0A0D0D0A
+#define BLOCK_IDB 1
+#define BLOCK_EPB 6
+#define BYTE_ORDER_MAGIC 0x1A2B3C4D
+
+/* Linux usbmon with the 64 byte header of the binary (mmapped) interface */
+#define LINKTYPE_USB_LINUX_MMAPPED 220
+#define USBMON_HDR_LEN 64
+#define USBMON_TYPE 8
+#define USBMON_XFER_TYPE 9
+#define USBMON_EPNUM 10
+#define USBMON_BULK 3
+
+/* USBTMC bulk header */
+#define TMC_HDR_LEN 12
+#define TMC_DEV_DEP_MSG_OUT 1
+#define TMC_DEV_DEP_MSG_IN 2
+#define TMC_EOM 0x01
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16(const uint8_t *p) {
+    return p[0] | p[1] << 8;
+}
+
+static uint8_t *read_file(const char *name, size_t *len) {
+    char  path[512];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", CAPTURE_DIR, name);
+    f = fopen(path, "rb");
+    if (!f) {
+        printf("cannot open %s\n", path);
+        return NULL;
+    }
+    uint8_t *buf = NULL;
+    long     n   = -1;
+    if (!fseek(f, 0, SEEK_END) && (n = ftell(f)) >= 0 &&
+        !fseek(f, 0, SEEK_SET) && (buf = malloc(n ? n : 1)) &&
+        fread(buf, 1, n, f) != (size_t)n) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+/* Add one bulk transfer's USBTMC payload, joining it to the message before
+ * it if that one did not end with EOM */
+static size_t add_transfer(const uint8_t *data, size_t len, bool answer,
+                           bool *open, capture_msg_t msgs[], size_t count,
+                           size_t max) {
+    if (len < TMC_HDR_LEN ||
+        data[0] != (answer ? TMC_DEV_DEP_MSG_IN : TMC_DEV_DEP_MSG_OUT)) {
+        return count;
+    }
+    size_t n = le32(&data[4]);
+    if (n > len - TMC_HDR_LEN) {
+        n = len - TMC_HDR_LEN;
+    }
+
+    capture_msg_t *msg;
+    if (*open && count && msgs[count - 1].answer == answer) {
+        msg = &msgs[count - 1];
+    } else if (count < max) {
+        msg = &msgs[count++];
+        msg->answer = answer;
+        msg->len    = 0;
+    } else {
+        return count;
+    }
+    if (n > CAPTURE_MSG_LEN - 1 - msg->len) {
+        n = CAPTURE_MSG_LEN - 1 - msg->len;
+    }
+    memcpy(&msg->text[msg->len], &data[TMC_HDR_LEN], n);
+    msg->len += n;
+    msg->text[msg->len] = 0;
+    *open = !(data[8] & TMC_EOM);
+    return count;
+}
+
+size_t capture_read(const char *name, capture_msg_t msgs[], size_t max) {
+    size_t   len;
+    uint8_t *buf   = read_file(name, &len);
+    size_t   count = 0;
+    bool     open  = false;
+    bool     usb   = false;
+
+    if (!buf) {
+        return 0;
+    }
+    for (size_t off = 0; off + 12 <= len;) {
+        const uint8_t *b    = &buf[off];
+        uint32_t       type = le32(b);
+        uint32_t       size = le32(&b[4]);
+
+        if (size < 12 || size > len - off ||
+            (type == BLOCK_SHB && le32(&b[8]) != BYTE_ORDER_MAGIC)) {
+            printf("%s: bad block at %zu\n", name, off);
+            count = 0;
+            break;
+        }
+        if (type == BLOCK_IDB && size >= 16) {
+            usb = le16(&b[8]) == LINKTYPE_USB_LINUX_MMAPPED;
+        } else if (type == BLOCK_EPB && size >= 28 && usb) {
+            const uint8_t *pkt    = &b[28];
+            uint32_t       caplen = le32(&b[20]);
+
+            if (caplen <= size - 28 && caplen > USBMON_HDR_LEN &&
+                pkt[USBMON_XFER_TYPE] == USBMON_BULK) {
+                /* Commands when submitted, answers when completed */
+                bool in = pkt[USBMON_EPNUM] & 0x80;
+                if (pkt[USBMON_TYPE] == (in ? 'C' : 'S')) {
+                    count = add_transfer(&pkt[USBMON_HDR_LEN],
+                                         caplen - USBMON_HDR_LEN, in, &open,
+                                         msgs, count, max);
+                }
+            }
+        }
+        off += size;
+    }
+    free(buf);
+    return count;
+}
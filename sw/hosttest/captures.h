@@ -0,0 +1,46 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * USBTMC messages from the usbmon captures in doc/captures: the payloads of
+ * the host's DEV_DEP_MSG_OUT transfers and of the instrument's
+ * DEV_DEP_MSG_IN answers, in capture order. A message sent in several
+ * transfers is joined up to the one with EOM set.
+ */
+
+#ifndef CAPTURES_H
+#define CAPTURES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CAPTURE_MSG_LEN 256
+
+typedef struct {
+    bool   answer; /* From the instrument, else a command or query */
+    size_t len;
+    char   text[CAPTURE_MSG_LEN]; /* NUL terminated */
+} capture_msg_t;
+
+/* Read up to max messages of the capture file name in doc/captures. Returns
+ * the number read, 0 if the file cannot be read or is not a usbmon capture
+ * in pcapng format. */
+size_t capture_read(const char *name, capture_msg_t msgs[], size_t max);
+
+#endif
@@ -0,0 +1,66 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fake_flash.h"
+
+#include "flash.h"
+
+#include <string.h>
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+uint8_t  fake_flash[FAKE_FLASH_SIZE] __attribute__((aligned(4)));
+unsigned fake_flash_programs;
+
+/* What the firmware's linker script does with ORIGIN() and LENGTH() */
+__asm__(".globl __profiles_base__\n"
+        ".set __profiles_base__, fake_flash\n"
+        ".globl __profiles_end__\n"
+        ".set __profiles_end__, fake_flash + " XSTR(FAKE_FLASH_SIZE) "\n");
+
+void fake_flash_init(void) {
+    memset(fake_flash, 0xFF, sizeof(fake_flash));
+    memcpy(fake_flash, &scope_profile_defaults,
+           sizeof(scope_profile_defaults) +
+               scope_profile_defaults.count * sizeof(struct scope_profile));
+}
+
+/* Programming as NOR flash does it: bits only go from 1 to 0, so writing
+ * over data that was not erased reads back wrong. Fails outside the region
+ * or off a word boundary. */
+bool flash_program(const void *addr, const uint32_t *data, size_t words) {
+    const uint8_t *p   = addr;
+    uint32_t *     dst = (uint32_t *)(uintptr_t)addr;
+    bool           ok  = true;
+
+    fake_flash_programs++;
+    if (p < fake_flash || p > fake_flash + FAKE_FLASH_SIZE ||
+        words > (size_t)(fake_flash + FAKE_FLASH_SIZE - p) / sizeof(uint32_t) ||
+        ((uintptr_t)p & 3U)) {
+        return false;
+    }
+    for (size_t i = 0; i < words; i++) {
+        dst[i] &= data[i];
+    }
+    for (size_t i = 0; i < words && ok; i++) {
+        ok = dst[i] == data[i];
+    }
+    return ok;
+}
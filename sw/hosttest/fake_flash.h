@@ -0,0 +1,48 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The profile flash region for firmware sources built on the host. The
+ * firmware reads the profile table through the __profiles_base__ and
+ * __profiles_end__ symbols from its linker script; here they are bound to
+ * fake_flash, which fake_flash_init() loads as flashing the firmware does.
+ * flash_program() writes to it like the real sector.
+ */
+
+#ifndef FAKE_FLASH_H
+#define FAKE_FLASH_H
+
+#include "scope_profile.h"
+
+/* Size of the profiles region in STM32F401xB.ld. A plain number, it is
+ * pasted into the symbol definitions in fake_flash.c. */
+#define FAKE_FLASH_SIZE 16384
+
+extern uint8_t fake_flash[FAKE_FLASH_SIZE];
+/* Calls to flash_program() */
+extern unsigned fake_flash_programs;
+
+/* From profiles.c */
+extern const struct scope_profile_table scope_profile_defaults;
+
+/* Erase the region and write the default profile table to its start, which
+ * also empties the reconnect cache at its end */
+void fake_flash_init(void);
+
+#endif
@@ -0,0 +1,642 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fake_tmc.h"
+#include "usbh_additional_class_drivers.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* USBTMC 1.0 and USB488 1.0 */
+enum {
+    TMC_DEV_DEP_MSG_OUT        = 1,
+    TMC_REQUEST_DEV_DEP_MSG_IN = 2,
+    TMC_DEV_DEP_MSG_IN         = 2,
+    TMC_TRIGGER                = 128,
+};
+
+enum {
+    TMC_INITIATE_ABORT_BULK_OUT     = 1,
+    TMC_CHECK_ABORT_BULK_OUT_STATUS = 2,
+    TMC_INITIATE_ABORT_BULK_IN      = 3,
+    TMC_CHECK_ABORT_BULK_IN_STATUS  = 4,
+    TMC_INITIATE_CLEAR              = 5,
+    TMC_CHECK_CLEAR_STATUS          = 6,
+    TMC_GET_CAPABILITIES            = 7,
+    TMC_INDICATOR_PULSE             = 64,
+    TMC_READ_STATUS_BYTE            = 128,
+    TMC_REN_CONTROL                 = 160,
+    TMC_GO_TO_LOCAL                 = 161,
+};
+
+enum {
+    TMC_EOM      = 1,
+    TMC_TERMCHAR = 2,
+};
+
+#define TMC_HDR_SIZE 12
+#define EP_BULK_OUT 0x01
+#define EP_BULK_IN 0x82
+#define EP_INT_IN 0x83
+
+static uint32_t _get32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void _put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t _padded(uint32_t n) {
+    return (n + 3) & ~3u;
+}
+
+/*===========================================================================*/
+/* Bulk IN                                                                   */
+/*===========================================================================*/
+
+/* Queue one DEV_DEP_MSG_IN transfer, of which only send bytes of payload
+ * actually go out */
+static void _queue_xfer(fake_tmc_t *tmc, uint8_t tag, uint8_t inverse,
+                        const char *data, uint32_t n, uint32_t send,
+                        bool eom) {
+    uint8_t *p = tmc->inq + tmc->inq_len;
+
+    if (tmc->nxfers == FAKE_TMC_MAX_XFERS ||
+        tmc->inq_len + TMC_HDR_SIZE + _padded(n) > sizeof(tmc->inq))
+        fake_panic("fake_tmc: bulk IN queue full");
+
+    memset(p, 0, TMC_HDR_SIZE + _padded(n));
+    p[0] = TMC_DEV_DEP_MSG_IN;
+    p[1] = tag;
+    p[2] = inverse;
+    _put32(p + 4, n);
+    p[8] = eom ? TMC_EOM : 0;
+    memcpy(p + TMC_HDR_SIZE, data, n);
+
+    tmc->inq_len += TMC_HDR_SIZE + (send < n ? send : _padded(n));
+    tmc->xfer_end[tmc->nxfers++] = tmc->inq_len;
+    tmc->counters.transfers++;
+}
+
+/* Queue a zero length packet, ending whatever the host was reading */
+static void _queue_zlp(fake_tmc_t *tmc) {
+    if (tmc->nxfers < FAKE_TMC_MAX_XFERS)
+        tmc->xfer_end[tmc->nxfers++] = tmc->inq_len;
+}
+
+static void _flush_in(fake_tmc_t *tmc) {
+    tmc->inq_pos = tmc->inq_len = 0;
+    tmc->nxfers  = 0;
+}
+
+static void _discard_answer(fake_tmc_t *tmc) {
+    tmc->answer_len = tmc->answer_pos = 0;
+    tmc->fragmenting                  = false;
+}
+
+/* Answer the outstanding request once there is something to send */
+static void _service(fake_tmc_t *tmc) {
+    if (!tmc->req_pending || tmc->nxfers || tmc->stall_in ||
+        tmc->answer_pos >= tmc->answer_len)
+        return;
+
+    fake_tmc_fault_t fault = tmc->fault;
+    if (fault != FAKE_TMC_FAULT_FRAGMENT) {
+        tmc->fault = FAKE_TMC_FAULT_NONE;
+    } else {
+        tmc->fragmenting = true;
+    }
+    if (tmc->fragmenting)
+        fault = FAKE_TMC_FAULT_FRAGMENT;
+
+    if (fault == FAKE_TMC_FAULT_STALL) {
+        /* The request stays outstanding until it is aborted */
+        tmc->stall_in = true;
+        tmc->stall_at = tmc->answer_at;
+        return;
+    }
+
+    const char *data = tmc->answer + tmc->answer_pos;
+    uint32_t    n    = tmc->answer_len - tmc->answer_pos;
+    if (n > tmc->req_size)
+        n = tmc->req_size;
+    if (tmc->cfg.max_transfer && n > tmc->cfg.max_transfer)
+        n = tmc->cfg.max_transfer;
+    if (fault == FAKE_TMC_FAULT_FRAGMENT && n > tmc->fault_param)
+        n = tmc->fault_param;
+    if (tmc->req_term && tmc->cfg.termchar) {
+        const char *end = memchr(data, tmc->req_termchar, n);
+        if (end)
+            n = end - data + 1;
+    }
+    const bool eom = tmc->answer_pos + n == tmc->answer_len;
+
+    if (fault == FAKE_TMC_FAULT_STALE_TAG) {
+        const uint8_t tag = tmc->req_tag == 1 ? 255 : tmc->req_tag - 1;
+        _queue_xfer(tmc, tag, ~tag, "STALE\n", 6, 6, true);
+    }
+
+    const uint8_t inverse =
+        fault == FAKE_TMC_FAULT_BAD_TAG ? tmc->req_tag : ~tmc->req_tag;
+    uint32_t send = n;
+    if (fault == FAKE_TMC_FAULT_SHORT)
+        send = tmc->fault_param < n ? n - tmc->fault_param : 0;
+    _queue_xfer(tmc, tmc->req_tag, inverse, data, n, send, eom);
+
+    tmc->answer_pos += n;
+    tmc->req_pending = false;
+    tmc->inq_at      = tmc->answer_at;
+    if (eom) {
+        _discard_answer(tmc);
+        if (fault == FAKE_TMC_FAULT_FRAGMENT)
+            tmc->fault = FAKE_TMC_FAULT_NONE;
+    }
+}
+
+static uint64_t _in_ready(fake_device_t *fd, usbh_ep_t *ep, uint32_t *avail) {
+    fake_tmc_t *const tmc = (fake_tmc_t *)fd;
+
+    if (ep->type == USBH_EPTYPE_INT) {
+        *avail = 2;
+        return tmc->nnotify ? tmc->notify_at : FAKE_NEVER;
+    }
+    if (tmc->stall_in) {
+        *avail = 0;
+        return tmc->stall_at;
+    }
+    if (!tmc->nxfers)
+        return FAKE_NEVER;
+    *avail = tmc->xfer_end[0] - tmc->inq_pos;
+    return tmc->inq_at;
+}
+
+static usbh_urbstatus_t _in(fake_device_t *fd, usbh_ep_t *ep, uint8_t *buf,
+                            uint32_t len, uint32_t *actual) {
+    fake_tmc_t *const tmc = (fake_tmc_t *)fd;
+
+    *actual = 0;
+    if (ep->type == USBH_EPTYPE_INT) {
+        if (!tmc->nnotify || len < 2)
+            return USBH_URBSTATUS_ERROR;
+        memcpy(buf, tmc->notify[0], 2);
+        memmove(tmc->notify[0], tmc->notify[1],
+                --tmc->nnotify * sizeof(tmc->notify[0]));
+        *actual = 2;
+        return USBH_URBSTATUS_OK;
+    }
+    if (tmc->stall_in)
+        return USBH_URBSTATUS_STALL;
+    if (!tmc->nxfers)
+        return USBH_URBSTATUS_ERROR;
+
+    /* A URB ends at the end of a transfer, its last packet being short */
+    uint32_t n = tmc->xfer_end[0] - tmc->inq_pos;
+    if (n > len)
+        n = len;
+    memcpy(buf, tmc->inq + tmc->inq_pos, n);
+    tmc->inq_pos += n;
+    *actual = n;
+    if (tmc->inq_pos == tmc->xfer_end[0]) {
+        memmove(tmc->xfer_end, tmc->xfer_end + 1,
+                --tmc->nxfers * sizeof(tmc->xfer_end[0]));
+        if (!tmc->nxfers)
+            _flush_in(tmc);
+        _service(tmc);
+    }
+    return USBH_URBSTATUS_OK;
+}
+
+/*===========================================================================*/
+/* Bulk OUT                                                                  */
+/*===========================================================================*/
+
+static void _dispatch(fake_tmc_t *tmc) {
+    tmc->cmd[tmc->cmd_len] = 0;
+    memcpy(tmc->last_cmd, tmc->cmd, tmc->cmd_len + 1);
+    tmc->counters.messages++;
+
+    _discard_answer(tmc);
+    tmc->answer_len = tmc->responder(tmc, tmc->cmd, tmc->cmd_len, tmc->answer,
+                                     sizeof(tmc->answer));
+    tmc->answer_at = fake_usbh_now() + tmc->cfg.answer_us;
+    if (tmc->fault == FAKE_TMC_FAULT_DELAY) {
+        tmc->answer_at += tmc->fault_param;
+        tmc->fault = FAKE_TMC_FAULT_NONE;
+    }
+    if (tmc->answer_len)
+        tmc->counters.queries++;
+    tmc->cmd_len = 0;
+}
+
+/* Handle one whole USBTMC message, returning false if it is malformed */
+static bool _message(fake_tmc_t *tmc, const uint8_t *m) {
+    const uint32_t size = _get32(m + 4);
+
+    switch (m[0]) {
+        case TMC_DEV_DEP_MSG_OUT:
+            if (!tmc->cmd_len &&
+                (tmc->answer_pos < tmc->answer_len || tmc->nxfers)) {
+                /* IEEE 488.2: a new message discards an unread answer */
+                tmc->counters.interrupted++;
+                _discard_answer(tmc);
+            }
+            if (tmc->cmd_len + size > FAKE_TMC_MSG_MAX)
+                return false;
+            memcpy(tmc->cmd + tmc->cmd_len, m + TMC_HDR_SIZE, size);
+            tmc->cmd_len += size;
+            if (m[8] & TMC_EOM)
+                _dispatch(tmc);
+            break;
+        case TMC_REQUEST_DEV_DEP_MSG_IN:
+            tmc->counters.requests++;
+            tmc->req_pending  = true;
+            tmc->req_tag      = m[1];
+            tmc->req_size     = size;
+            tmc->req_term     = (m[8] & TMC_TERMCHAR) != 0;
+            tmc->req_termchar = m[9];
+            _service(tmc);
+            break;
+        case TMC_TRIGGER:
+            tmc->counters.triggers++;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+static uint32_t _message_len(const uint8_t *m) {
+    return m[0] == TMC_DEV_DEP_MSG_OUT ? TMC_HDR_SIZE + _padded(_get32(m + 4))
+                                       : TMC_HDR_SIZE;
+}
+
+static usbh_urbstatus_t _out(fake_device_t *fd, usbh_ep_t *ep,
+                             const uint8_t *buf, uint32_t len) {
+    fake_tmc_t *const tmc = (fake_tmc_t *)fd;
+
+    (void)ep;
+    if (tmc->msg_len + len > sizeof(tmc->msg))
+        return USBH_URBSTATUS_STALL;
+    memcpy(tmc->msg + tmc->msg_len, buf, len);
+    tmc->msg_len += len;
+
+    while (tmc->msg_len >= TMC_HDR_SIZE) {
+        const uint8_t *m = tmc->msg;
+        if ((uint8_t)(m[1] ^ m[2]) != 0xFF || m[1] == 0) {
+            tmc->counters.bad_messages++;
+            tmc->msg_len = 0;
+            return USBH_URBSTATUS_STALL;
+        }
+        tmc->out_tag     = m[1];
+        const uint32_t n = _message_len(m);
+        if (n > sizeof(tmc->msg)) {
+            tmc->counters.bad_messages++;
+            tmc->msg_len = 0;
+            return USBH_URBSTATUS_STALL;
+        }
+        if (tmc->msg_len < n)
+            break;
+        if (!_message(tmc, m)) {
+            tmc->counters.bad_messages++;
+            tmc->msg_len = 0;
+            return USBH_URBSTATUS_STALL;
+        }
+        memmove(tmc->msg, tmc->msg + n, tmc->msg_len - n);
+        tmc->msg_len -= n;
+    }
+    return USBH_URBSTATUS_OK;
+}
+
+/*===========================================================================*/
+/* Control requests                                                          */
+/*===========================================================================*/
+
+static usbh_urbstatus_t _reply(uint8_t *buf, uint16_t len, const uint8_t *data,
+                               uint16_t n) {
+    memcpy(buf, data, len < n ? len : n);
+    return USBH_URBSTATUS_OK;
+}
+
+static usbh_urbstatus_t _control(fake_device_t *fd, uint8_t type,
+                                 uint8_t req, uint16_t value, uint16_t index,
+                                 uint16_t len, uint8_t *buf) {
+    fake_tmc_t *const tmc = (fake_tmc_t *)fd;
+    uint8_t           r[24] = {0};
+
+    if ((type & 0x60) == 0) {
+        /* CLEAR_FEATURE(ENDPOINT_HALT) */
+        if (req == 1 && (type & 0x1F) == USBH_REQTYPE_RECIP_ENDPOINT) {
+            if (index == EP_BULK_IN)
+                tmc->stall_in = false;
+            return USBH_URBSTATUS_OK;
+        }
+        return USBH_URBSTATUS_STALL;
+    }
+
+    r[0] = USBH_TMC_STATUS_SUCCESS;
+    switch (req) {
+        case TMC_INITIATE_ABORT_BULK_OUT:
+            tmc->counters.aborts_out++;
+            if (!tmc->msg_len && !tmc->cmd_len) {
+                r[0] = USBH_TMC_STATUS_TRANSFER_NOT_IN_PROGRESS;
+            } else if (value != tmc->out_tag) {
+                r[0] = USBH_TMC_STATUS_FAILED;
+            } else {
+                tmc->msg_len = 0;
+                tmc->cmd_len = 0;
+            }
+            r[1] = tmc->out_tag;
+            return _reply(buf, len, r, 2);
+        case TMC_CHECK_ABORT_BULK_OUT_STATUS:
+            return _reply(buf, len, r, 8);
+        case TMC_INITIATE_ABORT_BULK_IN:
+            tmc->counters.aborts_in++;
+            if (!tmc->req_pending && !tmc->nxfers && !tmc->stall_in) {
+                r[0] = USBH_TMC_STATUS_TRANSFER_NOT_IN_PROGRESS;
+            } else if (value != tmc->req_tag) {
+                r[0] = USBH_TMC_STATUS_FAILED;
+            } else {
+                const bool started = tmc->inq_pos != 0;
+                tmc->req_pending   = false;
+                tmc->stall_in      = false;
+                _flush_in(tmc);
+                _discard_answer(tmc);
+                /* A transfer cut off midway is ended with a short packet */
+                if (started)
+                    _queue_zlp(tmc);
+            }
+            r[1] = tmc->req_tag;
+            return _reply(buf, len, r, 2);
+        case TMC_CHECK_ABORT_BULK_IN_STATUS:
+            return _reply(buf, len, r, 8);
+        case TMC_INITIATE_CLEAR:
+            tmc->counters.clears++;
+            tmc->msg_len     = 0;
+            tmc->cmd_len     = 0;
+            tmc->req_pending = false;
+            tmc->stall_in    = false;
+            _flush_in(tmc);
+            _discard_answer(tmc);
+            return _reply(buf, len, r, 1);
+        case TMC_CHECK_CLEAR_STATUS:
+            return _reply(buf, len, r, 2);
+        case TMC_GET_CAPABILITIES:
+            r[2]  = 0x00;
+            r[3]  = 0x01; /* bcdUSBTMC 1.00 */
+            r[4]  = USBH_TMC_CAP_INDICATOR_PULSE;
+            r[5]  = tmc->cfg.termchar ? USBH_TMC_CAP_TERMCHAR : 0;
+            if (tmc->cfg.protocol == USBTMC_INTERFACE_PROTOCOL_USB488) {
+                r[12] = 0x00;
+                r[13] = 0x01; /* bcdUSB488 1.00 */
+                r[14] = USBH_TMC_USB488_CAP_488_2 |
+                        USBH_TMC_USB488_CAP_REN_CONTROL |
+                        USBH_TMC_USB488_CAP_TRIGGER;
+                r[15] = USBH_TMC_USB488_CAP_SCPI | USBH_TMC_USB488_CAP_RL1 |
+                        USBH_TMC_USB488_CAP_DT1;
+                if (tmc->cfg.sr1)
+                    r[15] |= USBH_TMC_USB488_CAP_SR1;
+            }
+            return _reply(buf, len, r, 24);
+        case TMC_INDICATOR_PULSE:
+        case TMC_REN_CONTROL:
+        case TMC_GO_TO_LOCAL:
+            return _reply(buf, len, r, 1);
+        case TMC_READ_STATUS_BYTE:
+            tmc->counters.stb_reads++;
+            r[1] = value;
+            if (tmc->cfg.int_mps && tmc->nnotify < FAKE_TMC_MAX_NOTIFY) {
+                tmc->notify[tmc->nnotify][0]   = 0x80 | (value & 0x7F);
+                tmc->notify[tmc->nnotify++][1] = tmc->stb;
+                tmc->notify_at                 = fake_usbh_now();
+            } else {
+                r[2] = tmc->stb;
+            }
+            return _reply(buf, len, r, 3);
+        default:
+            return USBH_URBSTATUS_STALL;
+    }
+}
+
+static const fake_device_ops_t fake_tmc_ops = {_out, _in_ready, _in, _control};
+
+/*===========================================================================*/
+/* Scope responder                                                           */
+/*===========================================================================*/
+
+/* Case insensitive match of a program header against its long form, which
+ * also accepts the short form: the leading capitals, e.g. "RST" for
+ * "RSTate" */
+static bool _header_is(const char *h, size_t n, const char *form) {
+    size_t shortlen = 0;
+    while (form[shortlen] && !islower((unsigned char)form[shortlen]))
+        shortlen++;
+    if (n != strlen(form) && n != shortlen)
+        return false;
+    for (size_t i = 0; i < n; i++) {
+        if (toupper((unsigned char)h[i]) != toupper((unsigned char)form[i]))
+            return false;
+    }
+    return true;
+}
+
+static size_t _append(char *answer, size_t pos, size_t max, const char *s,
+                      size_t n) {
+    if (pos + n > max)
+        n = max - pos;
+    memcpy(answer + pos, s, n);
+    return pos + n;
+}
+
+size_t fake_tmc_scope_responder(fake_tmc_t *tmc, const char *msg, size_t len,
+                                char *answer, size_t max) {
+    static const char *const state_names[] = {"STOP", "RUN", "SING"};
+    size_t                   pos           = 0;
+    bool                     first         = true;
+
+    /* Leave room for the terminator */
+    max--;
+    while (len) {
+        const char *unit = msg;
+        const char *end  = memchr(msg, ';', len);
+        size_t      n    = end ? (size_t)(end - msg) : len;
+        msg += n + (end ? 1 : 0);
+        len -= n + (end ? 1 : 0);
+
+        while (n && (isspace((unsigned char)*unit) || *unit == ':')) {
+            unit++;
+            n--;
+        }
+        while (n && isspace((unsigned char)unit[n - 1]))
+            n--;
+        size_t hlen = 0;
+        while (hlen < n && !isspace((unsigned char)unit[hlen]))
+            hlen++;
+        const bool    query = hlen && unit[hlen - 1] == '?';
+        const size_t  arg   = query ? strtoul(unit + hlen, NULL, 10) : 0;
+        char          text[64];
+        const char *  s = "0";
+        size_t        slen;
+
+        if (!query) {
+            if (_header_is(unit, hlen, "RUN"))
+                tmc->state = FAKE_TMC_RUNNING;
+            else if (_header_is(unit, hlen, "STOP"))
+                tmc->state = FAKE_TMC_STOPPED;
+            else if (_header_is(unit, hlen, "SINGle"))
+                tmc->state = FAKE_TMC_SINGLE;
+            continue;
+        }
+
+        if (!first)
+            pos = _append(answer, pos, max, ";", 1);
+        first = false;
+        if (_header_is(unit, hlen - 1, "*IDN")) {
+            s = tmc->cfg.idn;
+        } else if (_header_is(unit, hlen - 1, "*OPC")) {
+            s = "1";
+        } else if (_header_is(unit, hlen - 1, "RSTate")) {
+            s = state_names[tmc->state];
+        } else if (_header_is(unit, hlen - 1, "DATA")) {
+            /* n bytes including the final '\n', added below */
+            for (size_t i = 0; i + 1 < arg && pos < max; i++)
+                answer[pos++] = 'A' + i % 26;
+            continue;
+        } else if (_header_is(unit, hlen - 1, "CURVe")) {
+            int digits = snprintf(text, sizeof(text), "%zu", arg);
+            snprintf(text, sizeof(text), "#%d%zu", digits, arg);
+            pos = _append(answer, pos, max, text, strlen(text));
+            for (size_t i = 0; i < arg && pos < max; i++)
+                answer[pos++] = (char)(i * 7);
+            continue;
+        }
+        slen = strlen(s);
+        pos  = _append(answer, pos, max, s, slen);
+    }
+    if (!first)
+        answer[pos++] = '\n';
+    return pos;
+}
+
+/*===========================================================================*/
+/* Setup                                                                     */
+/*===========================================================================*/
+
+void fake_tmc_default_config(fake_tmc_config_t *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->idn      = "KEYSIGHT TECHNOLOGIES,DSO9404A,MY53020105,06.20.01002";
+    cfg->vid      = 0x2A8D;
+    cfg->pid      = 0x9004;
+    cfg->serial   = "MY53020105";
+    cfg->protocol = USBTMC_INTERFACE_PROTOCOL_USB488;
+    cfg->bulk_mps = 64;
+    cfg->int_mps  = 8;
+    cfg->sr1      = true;
+    cfg->termchar = true;
+    cfg->answer_us = 500;
+}
+
+static uint8_t *_ep_desc(uint8_t *p, uint8_t address, uint8_t type,
+                         uint16_t mps, uint8_t interval) {
+    p[0] = 7;
+    p[1] = USBH_DT_ENDPOINT;
+    p[2] = address;
+    p[3] = type;
+    p[4] = mps;
+    p[5] = mps >> 8;
+    p[6] = interval;
+    return p + 7;
+}
+
+void fake_tmc_init(fake_tmc_t *tmc, const fake_tmc_config_t *cfg) {
+    memset(tmc, 0, sizeof(*tmc));
+    tmc->cfg         = *cfg;
+    tmc->base.ops    = &fake_tmc_ops;
+    tmc->base.serial = cfg->serial;
+    tmc->responder   = fake_tmc_scope_responder;
+
+    usbh_device_descriptor_t *const d = &tmc->base.dev.devDesc;
+    d->bLength                        = sizeof(*d);
+    d->bDescriptorType                = USBH_DT_DEVICE;
+    d->bcdUSB                         = 0x0200;
+    d->bMaxPacketSize0                = 64;
+    d->idVendor                       = cfg->vid;
+    d->idProduct                      = cfg->pid;
+    d->iSerialNumber                  = 3;
+    d->bNumConfigurations             = 1;
+    tmc->base.dev.langID0             = 0x0409;
+
+    uint8_t *p = tmc->config_desc;
+    p[0]       = 9;
+    p[1]       = USBH_DT_INTERFACE;
+    p[4]       = cfg->int_mps ? 3 : 2;
+    p[5]       = USBTMC_INTERFACE_CLASS;
+    p[6]       = USBTMC_INTERFACE_SUBCLASS;
+    p[7]       = cfg->protocol;
+    p          = _ep_desc(p + 9, EP_BULK_OUT, USBH_EPTYPE_BULK,
+                          cfg->bulk_mps, 0);
+    p          = _ep_desc(p, EP_BULK_IN, USBH_EPTYPE_BULK, cfg->bulk_mps, 0);
+    if (cfg->int_mps)
+        p = _ep_desc(p, EP_INT_IN, USBH_EPTYPE_INT, cfg->int_mps, 8);
+    tmc->config_len = p - tmc->config_desc;
+}
+
+USBHTmcDriver *fake_tmc_attach(fake_tmc_t *tmc, const USBHTmcConfig *config) {
+    static bool initialized;
+    const usbh_classdriver_vmt_t *const vmt = usbhTmcClassDriverInfo.vmt;
+
+    if (!initialized) {
+        vmt->init();
+        initialized = true;
+    }
+    usbh_baseclassdriver_t *drv =
+        vmt->load(&tmc->base.dev, tmc->config_desc, tmc->config_len);
+    if (!drv)
+        return NULL;
+    /* As the USB host core does when a class driver takes the device */
+    drv->dev = &tmc->base.dev;
+
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)drv;
+    usbhtmcStart(tmcp, config);
+    return tmcp;
+}
+
+void fake_tmc_detach(fake_tmc_t *tmc, USBHTmcDriver *tmcp) {
+    (void)tmc;
+    usbhTmcClassDriverInfo.vmt->unload((usbh_baseclassdriver_t *)tmcp);
+    tmcp->dev = NULL;
+}
+
+void fake_tmc_fault(fake_tmc_t *tmc, fake_tmc_fault_t fault, uint32_t param) {
+    tmc->fault       = fault;
+    tmc->fault_param = param;
+}
+
+void fake_tmc_srq(fake_tmc_t *tmc, uint8_t stb) {
+    if (tmc->nnotify < FAKE_TMC_MAX_NOTIFY) {
+        tmc->notify[tmc->nnotify][0]   = 0x81;
+        tmc->notify[tmc->nnotify++][1] = stb;
+        tmc->notify_at                 = fake_usbh_now();
+    }
+}
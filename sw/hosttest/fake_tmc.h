@@ -0,0 +1,177 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A scripted USBTMC/USB488 instrument on the simulated bus. It reassembles
+ * DEV_DEP_MSG_OUT messages, hands each complete one to a responder for the
+ * answer, and serves REQUEST_DEV_DEP_MSG_IN, the class requests and the
+ * interrupt endpoint the way the scopes in doc/captures do. One-shot faults
+ * mangle the next answer to exercise the driver's recovery.
+ */
+
+#ifndef FAKE_TMC_H
+#define FAKE_TMC_H
+
+#include "fake_usbh.h"
+#include "usbh_usbtmc.h"
+
+#define FAKE_TMC_MSG_MAX 4096
+#define FAKE_TMC_ANSWER_MAX (256 * 1024)
+#define FAKE_TMC_INQ_MAX (FAKE_TMC_ANSWER_MAX + 1024)
+#define FAKE_TMC_MAX_XFERS 8
+#define FAKE_TMC_MAX_NOTIFY 8
+
+/* Applied to the next answer the device sends */
+typedef enum {
+    FAKE_TMC_FAULT_NONE = 0,
+    /* bTagInverse does not match bTag */
+    FAKE_TMC_FAULT_BAD_TAG,
+    /* A leftover answer to the request before goes out first */
+    FAKE_TMC_FAULT_STALE_TAG,
+    /* The transfer ends param bytes short of its dwTransferSize */
+    FAKE_TMC_FAULT_SHORT,
+    /* Bulk IN stalls instead of answering */
+    FAKE_TMC_FAULT_STALL,
+    /* The answer goes out param bytes per transfer, EOM on the last */
+    FAKE_TMC_FAULT_FRAGMENT,
+    /* The answer is ready param us later than usual */
+    FAKE_TMC_FAULT_DELAY,
+} fake_tmc_fault_t;
+
+typedef enum {
+    FAKE_TMC_STOPPED = 0,
+    FAKE_TMC_RUNNING,
+    FAKE_TMC_SINGLE,
+} fake_tmc_state_t;
+
+typedef struct fake_tmc fake_tmc_t;
+
+/* Answer a complete device dependent message; returns the answer length,
+ * 0 for a command without one */
+typedef size_t (*fake_tmc_responder_t)(fake_tmc_t *tmc, const char *msg,
+                                       size_t len, char *answer, size_t max);
+
+typedef struct {
+    const char *idn;
+    uint16_t    vid;
+    uint16_t    pid;
+    const char *serial;
+    uint8_t     protocol;     /* USBTMC_INTERFACE_PROTOCOL_* */
+    uint16_t    bulk_mps;     /* 64 at full speed */
+    uint16_t    int_mps;      /* 0 for no interrupt endpoint */
+    bool        sr1;          /* reports SR1, so can raise SRQs */
+    bool        termchar;     /* honours TermChar requests */
+    uint32_t    answer_us;    /* message received to answer ready */
+    uint32_t    max_transfer; /* payload limit per transfer, 0 for none */
+} fake_tmc_config_t;
+
+typedef struct {
+    uint32_t messages;    /* complete device dependent messages */
+    uint32_t queries;     /* ...that produced an answer */
+    uint32_t interrupted; /* answers discarded unread by a new message */
+    uint32_t requests;    /* REQUEST_DEV_DEP_MSG_IN */
+    uint32_t transfers;   /* DEV_DEP_MSG_IN sent */
+    uint32_t triggers;
+    uint32_t aborts_out;
+    uint32_t aborts_in;
+    uint32_t clears;
+    uint32_t stb_reads;
+    uint32_t bad_messages;
+} fake_tmc_counters_t;
+
+struct fake_tmc {
+    fake_device_t        base;
+    fake_tmc_config_t    cfg;
+    fake_tmc_responder_t responder;
+    fake_tmc_counters_t  counters;
+    uint8_t              config_desc[32];
+    uint16_t             config_len;
+
+    /* Bulk OUT bytes not yet making up a whole USBTMC message */
+    uint8_t  msg[FAKE_TMC_MSG_MAX];
+    uint32_t msg_len;
+    /* Device dependent message received so far, up to EOM */
+    char    cmd[FAKE_TMC_MSG_MAX + 1];
+    size_t  cmd_len;
+    uint8_t out_tag;
+    char    last_cmd[FAKE_TMC_MSG_MAX + 1];
+
+    /* Answer to the last query, sent as requests come in */
+    char     answer[FAKE_TMC_ANSWER_MAX];
+    size_t   answer_len;
+    size_t   answer_pos;
+    uint64_t answer_at;
+
+    /* Outstanding REQUEST_DEV_DEP_MSG_IN */
+    bool     req_pending;
+    uint8_t  req_tag;
+    uint32_t req_size;
+    bool     req_term;
+    uint8_t  req_termchar;
+
+    /* DEV_DEP_MSG_IN transfers queued on bulk IN */
+    uint8_t  inq[FAKE_TMC_INQ_MAX];
+    uint32_t inq_pos;
+    uint32_t inq_len;
+    uint32_t xfer_end[FAKE_TMC_MAX_XFERS];
+    unsigned nxfers;
+    uint64_t inq_at;
+    bool     stall_in;
+    uint64_t stall_at;
+
+    /* Interrupt IN notifications */
+    uint8_t  notify[FAKE_TMC_MAX_NOTIFY][2];
+    unsigned nnotify;
+    uint64_t notify_at;
+    uint8_t  stb;
+
+    fake_tmc_fault_t fault;
+    uint32_t         fault_param;
+    bool             fragmenting;
+
+    /* State of the default scope responder */
+    fake_tmc_state_t state;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* A USB488 scope at full speed with the DSO9404A's endpoints */
+void fake_tmc_default_config(fake_tmc_config_t *cfg);
+void fake_tmc_init(fake_tmc_t *tmc, const fake_tmc_config_t *cfg);
+/* Enumerate: load the class driver on the device and start it */
+USBHTmcDriver *fake_tmc_attach(fake_tmc_t *tmc, const USBHTmcConfig *config);
+void           fake_tmc_detach(fake_tmc_t *tmc, USBHTmcDriver *tmcp);
+void fake_tmc_fault(fake_tmc_t *tmc, fake_tmc_fault_t fault, uint32_t param);
+/* Queue an SRQ notification carrying stb */
+void fake_tmc_srq(fake_tmc_t *tmc, uint8_t stb);
+
+/*
+ * The default responder, a scope that knows *IDN?, *OPC?, RUN, STOP, SINGle
+ * and RSTate?, plus two queries for bulk tests: "DATA? <n>" answers n bytes
+ * of text ending in '\n', "CURVe? <n>" an IEEE 488.2 block of n bytes. Any
+ * other query answers "0".
+ */
+size_t fake_tmc_scope_responder(fake_tmc_t *tmc, const char *msg, size_t len,
+                                char *answer, size_t max);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAKE_TMC_H */
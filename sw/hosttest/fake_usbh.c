@@ -0,0 +1,653 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "fake_usbh.h"
+#include "chprintf.h"
+#include "usbh/internal.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+fake_usbh_stats_t fake_usbh_stats;
+SerialDriver      SD2;
+
+static uint64_t         now_us;
+static uint64_t         bus_free_us;
+static usbh_urb_t *     pending;
+static virtual_timer_t *timers;
+static int              lock_depth;
+static bool             verbose;
+
+/* The one thread a suspended reference can point at */
+static struct fake_thread {
+    msg_t msg;
+} main_thread;
+
+void fake_panic(const char *reason) {
+    fprintf(stderr, "panic at %llu us: %s\n", (unsigned long long)now_us,
+            reason);
+    abort();
+}
+
+void fake_usbh_reset(void) {
+    pending     = NULL;
+    timers      = NULL;
+    lock_depth  = 0;
+    bus_free_us = now_us;
+}
+
+uint64_t fake_usbh_now(void) {
+    return now_us;
+}
+
+void fake_usbh_verbose(bool on) {
+    verbose = on;
+}
+
+bool fake_usbh_is_verbose(void) {
+    return verbose;
+}
+
+unsigned fake_usbh_pending(void) {
+    unsigned n = 0;
+    for (usbh_urb_t *urb = pending; urb; urb = urb->fake_next)
+        n++;
+    return n;
+}
+
+/*===========================================================================*/
+/* Event loop                                                                */
+/*===========================================================================*/
+
+static uint32_t _packets(uint32_t len, uint16_t mps) {
+    return len ? (len + mps - 1) / mps : 1;
+}
+
+static uint64_t _max(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+/* Earliest time urb could complete, or FAKE_NEVER */
+static uint64_t _urb_done_at(usbh_urb_t *urb) {
+    usbh_ep_t *const     ep    = urb->ep;
+    fake_device_t *const fd    = fake_device_of(ep->device);
+    uint64_t             start = urb->fake_submit_us;
+    uint32_t             len   = urb->requestedLength;
+
+    if (ep->status != USBH_EPSTATUS_OPEN)
+        return start + FAKE_USBH_URB_US;
+    if (ep->in) {
+        uint32_t avail = 0;
+        uint64_t ready = fd->ops->in_ready(fd, ep, &avail);
+        if (ready == FAKE_NEVER)
+            return FAKE_NEVER;
+        start = _max(start, ready);
+        if (avail < len)
+            len = avail;
+    }
+    return _max(start, bus_free_us) + FAKE_USBH_URB_US +
+           FAKE_USBH_PACKET_US * _packets(len, ep->wMaxPacketSize);
+}
+
+static void _unlink_urb(usbh_urb_t *urb) {
+    for (usbh_urb_t **p = &pending; *p; p = &(*p)->fake_next) {
+        if (*p == urb) {
+            *p = urb->fake_next;
+            break;
+        }
+    }
+    urb->fake_next = NULL;
+}
+
+/* Complete a URB from "interrupt" context, as the host controller would */
+static void _urb_complete(usbh_urb_t *urb, usbh_urbstatus_t status) {
+    _unlink_urb(urb);
+    urb->status = status;
+    lock_depth++;
+    if (urb->callback)
+        urb->callback(urb);
+    lock_depth--;
+}
+
+static void _urb_transfer(usbh_urb_t *urb) {
+    usbh_ep_t *const     ep = urb->ep;
+    fake_device_t *const fd = fake_device_of(ep->device);
+    usbh_urbstatus_t     status;
+
+    if (ep->status == USBH_EPSTATUS_HALTED) {
+        _urb_complete(urb, USBH_URBSTATUS_STALL);
+        return;
+    }
+    if (ep->status != USBH_EPSTATUS_OPEN) {
+        _urb_complete(urb, USBH_URBSTATUS_DISCONNECTED);
+        return;
+    }
+
+    bus_free_us = now_us;
+    if (ep->in) {
+        status = fd->ops->in(fd, ep, urb->buff, urb->requestedLength,
+                             &urb->actualLength);
+        if (status == USBH_URBSTATUS_OK) {
+            fake_usbh_stats.bytes_in += urb->actualLength;
+            if (ep->type == USBH_EPTYPE_INT)
+                fake_usbh_stats.int_in++;
+            else
+                fake_usbh_stats.bulk_in++;
+        }
+    } else {
+        status = fd->ops->out(fd, ep, urb->buff, urb->requestedLength);
+        if (status == USBH_URBSTATUS_OK) {
+            urb->actualLength = urb->requestedLength;
+            fake_usbh_stats.bytes_out += urb->actualLength;
+            fake_usbh_stats.bulk_out++;
+        }
+    }
+    if (status == USBH_URBSTATUS_STALL)
+        ep->status = USBH_EPSTATUS_HALTED;
+    _urb_complete(urb, status);
+}
+
+static void _vt_unlink(virtual_timer_t *vtp) {
+    for (virtual_timer_t **p = &timers; *p; p = &(*p)->next) {
+        if (*p == vtp) {
+            *p = vtp->next;
+            break;
+        }
+    }
+    vtp->next  = NULL;
+    vtp->armed = false;
+}
+
+/* Handle the earliest event due by deadline. Returns false, with the clock
+ * moved to the deadline, if there was none. */
+static bool _step(uint64_t deadline) {
+    uint64_t         best     = FAKE_NEVER;
+    usbh_urb_t *     best_urb = NULL;
+    virtual_timer_t *best_vt  = NULL;
+
+    for (usbh_urb_t *urb = pending; urb; urb = urb->fake_next) {
+        /* Only the oldest URB on each endpoint can be moving */
+        bool behind = false;
+        for (usbh_urb_t *u = pending; u != urb; u = u->fake_next) {
+            if (u->ep == urb->ep) {
+                behind = true;
+                break;
+            }
+        }
+        if (behind)
+            continue;
+        uint64_t t = _urb_done_at(urb);
+        if (t < best) {
+            best     = t;
+            best_urb = urb;
+        }
+    }
+    for (virtual_timer_t *vt = timers; vt; vt = vt->next) {
+        if (vt->deadline_us < best) {
+            best     = vt->deadline_us;
+            best_urb = NULL;
+            best_vt  = vt;
+        }
+    }
+
+    if (best == FAKE_NEVER || best > deadline) {
+        if (deadline != FAKE_NEVER && deadline > now_us)
+            now_us = deadline;
+        return false;
+    }
+
+    now_us = _max(now_us, best);
+    if (best_urb) {
+        _urb_transfer(best_urb);
+    } else {
+        _vt_unlink(best_vt);
+        lock_depth++;
+        best_vt->func(best_vt->par);
+        lock_depth--;
+    }
+    return true;
+}
+
+static uint64_t _deadline(sysinterval_t timeout) {
+    return timeout == TIME_INFINITE ? FAKE_NEVER : now_us + TIME_I2US(timeout);
+}
+
+typedef bool (*_cond_t)(const void *arg);
+
+/* Run events until cond holds or the deadline passes */
+static bool _wait(_cond_t cond, const void *arg, uint64_t deadline) {
+    while (!cond(arg)) {
+        if (!_step(deadline)) {
+            if (deadline == FAKE_NEVER)
+                fake_panic("waiting forever with nothing in flight");
+            return cond(arg);
+        }
+    }
+    return true;
+}
+
+static bool _never(const void *arg) {
+    (void)arg;
+    return false;
+}
+
+void fake_usbh_run(uint64_t us) {
+    _wait(_never, NULL, now_us + us);
+}
+
+static bool _flag_set(const void *arg) {
+    return *(const volatile bool *)arg;
+}
+
+bool fake_usbh_run_until(const volatile bool *flag, uint64_t us) {
+    return _wait(_flag_set, (const void *)flag, now_us + us);
+}
+
+/*===========================================================================*/
+/* Kernel                                                                    */
+/*===========================================================================*/
+
+void chSysLock(void) {
+    lock_depth++;
+}
+
+void chSysUnlock(void) {
+    chDbgAssert(lock_depth > 0, "unlock without lock");
+    lock_depth--;
+}
+
+void chSysLockFromISR(void) {
+    chSysLock();
+}
+
+void chSysUnlockFromISR(void) {
+    chSysUnlock();
+}
+
+/* Thread context waits must not hold the lock, S class ones must */
+static void _check_thread(void) {
+    chDbgAssert(lock_depth == 0, "blocking with the system locked");
+}
+
+static void _check_locked(void) {
+    chDbgAssert(lock_depth > 0, "S class call without the lock");
+}
+
+rtcnt_t chSysGetRealtimeCounterX(void) {
+    return (rtcnt_t)(now_us * (STM32_HCLK / 1000000));
+}
+
+systime_t chVTGetSystemTimeX(void) {
+    return (systime_t)(now_us * CH_CFG_ST_FREQUENCY / 1000000);
+}
+
+void chVTObjectInit(virtual_timer_t *vtp) {
+    vtp->next  = NULL;
+    vtp->func  = NULL;
+    vtp->armed = false;
+}
+
+void chVTSetI(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+              void *par) {
+    chDbgCheck(delay != TIME_IMMEDIATE);
+    if (vtp->armed)
+        _vt_unlink(vtp);
+    vtp->deadline_us = _deadline(delay);
+    vtp->func        = vtfunc;
+    vtp->par         = par;
+    vtp->armed       = true;
+    vtp->next        = timers;
+    timers           = vtp;
+}
+
+void chVTSet(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+             void *par) {
+    chSysLock();
+    chVTSetI(vtp, delay, vtfunc, par);
+    chSysUnlock();
+}
+
+void chVTResetI(virtual_timer_t *vtp) {
+    if (vtp->armed)
+        _vt_unlink(vtp);
+}
+
+void chVTReset(virtual_timer_t *vtp) {
+    chSysLock();
+    chVTResetI(vtp);
+    chSysUnlock();
+}
+
+bool chVTIsArmedI(const virtual_timer_t *vtp) {
+    return vtp->armed;
+}
+
+void chSemObjectInit(semaphore_t *sp, cnt_t n) {
+    sp->cnt = n;
+}
+
+static bool _sem_available(const void *arg) {
+    return ((const semaphore_t *)arg)->cnt > 0;
+}
+
+msg_t chSemWaitTimeout(semaphore_t *sp, sysinterval_t timeout) {
+    _check_thread();
+    if (!_wait(_sem_available, sp, _deadline(timeout)))
+        return MSG_TIMEOUT;
+    sp->cnt--;
+    return MSG_OK;
+}
+
+msg_t chSemWait(semaphore_t *sp) {
+    return chSemWaitTimeout(sp, TIME_INFINITE);
+}
+
+void chSemSignalI(semaphore_t *sp) {
+    sp->cnt++;
+}
+
+void chSemSignal(semaphore_t *sp) {
+    chSemSignalI(sp);
+}
+
+void chMtxLock(mutex_t *mp) {
+    chDbgAssert(!mp->locked, "mutex deadlock");
+    mp->locked = true;
+}
+
+void chMtxUnlock(mutex_t *mp) {
+    chDbgAssert(mp->locked, "mutex not locked");
+    mp->locked = false;
+}
+
+void chThdSleep(sysinterval_t time) {
+    _check_thread();
+    _wait(_never, NULL, _deadline(time));
+}
+
+static bool _resumed(const void *arg) {
+    return *(const thread_reference_t *)arg == NULL;
+}
+
+msg_t osalThreadSuspendTimeoutS(thread_reference_t *trp,
+                                sysinterval_t       timeout) {
+    _check_locked();
+    *trp             = &main_thread;
+    main_thread.msg  = MSG_TIMEOUT;
+    if (!_wait(_resumed, trp, _deadline(timeout)))
+        *trp = NULL;
+    return main_thread.msg;
+}
+
+void osalThreadResumeI(thread_reference_t *trp, msg_t msg) {
+    if (*trp) {
+        (*trp)->msg = msg;
+        *trp        = NULL;
+    }
+}
+
+/*===========================================================================*/
+/* USB host                                                                  */
+/*===========================================================================*/
+
+void usbhEPObjectInit(usbh_ep_t *ep, usbh_device_t *dev,
+                      const usbh_endpoint_descriptor_t *desc) {
+    ep->device         = dev;
+    ep->type           = (usbh_eptype_t)(desc->bmAttributes & 3);
+    ep->address        = desc->bEndpointAddress & 0x0F;
+    ep->in             = (desc->bEndpointAddress & 0x80) != 0;
+    ep->wMaxPacketSize = desc->wMaxPacketSize;
+    ep->status         = USBH_EPSTATUS_CLOSED;
+    ep->name           = "";
+}
+
+void usbhEPOpen(usbh_ep_t *ep) {
+    chDbgAssert(ep->status == USBH_EPSTATUS_CLOSED, "endpoint not closed");
+    ep->status = USBH_EPSTATUS_OPEN;
+}
+
+void usbhEPClose(usbh_ep_t *ep) {
+    chSysLock();
+    for (usbh_urb_t *urb = pending; urb;) {
+        usbh_urb_t *next = urb->fake_next;
+        if (urb->ep == ep)
+            _urb_complete(urb, USBH_URBSTATUS_DISCONNECTED);
+        urb = next;
+    }
+    chSysUnlock();
+    ep->status = USBH_EPSTATUS_CLOSED;
+}
+
+/* CLEAR_FEATURE(ENDPOINT_HALT), passed on to the device */
+bool usbhEPReset(usbh_ep_t *ep) {
+    usbh_urbstatus_t status = usbhControlRequest(
+        ep->device, USBH_REQTYPE_RECIP_ENDPOINT, 1, 0,
+        ep->address | (ep->in ? 0x80 : 0), 0, NULL);
+    if (status != USBH_URBSTATUS_OK)
+        return HAL_FAILED;
+    fake_usbh_stats.ep_resets++;
+    if (ep->status == USBH_EPSTATUS_HALTED)
+        ep->status = USBH_EPSTATUS_OPEN;
+    return HAL_SUCCESS;
+}
+
+void usbhEPSetName(usbh_ep_t *ep, const char *name) {
+    ep->name = name;
+}
+
+void usbhURBObjectInit(usbh_urb_t *urb, usbh_ep_t *ep,
+                       usbh_completion_cb callback, void *user, void *buff,
+                       uint32_t len) {
+    chDbgAssert(urb->status != USBH_URBSTATUS_PENDING, "URB still pending");
+    urb->ep              = ep;
+    urb->callback        = callback;
+    urb->userData        = user;
+    urb->buff            = buff;
+    urb->requestedLength = len;
+    urb->actualLength    = 0;
+    urb->status          = USBH_URBSTATUS_INITIALIZED;
+    urb->fake_next       = NULL;
+}
+
+void usbhURBObjectResetI(usbh_urb_t *urb) {
+    chDbgAssert(urb->status != USBH_URBSTATUS_PENDING, "URB still pending");
+    urb->actualLength = 0;
+    urb->status       = USBH_URBSTATUS_INITIALIZED;
+}
+
+void usbhURBSubmitI(usbh_urb_t *urb) {
+    chDbgAssert(urb->status == USBH_URBSTATUS_INITIALIZED,
+                "URB not initialized");
+    urb->status         = USBH_URBSTATUS_PENDING;
+    urb->fake_submit_us = now_us;
+    urb->fake_next      = NULL;
+
+    usbh_urb_t **p = &pending;
+    while (*p)
+        p = &(*p)->fake_next;
+    *p = urb;
+}
+
+bool usbhURBCancelI(usbh_urb_t *urb) {
+    if (urb->status != USBH_URBSTATUS_PENDING)
+        return false;
+    fake_usbh_stats.cancels++;
+    urb->actualLength = 0;
+    _urb_complete(urb, USBH_URBSTATUS_CANCELLED);
+    return true;
+}
+
+void usbhURBCancelAndWaitS(usbh_urb_t *urb) {
+    _check_locked();
+    usbhURBCancelI(urb);
+}
+
+static bool _urb_done(const void *arg) {
+    return ((const usbh_urb_t *)arg)->status != USBH_URBSTATUS_PENDING;
+}
+
+msg_t usbhURBWaitTimeoutS(usbh_urb_t *urb, systime_t timeout) {
+    _check_locked();
+    /* Completions run as if from an ISR, which takes the lock itself */
+    const int depth = lock_depth;
+    lock_depth      = 0;
+    bool done       = _wait(_urb_done, urb, _deadline(timeout));
+    lock_depth      = depth;
+    return done ? MSG_OK : MSG_TIMEOUT;
+}
+
+usbh_urbstatus_t usbhBulkTransfer(usbh_ep_t *ep, void *data, uint32_t len,
+                                  uint32_t *actual, systime_t timeout) {
+    usbh_urb_t urb = {0};
+
+    _check_thread();
+    usbhURBObjectInit(&urb, ep, NULL, NULL, data, len);
+    chSysLock();
+    usbhURBSubmitI(&urb);
+    msg_t msg = usbhURBWaitTimeoutS(&urb, timeout);
+    if (msg == MSG_TIMEOUT)
+        usbhURBCancelAndWaitS(&urb);
+    chSysUnlock();
+    if (actual)
+        *actual = urb.actualLength;
+    return msg == MSG_TIMEOUT ? USBH_URBSTATUS_TIMEOUT : urb.status;
+}
+
+usbh_urbstatus_t usbhControlRequest(usbh_device_t *dev, uint8_t bmRequestType,
+                                    uint8_t bRequest, uint16_t wValue,
+                                    uint16_t wIndex, uint16_t wLength,
+                                    uint8_t *buff) {
+    fake_device_t *const fd = fake_device_of(dev);
+
+    _check_thread();
+    /* The control pipe holds the bus for the whole transfer */
+    const uint64_t done = _max(now_us, bus_free_us) + FAKE_USBH_CONTROL_US;
+    bus_free_us         = done;
+    _wait(_never, NULL, done);
+    fake_usbh_stats.control++;
+    return fd->ops->control(fd, bmRequestType, bRequest, wValue, wIndex,
+                            wLength, buff);
+}
+
+bool usbhDeviceReadString(usbh_device_t *dev, char *dest, uint8_t size,
+                          uint8_t index, uint16_t langID) {
+    const fake_device_t *const fd = fake_device_of(dev);
+
+    (void)langID;
+    if (!size || !fd->serial || index != dev->devDesc.iSerialNumber)
+        return HAL_FAILED;
+    snprintf(dest, size, "%s", fd->serial);
+    return HAL_SUCCESS;
+}
+
+/*===========================================================================*/
+/* Descriptors                                                               */
+/*===========================================================================*/
+
+bool _usbh_match_descriptor(const uint8_t *descriptor, uint16_t rem,
+                            int16_t type, int16_t _class, int16_t subclass,
+                            int16_t protocol) {
+    if (rem < 2 || descriptor[0] > rem || descriptor[1] != type)
+        return HAL_FAILED;
+    if (type == USBH_DT_INTERFACE) {
+        const usbh_interface_descriptor_t *const ifdesc =
+            (const usbh_interface_descriptor_t *)descriptor;
+        if ((_class >= 0 && ifdesc->bInterfaceClass != _class) ||
+            (subclass >= 0 && ifdesc->bInterfaceSubClass != subclass) ||
+            (protocol >= 0 && ifdesc->bInterfaceProtocol != protocol))
+            return HAL_FAILED;
+    }
+    return HAL_SUCCESS;
+}
+
+/* Step to the next endpoint descriptor of the interface, stopping at the
+ * next interface */
+static void _ep_iter_find(generic_iterator_t *ep) {
+    while (ep->rem >= 2 && ep->curr[0] >= 2 && ep->curr[0] <= ep->rem) {
+        if (ep->curr[1] == USBH_DT_INTERFACE)
+            break;
+        if (ep->curr[1] == USBH_DT_ENDPOINT) {
+            ep->valid = true;
+            return;
+        }
+        ep->rem -= ep->curr[0];
+        ep->curr += ep->curr[0];
+    }
+    ep->valid = false;
+}
+
+void ep_iter_init(generic_iterator_t *ep, const if_iterator_t *iif) {
+    ep->curr = iif->curr;
+    ep->rem  = iif->rem;
+    ep->valid = false;
+    if (ep->rem < 2 || ep->curr[0] > ep->rem)
+        return;
+    /* Skip the interface descriptor itself */
+    ep->rem -= ep->curr[0];
+    ep->curr += ep->curr[0];
+    _ep_iter_find(ep);
+}
+
+void ep_iter_next(generic_iterator_t *ep) {
+    ep->rem -= ep->curr[0];
+    ep->curr += ep->curr[0];
+    _ep_iter_find(ep);
+}
+
+/*===========================================================================*/
+/* Console                                                                   */
+/*===========================================================================*/
+
+void usbDbgPrintf(const char *fmt, ...) {
+    va_list ap;
+    if (!verbose)
+        return;
+    va_start(ap, fmt);
+    printf("    [usbh] ");
+    vprintf(fmt, ap);
+    printf("\n");
+    va_end(ap);
+}
+
+void usbDbgPuts(const char *s) {
+    if (verbose)
+        printf("    [usbh] %s\n", s);
+}
+
+int chprintf(BaseSequentialStream *chp, const char *fmt, ...) {
+    va_list ap;
+    int     n = 0;
+    (void)chp;
+    if (!verbose)
+        return 0;
+    va_start(ap, fmt);
+    n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int chsnprintf(char *str, size_t size, const char *fmt, ...) {
+    va_list ap;
+    int     n;
+    va_start(ap, fmt);
+    n = vsnprintf(str, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
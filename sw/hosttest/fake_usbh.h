@@ -0,0 +1,101 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulated USB host for running firmware sources on a workstation. URBs
+ * complete against fake devices on a virtual microsecond clock, which only
+ * advances while the (single) thread waits, so runs are deterministic and
+ * a one second timeout costs no wall time. Transfers share one full speed
+ * bus, costed per URB and per packet.
+ */
+
+#ifndef FAKE_USBH_H
+#define FAKE_USBH_H
+
+#include "hal.h"
+
+#define FAKE_NEVER UINT64_MAX
+
+/* Bus costs in us: host controller overhead per URB, one 64 byte full speed
+ * packet, and a control transfer (setup, data and status stages) */
+#define FAKE_USBH_URB_US 20
+#define FAKE_USBH_PACKET_US 50
+#define FAKE_USBH_CONTROL_US 1000
+
+typedef struct fake_device fake_device_t;
+
+typedef struct {
+    /* An OUT URB's data reached the device. Returns the URB status. */
+    usbh_urbstatus_t (*out)(fake_device_t *fd, usbh_ep_t *ep,
+                            const uint8_t *buf, uint32_t len);
+    /* Time from which the device answers IN tokens on ep, with up to *avail
+     * bytes; FAKE_NEVER while it NAKs. Not clamped to the current time, so
+     * a URB waiting on data completes as soon as the data is ready. */
+    uint64_t (*in_ready)(fake_device_t *fd, usbh_ep_t *ep, uint32_t *avail);
+    /* Complete an IN URB of up to len bytes into buf */
+    usbh_urbstatus_t (*in)(fake_device_t *fd, usbh_ep_t *ep, uint8_t *buf,
+                           uint32_t len, uint32_t *actual);
+    /* Any control request, standard ones included. buf holds len bytes. */
+    usbh_urbstatus_t (*control)(fake_device_t *fd, uint8_t type, uint8_t req,
+                                uint16_t value, uint16_t index, uint16_t len,
+                                uint8_t *buf);
+} fake_device_ops_t;
+
+struct fake_device {
+    usbh_device_t            dev; /* first, see fake_device_of() */
+    const fake_device_ops_t *ops;
+    const char *             serial; /* string iSerialNumber */
+};
+
+#define fake_device_of(devp) ((fake_device_t *)(devp))
+
+/* Completed transfers, for counting transactions per operation */
+typedef struct {
+    uint32_t bulk_out;
+    uint32_t bulk_in;
+    uint32_t int_in;
+    uint32_t control;
+    uint32_t ep_resets;
+    uint32_t cancels;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+} fake_usbh_stats_t;
+
+extern fake_usbh_stats_t fake_usbh_stats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Drop all pending URBs and timers. The clock keeps running. */
+void     fake_usbh_reset(void);
+uint64_t fake_usbh_now(void);
+/* Let us microseconds pass, completing transfers and firing timers */
+void fake_usbh_run(uint64_t us);
+/* The same, stopping early once *flag is set; returns *flag */
+bool fake_usbh_run_until(const volatile bool *flag, uint64_t us);
+/* Print the firmware's debug output */
+void fake_usbh_verbose(bool on);
+bool fake_usbh_is_verbose(void);
+/* Number of URBs in flight */
+unsigned fake_usbh_pending(void);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FAKE_USBH_H */
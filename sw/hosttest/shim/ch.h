@@ -0,0 +1,131 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stand-in for the parts of the ChibiOS/RT API used by the firmware
+ * sources built in the host tests. There is a single thread; time only moves
+ * while it waits, as fake_usbh.c runs the simulated bus and timers forward.
+ */
+
+#ifndef CH_H
+#define CH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+/* As configured in the firmware's chconf.h */
+#define CH_CFG_ST_FREQUENCY 10000
+
+typedef uint32_t systime_t;
+typedef uint32_t sysinterval_t;
+typedef uint32_t rtcnt_t;
+typedef int32_t  msg_t;
+typedef int32_t  cnt_t;
+
+#define MSG_OK 0
+#define MSG_TIMEOUT -1
+#define MSG_RESET -2
+
+#define TIME_IMMEDIATE ((sysinterval_t)0)
+#define TIME_INFINITE ((sysinterval_t)-1)
+
+#define TIME_MS2I(msecs)                                                       \
+    ((sysinterval_t)((((uint64_t)(msecs) * CH_CFG_ST_FREQUENCY) + 999) / 1000))
+#define TIME_US2I(usecs)                                                       \
+    ((sysinterval_t)((((uint64_t)(usecs) * CH_CFG_ST_FREQUENCY) + 999999) /    \
+                     1000000))
+#define TIME_I2US(interval)                                                    \
+    ((uint64_t)(interval) * 1000000 / CH_CFG_ST_FREQUENCY)
+
+/* The realtime counter runs at the core clock, as on the STM32F401 */
+#define STM32_HCLK 84000000
+#define RTC2US(freq, n) ((((n)-1UL) / ((freq) / 1000000UL)) + 1UL)
+
+typedef struct {
+    cnt_t cnt;
+} semaphore_t;
+
+typedef struct {
+    bool locked;
+} mutex_t;
+
+#define MUTEX_DECL(name) mutex_t name = {false}
+
+typedef void (*vtfunc_t)(void *p);
+
+typedef struct virtual_timer {
+    struct virtual_timer *next;
+    uint64_t              deadline_us;
+    vtfunc_t              func;
+    void *                par;
+    bool                  armed;
+} virtual_timer_t;
+
+typedef struct fake_thread *thread_reference_t;
+
+/* Failed assertions end the test run */
+void fake_panic(const char *reason);
+
+#define chDbgAssert(c, r)                                                      \
+    do {                                                                       \
+        if (!(c))                                                              \
+            fake_panic(r);                                                     \
+    } while (0)
+#define chDbgCheck(c) chDbgAssert(c, #c)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void      chSysLock(void);
+void      chSysUnlock(void);
+void      chSysLockFromISR(void);
+void      chSysUnlockFromISR(void);
+rtcnt_t   chSysGetRealtimeCounterX(void);
+systime_t chVTGetSystemTimeX(void);
+void      chVTObjectInit(virtual_timer_t *vtp);
+void chVTSetI(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+              void *par);
+void chVTSet(virtual_timer_t *vtp, sysinterval_t delay, vtfunc_t vtfunc,
+             void *par);
+void  chVTResetI(virtual_timer_t *vtp);
+void  chVTReset(virtual_timer_t *vtp);
+bool  chVTIsArmedI(const virtual_timer_t *vtp);
+void  chSemObjectInit(semaphore_t *sp, cnt_t n);
+msg_t chSemWait(semaphore_t *sp);
+msg_t chSemWaitTimeout(semaphore_t *sp, sysinterval_t timeout);
+void  chSemSignal(semaphore_t *sp);
+void  chSemSignalI(semaphore_t *sp);
+void  chMtxLock(mutex_t *mp);
+void  chMtxUnlock(mutex_t *mp);
+void  chThdSleep(sysinterval_t time);
+#ifdef __cplusplus
+}
+#endif
+
+#define chThdSleepMilliseconds(msec) chThdSleep(TIME_MS2I(msec))
+
+#endif /* CH_H */
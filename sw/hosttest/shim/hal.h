@@ -0,0 +1,68 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stand-in for the HAL: the OSAL mapped onto the ch.h shim, the
+ * debug console and the USB host layer in hal_usbh.h */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include "ch.h"
+#include "halconf.h"
+
+#define HAL_SUCCESS false
+#define HAL_FAILED true
+
+#define osalDbgCheck(c) chDbgCheck(c)
+#define osalDbgAssert(c, r) chDbgAssert(c, r)
+#define osalSysLock() chSysLock()
+#define osalSysUnlock() chSysUnlock()
+#define osalSysLockFromISR() chSysLockFromISR()
+#define osalSysUnlockFromISR() chSysUnlockFromISR()
+#define osalOsRescheduleS()                                                    \
+    do {                                                                       \
+    } while (0)
+#define osalThreadSleepMilliseconds(msec) chThdSleepMilliseconds(msec)
+
+/* Console output goes to stdout when the test asks for it, see
+ * fake_usbh_verbose() */
+typedef struct {
+    int unused;
+} BaseSequentialStream;
+
+typedef struct {
+    BaseSequentialStream stream;
+} SerialDriver;
+
+extern SerialDriver SD2;
+#define CON ((BaseSequentialStream *)&SD2)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+msg_t osalThreadSuspendTimeoutS(thread_reference_t *trp,
+                                sysinterval_t       timeout);
+void  osalThreadResumeI(thread_reference_t *trp, msg_t msg);
+#ifdef __cplusplus
+}
+#endif
+
+#include "hal_usbh.h"
+
+#endif /* HAL_H */
@@ -0,0 +1,209 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host stand-in for the ChibiOS-Contrib USB host layer. Types and calls keep
+ * their upstream names and meaning; URBs are completed by the simulated bus
+ * in fake_usbh.c, against whichever fake device owns the endpoint.
+ */
+
+#ifndef HAL_USBH_H
+#define HAL_USBH_H
+
+#include "hal.h"
+
+#define USBH_DEFINE_BUFFER(var) __attribute__((aligned(4))) var
+
+#define USBH_DT_DEVICE 1
+#define USBH_DT_CONFIG 2
+#define USBH_DT_STRING 3
+#define USBH_DT_INTERFACE 4
+#define USBH_DT_ENDPOINT 5
+
+#define USBH_REQTYPE_DIR_IN 0x80
+#define USBH_REQTYPE_DIR_OUT 0x00
+#define USBH_REQTYPE_TYPE_STANDARD 0x00
+#define USBH_REQTYPE_TYPE_CLASS 0x20
+#define USBH_REQTYPE_TYPE_VENDOR 0x40
+#define USBH_REQTYPE_RECIP_DEVICE 0x00
+#define USBH_REQTYPE_RECIP_INTERFACE 0x01
+#define USBH_REQTYPE_RECIP_ENDPOINT 0x02
+
+#define USBH_REQTYPE_CLASSIN(type)                                             \
+    (USBH_REQTYPE_DIR_IN | USBH_REQTYPE_TYPE_CLASS | (type))
+#define USBH_REQTYPE_CLASSOUT(type)                                            \
+    (USBH_REQTYPE_DIR_OUT | USBH_REQTYPE_TYPE_CLASS | (type))
+
+typedef enum {
+    USBH_EPTYPE_CTRL = 0,
+    USBH_EPTYPE_ISO  = 1,
+    USBH_EPTYPE_BULK = 2,
+    USBH_EPTYPE_INT  = 3,
+} usbh_eptype_t;
+
+typedef enum {
+    USBH_EPSTATUS_UNINITIALIZED = 0,
+    USBH_EPSTATUS_CLOSED,
+    USBH_EPSTATUS_OPEN,
+    USBH_EPSTATUS_HALTED,
+} usbh_epstatus_t;
+
+typedef enum {
+    USBH_URBSTATUS_UNINITIALIZED = 0,
+    USBH_URBSTATUS_INITIALIZED,
+    USBH_URBSTATUS_PENDING,
+    USBH_URBSTATUS_ERROR,
+    USBH_URBSTATUS_TIMEOUT,
+    USBH_URBSTATUS_CANCELLED,
+    USBH_URBSTATUS_STALL,
+    USBH_URBSTATUS_DISCONNECTED,
+    USBH_URBSTATUS_OK,
+} usbh_urbstatus_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t bcdUSB;
+    uint8_t  bDeviceClass;
+    uint8_t  bDeviceSubClass;
+    uint8_t  bDeviceProtocol;
+    uint8_t  bMaxPacketSize0;
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t  iManufacturer;
+    uint8_t  iProduct;
+    uint8_t  iSerialNumber;
+    uint8_t  bNumConfigurations;
+} usbh_device_descriptor_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t bLength;
+    uint8_t bDescriptorType;
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+} usbh_interface_descriptor_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bEndpointAddress;
+    uint8_t  bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t  bInterval;
+} usbh_endpoint_descriptor_t;
+
+typedef struct usbh_device usbh_device_t;
+typedef struct usbh_ep     usbh_ep_t;
+typedef struct usbh_urb    usbh_urb_t;
+
+typedef void (*usbh_completion_cb)(usbh_urb_t *urb);
+
+struct usbh_ep {
+    usbh_device_t * device;
+    usbh_eptype_t   type;
+    usbh_epstatus_t status;
+    uint8_t         address; /* without the direction bit */
+    bool            in;
+    uint16_t        wMaxPacketSize;
+    const char *    name;
+};
+
+struct usbh_urb {
+    usbh_ep_t *         ep;
+    void *              userData;
+    usbh_completion_cb  callback;
+    void *              buff;
+    uint32_t            requestedLength;
+    uint32_t            actualLength;
+    usbh_urbstatus_t    status;
+    /* Simulated bus bookkeeping */
+    struct usbh_urb *   fake_next;
+    uint64_t            fake_submit_us;
+};
+
+struct usbh_device {
+    usbh_device_descriptor_t devDesc;
+    uint16_t                 langID0;
+    usbh_ep_t                ctrl;
+};
+
+typedef struct usbh_baseclassdriver usbh_baseclassdriver_t;
+
+typedef struct {
+    void (*init)(void);
+    usbh_baseclassdriver_t *(*load)(usbh_device_t *dev,
+                                    const uint8_t *descriptor, uint16_t rem);
+    void (*unload)(usbh_baseclassdriver_t *drv);
+} usbh_classdriver_vmt_t;
+
+typedef struct {
+    const char *                  name;
+    const usbh_classdriver_vmt_t *vmt;
+} usbh_classdriverinfo_t;
+
+#define _usbh_base_classdriver_data                                            \
+    const usbh_classdriverinfo_t *info;                                        \
+    usbh_device_t *               dev;                                         \
+    usbh_baseclassdriver_t *      next;
+
+struct usbh_baseclassdriver {
+    _usbh_base_classdriver_data
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void usbhEPObjectInit(usbh_ep_t *ep, usbh_device_t *dev,
+                      const usbh_endpoint_descriptor_t *desc);
+void usbhEPOpen(usbh_ep_t *ep);
+void usbhEPClose(usbh_ep_t *ep);
+bool usbhEPReset(usbh_ep_t *ep);
+void usbhEPSetName(usbh_ep_t *ep, const char *name);
+
+void  usbhURBObjectInit(usbh_urb_t *urb, usbh_ep_t *ep,
+                        usbh_completion_cb callback, void *user, void *buff,
+                        uint32_t len);
+void  usbhURBObjectResetI(usbh_urb_t *urb);
+void  usbhURBSubmitI(usbh_urb_t *urb);
+bool  usbhURBCancelI(usbh_urb_t *urb);
+void  usbhURBCancelAndWaitS(usbh_urb_t *urb);
+msg_t usbhURBWaitTimeoutS(usbh_urb_t *urb, systime_t timeout);
+
+usbh_urbstatus_t usbhBulkTransfer(usbh_ep_t *ep, void *data, uint32_t len,
+                                  uint32_t *actual, systime_t timeout);
+usbh_urbstatus_t usbhControlRequest(usbh_device_t *dev, uint8_t bmRequestType,
+                                    uint8_t bRequest, uint16_t wValue,
+                                    uint16_t wIndex, uint16_t wLength,
+                                    uint8_t *buff);
+bool usbhDeviceReadString(usbh_device_t *dev, char *dest, uint8_t size,
+                          uint8_t index, uint16_t langID);
+
+void usbDbgPrintf(const char *fmt, ...);
+void usbDbgPuts(const char *s);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HAL_USBH_H */
@@ -0,0 +1,34 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* HAL configuration for the host tests, mirroring the firmware's halconf.h
+ * and halconf_community.h where the shimmed sources care */
+
+#ifndef HALCONF_H
+#define HALCONF_H
+
+#define HAL_USE_USBH TRUE
+#define HAL_USBH_USE_ADDITIONAL_CLASS_DRIVERS TRUE
+
+#define USBH_DEBUG_ENABLE_TRACE FALSE
+#define USBH_DEBUG_ENABLE_INFO FALSE
+#define USBH_DEBUG_ENABLE_WARNINGS TRUE
+#define USBH_DEBUG_ENABLE_ERRORS TRUE
+
+#endif /* HALCONF_H */
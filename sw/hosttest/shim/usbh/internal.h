@@ -0,0 +1,55 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Host stand-in for the descriptor helpers class drivers use to parse a
+ * configuration descriptor */
+
+#ifndef USBH_INTERNAL_H
+#define USBH_INTERNAL_H
+
+#include "hal_usbh.h"
+
+typedef struct {
+    uint16_t       rem;
+    const uint8_t *curr;
+    bool           valid;
+} generic_iterator_t;
+
+typedef struct {
+    uint16_t       rem;
+    const uint8_t *curr;
+    bool           valid;
+    const void *   iad;
+} if_iterator_t;
+
+#define ep_get(it) ((const usbh_endpoint_descriptor_t *)(it)->curr)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void ep_iter_init(generic_iterator_t *ep, const if_iterator_t *iif);
+void ep_iter_next(generic_iterator_t *ep);
+bool _usbh_match_descriptor(const uint8_t *descriptor, uint16_t rem,
+                            int16_t type, int16_t _class, int16_t subclass,
+                            int16_t protocol);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USBH_INTERNAL_H */
@@ -0,0 +1,589 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The SCPI response parsing of scope.c, built from the firmware source so
+ * its static functions are in reach. The instrument answers captured in
+ * doc/captures go through scpi_split(), the profile lookup and the state
+ * rules, then a fuzz corpus mutated from those answers is checked against
+ * reference models of the split and the mnemonic match.
+ */
+
+#include "scope.c"
+
+#include "captures.h"
+#include "fake_flash.h"
+#include "fake_tmc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures;
+
+#define CHECK(c)                                                               \
+    do {                                                                       \
+        if (!(c)) {                                                            \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #c);              \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+#define MAX_MSGS 64
+#define ARRAY_LEN(a) (sizeof(a) / sizeof((a)[0]))
+
+static capture_msg_t msgs[MAX_MSGS];
+
+static bool span_is(scpi_span_t field, const char *str) {
+    return field.len == strlen(str) && !memcmp(field.ptr, str, field.len);
+}
+
+/* The first default profile for vendor */
+static const scope_config_t *profile_for(const char *vendor) {
+    const struct scope_profile_table *table = scope_profiles();
+
+    for (size_t i = 0; table && i < table->count; i++) {
+        if (!strcmp(table->profiles[i].vendor, vendor)) {
+            return &table->profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/* The answer to the query at msgs[i], or NULL */
+static const capture_msg_t *answer_to(size_t i, size_t count) {
+    return i + 1 < count && !msgs[i].answer && msgs[i + 1].answer
+               ? &msgs[i + 1]
+               : NULL;
+}
+
+static void test_idn(void) {
+    static const struct {
+        const char *capture;
+        const char *vendor;
+        const char *fields[4];
+    } idns[] = {
+        {"dpo3034_idn.pcapng",
+         "TEKTRONIX",
+         {"TEKTRONIX", "DPO3054", "C010644", "CF:91.1CT FV:v2.40"}},
+        {"dso9404a_idn.pcapng",
+         "KEYSIGHT",
+         {"KEYSIGHT TECHNOLOGIES", "DSO9404A", "MY53020105", "06.20.01002"}},
+    };
+
+    for (size_t c = 0; c < ARRAY_LEN(idns); c++) {
+        size_t count = capture_read(idns[c].capture, msgs, MAX_MSGS);
+        size_t found = 0;
+
+        CHECK(count > 0);
+        for (size_t i = 0; i < count; i++) {
+            const capture_msg_t *ans = answer_to(i, count);
+            scpi_span_t          fields[4];
+
+            if (!ans || strcmp(msgs[i].text, "*IDN?")) {
+                continue;
+            }
+            found++;
+            CHECK(scpi_split(ans->text, ans->len, fields, 4) == 4);
+            for (size_t f = 0; f < 4; f++) {
+                CHECK(span_is(fields[f], idns[c].fields[f]));
+            }
+            CHECK(match_profile(fields) == profile_for(idns[c].vendor));
+            CHECK(scope_match_idn(ans->text, ans->len) ==
+                  profile_for(idns[c].vendor));
+        }
+        CHECK(found == 1);
+    }
+}
+
+static const struct {
+    const char *  answer;
+    scope_state_t state;
+} keysight_states[] = {
+    {"STOP\n", SCOPE_STATE_STOPPED},
+    {"RUN\n", SCOPE_STATE_RUNNING},
+    {"SING\n", SCOPE_STATE_SINGLE},
+};
+
+/* RSTate? answers with the Keysight rules, and every run/stop command the
+ * host sent matching one of the profile's state commands */
+static void test_keysight_runstop(void) {
+    const scope_config_t *cfg   = profile_for("KEYSIGHT");
+    size_t                count = capture_read("dso9404a_runstop.pcapng", msgs,
+                                MAX_MSGS);
+    size_t                states = 0, cmds = 0;
+
+    CHECK(cfg != NULL && count > 0);
+    if (!cfg) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const capture_msg_t *ans = answer_to(i, count);
+
+        if (msgs[i].answer) {
+            continue;
+        }
+        if (!strchr(msgs[i].text, '?')) {
+            scpi_span_t cmd   = {msgs[i].text, msgs[i].len};
+            bool        known = false;
+            for (size_t s = 0; s < SCOPE_PROFILE_NUM_STATES; s++) {
+                known = known || scpi_match(cfg->state_cmds[s], cmd);
+            }
+            CHECK(known);
+            cmds++;
+        } else if (ans && !strcmp(msgs[i].text, cfg->state_query)) {
+            size_t k = 0;
+            while (k < ARRAY_LEN(keysight_states) &&
+                   strcmp(keysight_states[k].answer, ans->text)) {
+                k++;
+            }
+            scope_state_t state;
+            CHECK(k < ARRAY_LEN(keysight_states));
+            CHECK(scope_parse_state(cfg, ans->text, ans->len, &state));
+            CHECK(k == ARRAY_LEN(keysight_states) ||
+                  state == keysight_states[k].state);
+            states++;
+        }
+    }
+    CHECK(states == 6 && cmds == 8);
+}
+
+/* ACQuire? answers all six fields; the profile asks for the first two only,
+ * so the answer to its query is rebuilt from those */
+static void test_tektronix_runstop(void) {
+    static const struct {
+        const char *  prefix;
+        scope_state_t state;
+    } expect[] = {
+        {"SEQUENCE;0;", SCOPE_STATE_STOPPED},
+        {"RUNSTOP;1;", SCOPE_STATE_RUNNING},
+        {"RUNSTOP;0;", SCOPE_STATE_STOPPED},
+    };
+    const scope_config_t *cfg   = profile_for("TEKTRONIX");
+    size_t                count = capture_read("dpo3034_runstop.pcapng", msgs,
+                                MAX_MSGS);
+    size_t                found = 0;
+
+    CHECK(cfg != NULL && count > 0);
+    if (!cfg) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const capture_msg_t *ans = answer_to(i, count);
+        scpi_span_t          fields[SCOPE_PROFILE_MAX_FIELDS], rest[2];
+        scope_state_t        state;
+        char                 resp[64];
+
+        if (!ans || strcmp(msgs[i].text, "ACQuire?")) {
+            continue;
+        }
+        found++;
+        CHECK(scpi_split(ans->text, ans->len, fields, 8) == 6);
+        CHECK(span_is(fields[2], "SAMPLE") && span_is(fields[5], "2.5000E+9"));
+
+        /* The last field takes the rest of the answer */
+        CHECK(scpi_split(ans->text, ans->len, rest, 2) == 2);
+        CHECK(rest[1].ptr == fields[1].ptr &&
+              rest[1].ptr + rest[1].len == fields[5].ptr + fields[5].len);
+        CHECK(!scope_parse_state(cfg, ans->text, ans->len, &state));
+
+        snprintf(resp, sizeof(resp), "%.*s;%.*s\n", (int)fields[0].len,
+                 fields[0].ptr, (int)fields[1].len, fields[1].ptr);
+        size_t k = 0;
+        while (k < ARRAY_LEN(expect) &&
+               strncmp(ans->text, expect[k].prefix, strlen(expect[k].prefix))) {
+            k++;
+        }
+        CHECK(k < ARRAY_LEN(expect));
+        CHECK(scope_parse_state(cfg, resp, strlen(resp), &state));
+        CHECK(k == ARRAY_LEN(expect) || state == expect[k].state);
+    }
+    CHECK(found == 4);
+}
+
+static void test_mnemonics(void) {
+    static const struct {
+        const char *mnemonic;
+        const char *field;
+        bool        match;
+    } cases[] = {
+        {"SINGle", "SINGle", true}, {"SINGle", "single", true},
+        {"SINGle", "SING", true},   {"SINGle", "sing", true},
+        {"SINGle", "SIN", false},   {"SINGle", "SINGL", false},
+        {"SINGle", "SINGLES", false}, {"SINGle", "", false},
+        {"RUNSTop", "RUNST", true}, {"RUNSTop", "RUNSTOP", true},
+        {"RUNSTop", "RUNS", false}, {"RUN", "RUN", true},
+        {"RUN", "RU", false},       {"0", "0", true},
+        {"0", "0.0", false},        {"", "", true},
+    };
+
+    for (size_t i = 0; i < ARRAY_LEN(cases); i++) {
+        scpi_span_t field = to_span(cases[i].field);
+        CHECK(scpi_match(cases[i].mnemonic, field) == cases[i].match);
+    }
+}
+
+/* A state command answered well past the round trip deadline, as scopes do
+ * when starting or stopping acquisition, still succeeds */
+static void test_slow_state_cmd(void) {
+    static const USBHTmcConfig tmc_config = {NULL};
+    const scope_config_t *     cfg        = profile_for("KEYSIGHT");
+    fake_tmc_t                 dev;
+    fake_tmc_config_t          dev_cfg;
+    scope_frames_t             frames;
+    scope_frames_t *           framesp = &frames;
+    scope_state_t              state, actual;
+
+    fake_usbh_reset();
+    fake_tmc_default_config(&dev_cfg);
+    fake_tmc_init(&dev, &dev_cfg);
+    USBHTmcDriver *tmcp = fake_tmc_attach(&dev, &tmc_config);
+    CHECK(tmcp != NULL && cfg != NULL);
+    if (!tmcp || !cfg) {
+        return;
+    }
+    CHECK(scope_encode_frames(cfg, &frames));
+
+    /* Quick answers bring the query deadline down to its floor */
+    for (int i = 0; i < 20; i++) {
+        CHECK(scope_get_state(tmcp, cfg, &state));
+    }
+    CHECK(usbhtmcTimeout(tmcp) < TIME_MS2I(100));
+
+    USBHTmcGroupWrite write = {.tmcp = tmcp};
+    fake_tmc_fault(&dev, FAKE_TMC_FAULT_DELAY, 200000);
+    CHECK(scope_set_state_group(&write, &cfg, &framesp, 1,
+                                SCOPE_STATE_RUNNING, &actual) == 1);
+    CHECK(write.ok && actual == SCOPE_STATE_RUNNING);
+    CHECK(tmcp->stats.timeouts == 0);
+    fake_tmc_detach(&dev, tmcp);
+}
+
+/* The reconnect cache log at the end of the profile region: store, lookup
+ * with the newest entry for a device winning, a full log, and the erase
+ * that comes with writing a profile table */
+static void test_cache(void) {
+    static const USBHTmcConfig        tmc_config = {NULL};
+    const struct scope_profile_table *table      = scope_profiles();
+    const cache_entry_t *             entry, *free_slot;
+    scope_cache_key_t                 key = {0x0699, 0x0410, 0x1234};
+
+    CHECK(table && table->count >= 4);
+    if (!table || table->count < 4) {
+        return;
+    }
+    fake_flash_init();
+    CHECK(!cache_find(&key, &free_slot) && free_slot == cache_entries());
+
+    scope_cache_store(&key, &table->profiles[0]);
+    entry = cache_find(&key, &free_slot);
+    CHECK(entry && entry->profile == 0 && free_slot == cache_entries() + 1);
+
+    /* The same profile again writes nothing, a new one is appended */
+    unsigned programs = fake_flash_programs;
+    scope_cache_store(&key, &table->profiles[0]);
+    CHECK(fake_flash_programs == programs);
+    scope_cache_store(&key, &table->profiles[3]);
+    entry = cache_find(&key, &free_slot);
+    CHECK(entry && entry->profile == 3 && free_slot == cache_entries() + 2);
+
+    /* Keyed on the device descriptor and the serial number string */
+    fake_tmc_t        dev;
+    fake_tmc_config_t dev_cfg;
+    scope_cache_key_t dev_key;
+    fake_usbh_reset();
+    fake_tmc_default_config(&dev_cfg);
+    fake_tmc_init(&dev, &dev_cfg);
+    USBHTmcDriver *tmcp = fake_tmc_attach(&dev, &tmc_config);
+    CHECK(tmcp != NULL);
+    if (tmcp) {
+        CHECK(scope_cache_lookup(tmcp, &dev_key) == NULL);
+        CHECK(dev_key.vid == dev_cfg.vid && dev_key.pid == dev_cfg.pid &&
+              dev_key.serial == hash_serial(dev_cfg.serial));
+        scope_cache_store(&dev_key, &table->profiles[1]);
+        CHECK(scope_cache_lookup(tmcp, &dev_key) == &table->profiles[1]);
+        fake_tmc_detach(&dev, tmcp);
+    }
+
+    /* Once the log is full new devices are not cached, known ones still
+     * are */
+    for (uint32_t n = 0; free_slot && n < CACHE_ENTRIES; n++) {
+        scope_cache_key_t filler = {0x1234, 0x5678, n};
+        scope_cache_store(&filler, &table->profiles[2]);
+        cache_find(&key, &free_slot);
+    }
+    entry = cache_find(&key, &free_slot);
+    CHECK(entry && entry->profile == 3 && !free_slot);
+    scope_cache_key_t late = {0x1AB1, 0x0588, 1};
+    programs              = fake_flash_programs;
+    scope_cache_store(&late, &table->profiles[0]);
+    CHECK(fake_flash_programs == programs && !cache_find(&late, &free_slot));
+
+    /* Writing the table erases the sector, cache included */
+    fake_flash_init();
+    CHECK(!cache_find(&key, &free_slot) && free_slot == cache_entries());
+}
+
+/* Fuzzing: seeds are the captured answers plus some awkward cases, each
+ * round mutates one, splits it at several limits and matches every field
+ * against every profile token, checked against the reference models below.
+ * Inputs are copied to a buffer of their exact length so reads past the
+ * end land outside it under a memory checker. */
+
+#define FUZZ_ROUNDS 20000
+#define FUZZ_MAX_LEN 512
+#define FUZZ_MAX_SEEDS 64
+
+static const char *const extra_seeds[] = {
+    "",
+    "\n",
+    ",,;;\n\n",
+    "  \t\r\n",
+    "\"a,b\",'c;d', e \n",
+    "\"unterminated,x;y\n",
+    "'',\"\",x\n",
+    "RUN\r\n",
+    "RUNSTOP;1\n",
+    "TRIG;SING\n",
+    "AGILENT TECHNOLOGIES,DSO-X 3034A,MY1234,07.10.2017\n",
+    "RIGOL TECHNOLOGIES,DS1054Z,DS1ZA1234,00.04.04.SP4\n",
+};
+
+static char   seeds[FUZZ_MAX_SEEDS][CAPTURE_MSG_LEN];
+static size_t num_seeds;
+
+static uint32_t rng_state = 0x2545F491;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static char random_char(void) {
+    static const char interesting[] = ",;\n \t\r\"'aZ0?*";
+    return rng() % 4 ? interesting[rng() % (sizeof(interesting) - 1)]
+                     : (char)rng();
+}
+
+static size_t mutate(char *buf, size_t len) {
+    for (unsigned n = 1 + rng() % 4; n; n--) {
+        size_t at = len ? rng() % len : 0;
+        switch (rng() % 5) {
+        case 0: /* Replace */
+            if (len)
+                buf[at] = random_char();
+            break;
+        case 1: /* Insert */
+            if (len < FUZZ_MAX_LEN) {
+                memmove(&buf[at + 1], &buf[at], len - at);
+                buf[at] = random_char();
+                len++;
+            }
+            break;
+        case 2: /* Delete */
+            if (len) {
+                memmove(&buf[at], &buf[at + 1], len - at - 1);
+                len--;
+            }
+            break;
+        case 3: /* Truncate */
+            len = at;
+            break;
+        case 4: /* Repeat a run, growing long fields and many fields */
+            for (size_t run = 1 + rng() % 32, i = 0;
+                 i < run && at + i < len && len < FUZZ_MAX_LEN; i++) {
+                buf[len++] = buf[at + i];
+            }
+            break;
+        }
+    }
+    return len;
+}
+
+/* Fields in resp: one more than the separators outside quoted strings,
+ * after dropping the terminator */
+static size_t ref_count(const char *resp, size_t len) {
+    size_t count = 1;
+    char   quote = 0;
+
+    while (len && is_space(resp[len - 1])) {
+        len--;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = resp[i];
+        if (quote) {
+            quote = c == quote ? 0 : quote;
+        } else if (c == ',' || c == ';' || c == '\n') {
+            count++;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+        }
+    }
+    return count;
+}
+
+/* The mnemonic itself or its short form, the part before the first lower
+ * case letter, ignoring case */
+static bool ref_match(const char *mnemonic, scpi_span_t field) {
+    size_t len = strlen(mnemonic), short_len = 0;
+
+    while (short_len < len && !islower((unsigned char)mnemonic[short_len])) {
+        short_len++;
+    }
+    if (field.len != len && field.len != short_len) {
+        return false;
+    }
+    for (size_t i = 0; i < field.len; i++) {
+        if (tolower((unsigned char)mnemonic[i]) !=
+            tolower((unsigned char)field.ptr[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool has_quote(scpi_span_t field) {
+    return memchr(field.ptr, '"', field.len) ||
+           memchr(field.ptr, '\'', field.len);
+}
+
+static void fuzz_one(const char *resp, size_t len) {
+    static const size_t limits[] = {1, 2, 4, SCOPE_PROFILE_MAX_FIELDS};
+    const struct scope_profile_table *table = scope_profiles();
+    const size_t ref = ref_count(resp, len);
+    scpi_span_t  all[FUZZ_MAX_LEN + 1], fields[SCOPE_PROFILE_MAX_FIELDS];
+
+    CHECK(scpi_split(resp, len, all, 0) == 0);
+    CHECK(scpi_split(resp, len, all, ARRAY_LEN(all)) == ref);
+    for (size_t i = 0; i < ref; i++) {
+        CHECK(all[i].ptr >= resp && all[i].ptr + all[i].len <= resp + len);
+        CHECK(i + 1 == ref || all[i].ptr + all[i].len <= all[i + 1].ptr);
+        /* Trimmed, unless the spaces are inside a quoted string */
+        if (all[i].len && !has_quote(all[i]) &&
+            (all[i].ptr == resp ||
+             (all[i].ptr[-1] != '"' && all[i].ptr[-1] != '\''))) {
+            CHECK(!is_space(all[i].ptr[0]) &&
+                  !is_space(all[i].ptr[all[i].len - 1]));
+        }
+        for (size_t p = 0; table && p < table->count; p++) {
+            const scope_config_t *cfg = &table->profiles[p];
+            for (size_t r = 0; r < cfg->num_rules; r++) {
+                CHECK(scpi_match(cfg->rules[r].token, all[i]) ==
+                      ref_match(cfg->rules[r].token, all[i]));
+            }
+        }
+    }
+
+    /* A limit keeps the fields before the last one */
+    for (size_t l = 0; l < ARRAY_LEN(limits); l++) {
+        size_t count = scpi_split(resp, len, fields, limits[l]);
+        CHECK(count == (ref < limits[l] ? ref : limits[l]));
+        for (size_t i = 0; i + 1 < count; i++) {
+            CHECK(fields[i].ptr == all[i].ptr && fields[i].len == all[i].len);
+        }
+        CHECK(fields[count - 1].ptr >= resp &&
+              fields[count - 1].ptr + fields[count - 1].len <= resp + len);
+    }
+
+    /* Anything that splits parses to a valid state or fails */
+    for (size_t p = 0; table && p < table->count; p++) {
+        scope_state_t state;
+        if (scope_parse_state(&table->profiles[p], resp, len, &state)) {
+            CHECK((unsigned)state <= SCOPE_STATE_SINGLE);
+        }
+    }
+    if (scpi_split(resp, len, fields, 4) == 4) {
+        const scope_config_t *cfg = match_profile(fields);
+        CHECK(!cfg || (cfg >= table->profiles &&
+                       cfg < table->profiles + table->count));
+    }
+}
+
+static void test_fuzz(void) {
+    static const char *const captures[] = {
+        "dpo3034_idn.pcapng", "dpo3034_runstop.pcapng", "dso9404a_idn.pcapng",
+        "dso9404a_runstop.pcapng"};
+    const int before = failures;
+    char      buf[FUZZ_MAX_LEN];
+
+    num_seeds = 0;
+    for (size_t c = 0; c < ARRAY_LEN(captures); c++) {
+        size_t count = capture_read(captures[c], msgs, MAX_MSGS);
+        for (size_t i = 0; i < count && num_seeds < FUZZ_MAX_SEEDS; i++) {
+            if (msgs[i].answer) {
+                memcpy(seeds[num_seeds++], msgs[i].text, msgs[i].len + 1);
+            }
+        }
+    }
+    CHECK(num_seeds == 1 + 4 + 1 + 8);
+    for (size_t i = 0;
+         i < ARRAY_LEN(extra_seeds) && num_seeds < FUZZ_MAX_SEEDS; i++) {
+        strcpy(seeds[num_seeds++], extra_seeds[i]);
+    }
+
+    for (unsigned round = 0; round < FUZZ_ROUNDS && failures == before;
+         round++) {
+        const char *seed = seeds[round % num_seeds];
+        size_t      len  = strlen(seed);
+
+        memcpy(buf, seed, len);
+        /* Every seed goes through unchanged first */
+        if (round >= num_seeds) {
+            len = mutate(buf, len);
+        }
+        char *resp = malloc(len ? len : 1);
+        memcpy(resp, buf, len);
+        fuzz_one(resp, len);
+        if (failures != before) {
+            printf("  round %u: '%.*s'\n", round, (int)len, resp);
+        }
+        free(resp);
+    }
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    {"idn", test_idn},
+    {"keysight runstop", test_keysight_runstop},
+    {"tektronix runstop", test_tektronix_runstop},
+    {"mnemonics", test_mnemonics},
+    {"slow state command", test_slow_state_cmd},
+    {"reconnect cache", test_cache},
+    {"fuzz", test_fuzz},
+};
+
+int main(int argc, char **argv) {
+    fake_usbh_verbose(argc > 1 && strcmp(argv[1], "-v") == 0);
+    fake_flash_init();
+    CHECK(load_profiles());
+
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        const int before = failures;
+        printf("%s\n", tests[i].name);
+        tests[i].fn();
+        if (failures != before)
+            printf("  %d failed\n", failures - before);
+    }
+    printf("%s: %d failure%s\n", failures ? "FAILED" : "passed", failures,
+           failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
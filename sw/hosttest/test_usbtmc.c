@@ -0,0 +1,469 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The USBTMC host driver against a scripted instrument: plain round trips
+ * through each read path, then every fault the device can script, checking
+ * that the driver fails the affected query, recovers the device, and the
+ * next query gets its own answer.
+ */
+
+#include "fake_tmc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define IDN "KEYSIGHT TECHNOLOGIES,DSO9404A,MY53020105,06.20.01002\n"
+
+static int failures;
+
+#define CHECK(c)                                                               \
+    do {                                                                       \
+        if (!(c)) {                                                            \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #c);              \
+            failures++;                                                        \
+        }                                                                      \
+    } while (0)
+
+static fake_tmc_t     devs[2];
+static fake_tmc_t *   dev = &devs[0];
+static USBHTmcDriver *tmcp;
+
+static unsigned srq_count;
+static uint8_t  srq_stb;
+
+static void srq_cb(USBHTmcDriver *drv, uint8_t status_byte) {
+    (void)drv;
+    srq_count++;
+    srq_stb = status_byte;
+}
+
+static const USBHTmcConfig tmc_config = {srq_cb};
+
+static void attach(const fake_tmc_config_t *cfg) {
+    fake_usbh_reset();
+    fake_tmc_init(dev, cfg);
+    tmcp = fake_tmc_attach(dev, &tmc_config);
+    CHECK(tmcp != NULL);
+    srq_count = 0;
+}
+
+static void attach_default(void) {
+    fake_tmc_config_t cfg;
+    fake_tmc_default_config(&cfg);
+    attach(&cfg);
+}
+
+static void detach(void) {
+    fake_tmc_detach(dev, tmcp);
+    CHECK(fake_usbh_pending() == 0);
+}
+
+/* Read paths under test, each asking query and returning the answer */
+typedef enum {
+    PATH_ASK = 0,
+    PATH_IN_PLACE,
+    PATH_ASYNC,
+    PATH_COUNT
+} path_t;
+
+static const char *const path_names[PATH_COUNT] = {"ask", "in place",
+                                                   "async"};
+
+static char    answer[4096];
+static uint8_t rx[USBH_TMC_RX_BUF_SIZE(sizeof(answer))]
+    __attribute__((aligned(4)));
+
+static size_t async_len;
+static volatile bool async_done;
+
+static void async_cb(USBHTmcDriver *drv, size_t len) {
+    (void)drv;
+    async_len  = len;
+    async_done = true;
+}
+
+static size_t ask(path_t path, const char *query) {
+    const size_t qlen    = strlen(query);
+    const size_t n       = sizeof(answer) - 1;
+    const systime_t tout = usbhtmcTimeout(tmcp);
+    size_t          len  = 0;
+
+    answer[0] = 0;
+    switch (path) {
+        case PATH_ASK:
+            len = usbhtmcAsk(tmcp, query, qlen, answer, n, tout);
+            break;
+        case PATH_IN_PLACE:
+            len = usbhtmcAskInPlace(tmcp, query, qlen, rx, n, tout);
+            memcpy(answer, usbhtmcRxPayload(rx), len + 1);
+            break;
+        case PATH_ASYNC:
+            async_done = false;
+            if (!usbhtmcAskAsync(tmcp, query, qlen, answer, n, tout,
+                                 async_cb))
+                return 0;
+            if (!fake_usbh_run_until(&async_done, 10000000))
+                return 0;
+            len = async_len;
+            break;
+        default:
+            break;
+    }
+    return len;
+}
+
+/* The query after a fault must get its own answer, not a leftover */
+static void check_next(path_t path) {
+    CHECK(ask(path, "RSTate?") == 5 && strcmp(answer, "STOP\n") == 0);
+    CHECK(ask(path, "*IDN?") == strlen(IDN) && strcmp(answer, IDN) == 0);
+}
+
+static void test_connect(void) {
+    attach_default();
+    CHECK(tmcp->state == USBHTMC_STATE_READY);
+    CHECK(usbhtmcIsUSB488(tmcp));
+    CHECK(usbhtmcHasTermChar(tmcp));
+    CHECK(usbhtmcHas488_2(tmcp));
+    CHECK(usbhtmcHasNotifications(tmcp));
+    /* Only the notification URB stays in flight */
+    CHECK(fake_usbh_pending() == 1);
+    detach();
+    CHECK(tmcp->state == USBHTMC_STATE_STOP);
+}
+
+static void test_round_trip(void) {
+    attach_default();
+    for (path_t p = 0; p < PATH_COUNT; p++) {
+        CHECK(ask(p, "*IDN?") == strlen(IDN) && strcmp(answer, IDN) == 0);
+        CHECK(usbhtmcWrite(tmcp, "RUN", 3, usbhtmcTimeout(tmcp)) == 3);
+        CHECK(ask(p, "RSTate?") == 4 && strcmp(answer, "RUN\n") == 0);
+        CHECK(usbhtmcWrite(tmcp, ":STOP", 5, usbhtmcTimeout(tmcp)) == 5);
+        /* Commands and queries in one message, as the confirm does */
+        CHECK(ask(p, "SINGle;:RSTate?") == 5 &&
+              strcmp(answer, "SING\n") == 0);
+        CHECK(ask(p, "STOP;:RSTate?") == 5 && strcmp(answer, "STOP\n") == 0);
+    }
+    /* A query longer than one packet goes out in several URBs */
+    char long_query[200];
+    memset(long_query, ' ', sizeof(long_query));
+    memcpy(long_query + sizeof(long_query) - 8, "RSTate?", 8);
+    for (path_t p = 0; p < PATH_COUNT; p++) {
+        CHECK(ask(p, long_query) == 5 && strcmp(answer, "STOP\n") == 0);
+    }
+    CHECK(tmcp->stats.errors == 0 && tmcp->stats.aborts == 0);
+    CHECK(dev->counters.interrupted == 0);
+    detach();
+}
+
+static void test_bad_tag(path_t path) {
+    attach_default();
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_BAD_TAG, 0);
+    CHECK(ask(path, "*IDN?") == 0);
+    CHECK(tmcp->stats.bad_tags == 1);
+    check_next(path);
+    CHECK(tmcp->stats.aborts == 1);
+    detach();
+}
+
+static void test_stale_tag(path_t path) {
+    attach_default();
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_STALE_TAG, 0);
+    CHECK(ask(path, "*IDN?") == strlen(IDN) && strcmp(answer, IDN) == 0);
+    CHECK(tmcp->stats.stale == 1);
+    CHECK(tmcp->stats.aborts == 0);
+    check_next(path);
+    detach();
+}
+
+static void test_short(path_t path) {
+    attach_default();
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_SHORT, 10);
+    CHECK(ask(path, "*IDN?") == 0);
+    check_next(path);
+    CHECK(tmcp->stats.aborts == 1);
+    detach();
+}
+
+static void test_stall(path_t path) {
+    attach_default();
+    const uint32_t resets = fake_usbh_stats.ep_resets;
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_STALL, 0);
+    CHECK(ask(path, "*IDN?") == 0);
+    CHECK(tmcp->stats.stalls >= 1);
+    check_next(path);
+    CHECK(tmcp->stats.aborts == 1 && dev->counters.aborts_in == 1);
+    CHECK(fake_usbh_stats.ep_resets > resets);
+    CHECK(tmcp->epin.status == USBH_EPSTATUS_OPEN);
+    detach();
+}
+
+static void test_fragment(path_t path) {
+    /* Whole words, then pieces that leave the in place read unaligned */
+    static const uint32_t sizes[] = {8, 5, 1};
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        attach_default();
+        fake_tmc_fault(dev, FAKE_TMC_FAULT_FRAGMENT, sizes[i]);
+        CHECK(ask(path, "*IDN?") == strlen(IDN) && strcmp(answer, IDN) == 0);
+        CHECK(dev->counters.transfers ==
+              (strlen(IDN) + sizes[i] - 1) / sizes[i]);
+        CHECK(tmcp->stats.aborts == 0);
+        check_next(path);
+        detach();
+    }
+}
+
+static void test_delay(path_t path) {
+    attach_default();
+    /* Later than usual but inside the deadline */
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_DELAY, 20000);
+    uint64_t start = fake_usbh_now();
+    CHECK(ask(path, "*IDN?") == strlen(IDN));
+    CHECK(fake_usbh_now() - start >= 20000);
+    CHECK(tmcp->stats.timeouts == 0);
+
+    /* Past it: the query fails, and the answer must not turn up later */
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_DELAY, 3000000);
+    CHECK(ask(path, "*IDN?") == 0);
+    CHECK(tmcp->stats.timeouts == 1);
+    fake_usbh_run(3000000);
+    check_next(path);
+    CHECK(tmcp->stats.aborts == 1);
+    detach();
+}
+
+/* Each fault through each read path */
+static void test_faults(void) {
+    for (path_t p = 0; p < PATH_COUNT; p++) {
+        printf("  %s\n", path_names[p]);
+        test_bad_tag(p);
+        test_stale_tag(p);
+        test_short(p);
+        test_stall(p);
+        test_fragment(p);
+        test_delay(p);
+    }
+}
+
+static uint8_t block[100000];
+static size_t  block_len;
+static bool    block_ok;
+
+static bool block_cb(void *user, const uint8_t *data, size_t n) {
+    (void)user;
+    for (size_t i = 0; i < n; i++) {
+        if (data[i] != (uint8_t)((block_len + i) * 7))
+            block_ok = false;
+    }
+    if (block_len + n <= sizeof(block))
+        memcpy(block + block_len, data, n);
+    block_len += n;
+    return true;
+}
+
+static size_t ask_block(const char *query) {
+    block_len = 0;
+    block_ok  = true;
+    return usbhtmcAskBlock(tmcp, query, strlen(query), block_cb, NULL,
+                           usbhtmcTimeout(tmcp));
+}
+
+static void test_block(void) {
+    attach_default();
+    CHECK(ask_block("CURVe? 5000") == 5000 && block_len == 5000 && block_ok);
+    /* Device side transfer limit, and answers split without EOM */
+    dev->cfg.max_transfer = 1000;
+    CHECK(ask_block("CURVe? 5000") == 5000 && block_len == 5000 && block_ok);
+    dev->cfg.max_transfer = 0;
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_FRAGMENT, 333);
+    CHECK(ask_block("CURVe? 5000") == 5000 && block_len == 5000 && block_ok);
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_STALE_TAG, 0);
+    CHECK(ask_block("CURVe? 100") == 100 && block_ok);
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_STALL, 0);
+    CHECK(ask_block("CURVe? 100") == 0);
+    CHECK(ask_block("CURVe? 100") == 100 && block_ok);
+    CHECK(tmcp->stats.aborts == 1);
+    check_next(PATH_ASK);
+    detach();
+}
+
+/* The press path: a slow poll in flight is cancelled rather than waited
+ * out, and the device is recovered before the command goes out */
+static void test_async_cancel(void) {
+    attach_default();
+    for (int stage = 0; stage < 2; stage++) {
+        async_done = false;
+        fake_tmc_fault(dev, FAKE_TMC_FAULT_DELAY, 500000);
+        CHECK(usbhtmcAskAsync(tmcp, "RSTate?", 7, answer, 100,
+                              TIME_MS2I(1000), async_cb));
+        /* Cancel during the write, or once waiting for the answer */
+        fake_usbh_run(stage ? 5000 : 10);
+        CHECK(!usbhtmcAskAsync(tmcp, "RSTate?", 7, answer, 100,
+                               TIME_MS2I(1000), async_cb));
+        CHECK(usbhtmcAskCancel(tmcp));
+        CHECK(!usbhtmcAskCancel(tmcp));
+
+        uint64_t start = fake_usbh_now();
+        CHECK(usbhtmcWrite(tmcp, "RUN", 3, TIME_MS2I(1000)) == 3);
+        CHECK(fake_usbh_now() - start < 20000);
+        CHECK(!async_done);
+        CHECK(ask(PATH_ASK, "RSTate?") == 4 && strcmp(answer, "RUN\n") == 0);
+        CHECK(usbhtmcWrite(tmcp, "STOP", 4, TIME_MS2I(1000)) == 4);
+    }
+    check_next(PATH_ASYNC);
+    detach();
+}
+
+static void test_async_timeout(void) {
+    attach_default();
+    async_done = false;
+    fake_tmc_fault(dev, FAKE_TMC_FAULT_DELAY, 500000);
+    uint64_t start = fake_usbh_now();
+    CHECK(usbhtmcAskAsync(tmcp, "*IDN?", 5, answer, 100, TIME_MS2I(50),
+                          async_cb));
+    CHECK(fake_usbh_run_until(&async_done, 1000000));
+    CHECK(async_len == 0);
+    CHECK(fake_usbh_now() - start < 60000);
+    CHECK(tmcp->stats.timeouts == 1);
+    check_next(PATH_ASYNC);
+    detach();
+}
+
+static void test_status_byte(void) {
+    uint8_t stb = 0;
+
+    /* Answered over the interrupt endpoint */
+    attach_default();
+    dev->stb = 0x44;
+    CHECK(usbhtmcReadStatusByte(tmcp, &stb, TIME_MS2I(100)) ==
+          USBH_URBSTATUS_OK);
+    CHECK(stb == 0x44);
+    dev->stb = 0x00;
+    CHECK(usbhtmcReadStatusByte(tmcp, &stb, TIME_MS2I(100)) ==
+          USBH_URBSTATUS_OK);
+    CHECK(stb == 0x00);
+
+    /* SRQ notifications reach the callback */
+    fake_tmc_srq(dev, 0x41);
+    fake_usbh_run(1000);
+    CHECK(srq_count == 1 && srq_stb == 0x41);
+    fake_tmc_srq(dev, 0x40);
+    fake_usbh_run(1000);
+    CHECK(srq_count == 2 && srq_stb == 0x40);
+    detach();
+
+    /* Still over the interrupt endpoint without SR1, only SRQs need it */
+    fake_tmc_config_t cfg;
+    fake_tmc_default_config(&cfg);
+    cfg.sr1 = false;
+    attach(&cfg);
+    CHECK(!usbhtmcHasNotifications(tmcp));
+    dev->stb = 0x44;
+    CHECK(usbhtmcReadStatusByte(tmcp, &stb, TIME_MS2I(100)) ==
+          USBH_URBSTATUS_OK);
+    CHECK(stb == 0x44);
+    detach();
+
+    /* In the control response without one */
+    fake_tmc_default_config(&cfg);
+    cfg.int_mps = 0;
+    attach(&cfg);
+    CHECK(!usbhtmcHasNotifications(tmcp));
+    dev->stb = 0x10;
+    CHECK(usbhtmcReadStatusByte(tmcp, &stb, TIME_MS2I(100)) ==
+          USBH_URBSTATUS_OK);
+    CHECK(stb == 0x10);
+    detach();
+}
+
+static void test_no_termchar(void) {
+    fake_tmc_config_t cfg;
+    fake_tmc_default_config(&cfg);
+    cfg.termchar = false;
+    attach(&cfg);
+    CHECK(!usbhtmcHasTermChar(tmcp));
+    for (path_t p = 0; p < PATH_COUNT; p++)
+        check_next(p);
+    detach();
+}
+
+static void test_group_write(void) {
+    fake_tmc_config_t cfg;
+    USBHTmcDriver *   drv[2];
+    USBHTmcFrame      frame;
+
+    fake_usbh_reset();
+    fake_tmc_default_config(&cfg);
+    for (int i = 0; i < 2; i++) {
+        fake_tmc_init(&devs[i], &cfg);
+        drv[i] = fake_tmc_attach(&devs[i], &tmc_config);
+        CHECK(drv[i] != NULL);
+    }
+    CHECK(drv[0] != drv[1]);
+
+    USBHTmcGroupWrite writes[2] = {{drv[0], "RUN", NULL, false, 0, 0},
+                                   {drv[1], "RUN", NULL, false, 0, 0}};
+    CHECK(usbhtmcWriteGroup(writes, 2, TIME_MS2I(100)) == 2);
+    CHECK(devs[0].state == FAKE_TMC_RUNNING &&
+          devs[1].state == FAKE_TMC_RUNNING);
+    /* Both writes share one bus, so one follows the other */
+    uint32_t skew = RTC2US(STM32_HCLK, writes[1].done - writes[0].done);
+    CHECK(skew <= FAKE_USBH_URB_US + FAKE_USBH_PACKET_US);
+
+    CHECK(usbhtmcEncodeFrame(&frame, "STOP", 4) == 16);
+    writes[0].frame = writes[1].frame = &frame;
+    CHECK(usbhtmcWriteGroup(writes, 2, TIME_MS2I(100)) == 2);
+    CHECK(devs[0].state == FAKE_TMC_STOPPED &&
+          devs[1].state == FAKE_TMC_STOPPED);
+    CHECK(strcmp(devs[1].last_cmd, "STOP") == 0);
+
+    for (int i = 0; i < 2; i++)
+        fake_tmc_detach(&devs[i], drv[i]);
+    dev = &devs[0];
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} tests[] = {
+    {"connect", test_connect},
+    {"round trip", test_round_trip},
+    {"faults", test_faults},
+    {"block", test_block},
+    {"async cancel", test_async_cancel},
+    {"async timeout", test_async_timeout},
+    {"status byte", test_status_byte},
+    {"no termchar", test_no_termchar},
+    {"group write", test_group_write},
+};
+
+int main(int argc, char **argv) {
+    fake_usbh_verbose(argc > 1 && strcmp(argv[1], "-v") == 0);
+
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        const int before = failures;
+        printf("%s\n", tests[i].name);
+        tests[i].fn();
+        if (failures != before)
+            printf("  %d failed\n", failures - before);
+    }
+    printf("%s: %d failure%s\n", failures ? "FAILED" : "passed", failures,
+           failures == 1 ? "" : "s");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ch.h"
+#include "hal.h"
+#include "chprintf.h"
+#include "shell.h"
+#include <string.h>
+
+#include "console.h"
+#include "poll.h"
+#include "trace.h"
+#include "usbh_usbtmc.h"
+
+static const char *const lat_names[USBHTMC_LAT_COUNT] = {
+    [USBHTMC_LAT_WRITE]   = "write",
+    [USBHTMC_LAT_REQUEST] = "request",
+    [USBHTMC_LAT_BULK_IN] = "bulk in",
+    [USBHTMC_LAT_ASK]     = "ask",
+};
+
+static void print_tmc_stats(BaseSequentialStream *chp, unsigned index,
+                            const USBHTmcStats *s, uint32_t srtt_us) {
+    chprintf(chp,
+             "TMC%u: %lu timeouts, %lu stalls, %lu errors, %lu bad tags, "
+             "%lu stale, %lu aborts, %lu clears\r\n",
+             index, s->timeouts, s->stalls, s->errors, s->bad_tags, s->stale,
+             s->aborts, s->clears);
+    chprintf(chp, "smoothed RTT %lu us\r\n", srtt_us);
+
+    chprintf(chp, "%-8s %6s %6s %6s", "us", "n", "avg", "max");
+    for (unsigned b = 0; b < USBH_TMC_HIST_BUCKETS - 1; b++) {
+        chprintf(chp, " %6lu", usbhtmcHistBounds[b]);
+    }
+    chprintf(chp, "  >%lu\r\n", usbhtmcHistBounds[USBH_TMC_HIST_BUCKETS - 2]);
+
+    for (unsigned k = 0; k < USBHTMC_LAT_COUNT; k++) {
+        const usbhtmc_hist_t *h   = &s->lat[k];
+        uint32_t              avg = h->count ? h->total_us / h->count : 0;
+        chprintf(chp, "%-8s %6lu %6lu %6lu", lat_names[k], h->count, avg,
+                 h->max_us);
+        for (unsigned b = 0; b < USBH_TMC_HIST_BUCKETS; b++) {
+            chprintf(chp, " %6lu", h->buckets[b]);
+        }
+        chprintf(chp, "\r\n");
+    }
+}
+
+static void cmd_tmcstats(BaseSequentialStream *chp, int argc, char *argv[]) {
+    bool clear = argc == 1 && strcmp(argv[0], "clear") == 0;
+    if (argc > 1 || (argc == 1 && !clear)) {
+        chprintf(chp, "Usage: tmcstats [clear]\r\n");
+        return;
+    }
+
+    for (unsigned i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+        USBHTmcDriver *tmcp = &USBHTMCD[i];
+        USBHTmcStats   s;
+        uint32_t       srtt_us;
+
+        if (tmcp->state != USBHTMC_STATE_READY) {
+            continue;
+        }
+        /* URB callbacks update the counters, so snapshot them atomically */
+        osalSysLock();
+        if (clear) {
+            memset(&tmcp->stats, 0, sizeof(tmcp->stats));
+        } else {
+            s       = tmcp->stats;
+            srtt_us = tmcp->srtt_us;
+        }
+        osalSysUnlock();
+        if (!clear) {
+            print_tmc_stats(chp, i, &s, srtt_us);
+        }
+    }
+}
+
+/* Press latency spans, each point to the next and then end to end. The
+ * skew is from the first scope of a group press to the last. */
+static const struct {
+    const char *  name;
+    trace_point_t from;
+    trace_point_t to;
+} spans[] = {
+    {"exti>queue", TRACE_EXTI, TRACE_DEQUEUE},
+    {"queue>usb", TRACE_DEQUEUE, TRACE_WORKER},
+    {"usb>submit", TRACE_WORKER, TRACE_SUBMIT},
+    {"submit>done", TRACE_SUBMIT, TRACE_COMPLETE},
+    {"total", TRACE_EXTI, TRACE_COMPLETE},
+    {"skew", TRACE_COMPLETE, TRACE_LAST},
+};
+
+static void cmd_latency(BaseSequentialStream *chp, int argc, char *argv[]) {
+    bool clear = argc == 1 && strcmp(argv[0], "clear") == 0;
+    if (argc > 1 || (argc == 1 && !clear)) {
+        chprintf(chp, "Usage: latency [clear]\r\n");
+        return;
+    }
+    if (clear) {
+        trace_clear();
+        return;
+    }
+
+    chprintf(chp, "%-12s %6s %6s %6s %6s %6s\r\n", "us", "n", "min", "avg",
+             "p99", "max");
+    for (unsigned i = 0; i < sizeof(spans) / sizeof(spans[0]); i++) {
+        trace_stats_t s;
+        trace_stats(spans[i].from, spans[i].to, &s);
+        chprintf(chp, "%-12s %6lu %6lu %6lu %6lu %6lu\r\n", spans[i].name,
+                 s.count, s.min_us, s.avg_us, s.p99_us, s.max_us);
+    }
+}
+
+static void cmd_polls(BaseSequentialStream *chp, int argc, char *argv[]) {
+    bool clear = argc == 1 && strcmp(argv[0], "clear") == 0;
+    if (argc > 1 || (argc == 1 && !clear)) {
+        chprintf(chp, "Usage: polls [clear]\r\n");
+        return;
+    }
+
+    poll_stats_t s;
+    poll_get_stats(&s, clear);
+    if (!clear) {
+        chprintf(chp, "%lu polls, %lu/hour, every %lu ms\r\n",
+                 s.transactions, s.per_hour, s.interval_ms);
+        chprintf(chp, "LED state read %lu ms ago, longest gap %lu ms\r\n",
+                 s.stale_ms, s.max_stale_ms);
+    }
+}
+
+static const ShellCommand commands[] = {
+    {"tmcstats", cmd_tmcstats},
+    {"latency", cmd_latency},
+    {"polls", cmd_polls},
+    {NULL, NULL},
+};
+
+static const ShellConfig shell_cfg = {
+    .sc_channel  = CON,
+    .sc_commands = commands,
+};
+
+static THD_WORKING_AREA(waShell, 1024);
+
+void console_init(void) {
+    shellInit();
+    chThdCreateStatic(waShell, sizeof(waShell), NORMALPRIO - 1, shellThread,
+                      (void *)&shell_cfg);
+}
@@ -1,3 +1,8 @@
 #! /usr/bin/sh
 
-dfu-util -D build/scope-footswitch-v1.bin -s 0x8004000:leave -d 1d50:613b
\ No newline at end of file
+# ./dfu.sh flashes the firmware, ./dfu.sh profiles only the profile table
+if [ "$1" = "profiles" ]; then
+    dfu-util -D build/profiles.bin -s 0x800C000:leave -d 1d50:613b
+else
+    dfu-util -D build/scope-footswitch-v1.bin -s 0x8004000:leave -d 1d50:613b
+fi
@@ -19,6 +19,7 @@
 
 
 #include "events.h"
+#include "trace.h"
 
 #define LONGPRESS_MS 1000
 
@@ -89,7 +90,8 @@ static void longpress_cb(void *arg) {
 }
 
 static void pal_event_cb(void *arg) {
-    size_t src = (size_t)arg;
+    size_t  src = (size_t)arg;
+    rtcnt_t now = chSysGetRealtimeCounterX();
 
     chSysLockFromISR();
     if (src < (sizeof(evt_config) / sizeof(evt_config[0]))) {
@@ -110,6 +112,7 @@ static void pal_event_cb(void *arg) {
                                      longpress_cb, 0);
                     } else if (cfg->events[0]) { // Generate immediate event for
                                                  // low latecy processing
+                        trace_startI(now);
                         iqPutI(&event_queue, cfg->events[0]);
                     }
                 }
@@ -117,6 +120,7 @@ static void pal_event_cb(void *arg) {
                 if (cfg->flags & FLAG_LONG_PRESS) {
                     chVTResetI(&state->vt);
                     if (state->state == STATE_BTN_PRESSED && cfg->events[0]) {
+                        trace_startI(now);
                         iqPutI(&event_queue, cfg->events[0]);
                     }
                 } else {
@@ -32,7 +32,10 @@ enum events {
     EVT_FOOTSW2_PRESS,
     EVT_MODE_CHANGE,
     EVT_VBUS_FAULT,
-    EVT_STATE_CHANGE
+    EVT_STATE_CHANGE,
+    EVT_POLL_DONE,
+    EVT_SCOPE_CONNECTED,
+    EVT_LED_CORRECTED
 };
 
 extern input_queue_t event_queue;
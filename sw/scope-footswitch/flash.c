@@ -0,0 +1,76 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flash.h"
+
+#include "ch.h"
+#include "hal.h"
+
+/* Internal flash programming, for the few words of state the firmware keeps
+ * across power cycles. Erasing is left to the bootloader. */
+
+#define FLASH_KEY1 0x45670123U
+#define FLASH_KEY2 0xCDEF89ABU
+
+#define FLASH_SR_ERRORS                                                        \
+    (FLASH_SR_PGSERR | FLASH_SR_PGPERR | FLASH_SR_PGAERR | FLASH_SR_WRPERR)
+
+static void flash_wait(void) {
+    while (FLASH->SR & FLASH_SR_BSY) {
+    }
+}
+
+/* Program words at addr, which must be erased and word aligned. The CPU
+ * stalls on flash reads while each word is written, about 16 us. Returns
+ * true if the words read back as written. */
+bool flash_program(const void *addr, const uint32_t *data, size_t words) {
+    volatile uint32_t *dst = (volatile uint32_t *)(uintptr_t)addr;
+    bool               ok  = true;
+
+    osalDbgCheck(((uintptr_t)addr & 3U) == 0);
+
+    chSysLock();
+    flash_wait();
+    if (FLASH->CR & FLASH_CR_LOCK) {
+        FLASH->KEYR = FLASH_KEY1;
+        FLASH->KEYR = FLASH_KEY2;
+    }
+    FLASH->SR = FLASH_SR_ERRORS | FLASH_SR_EOP;
+    /* x32 parallelism, valid at the board's 3.3 V */
+    FLASH->CR = FLASH_CR_PSIZE_1 | FLASH_CR_PG;
+    for (size_t i = 0; i < words && ok; i++) {
+        dst[i] = data[i];
+        __DSB();
+        flash_wait();
+        ok = !(FLASH->SR & FLASH_SR_ERRORS);
+    }
+    FLASH->CR = FLASH_CR_LOCK;
+
+    /* Drop stale erased lines from the data cache */
+    FLASH->ACR &= ~FLASH_ACR_DCEN;
+    FLASH->ACR |= FLASH_ACR_DCRST;
+    FLASH->ACR &= ~FLASH_ACR_DCRST;
+    FLASH->ACR |= FLASH_ACR_DCEN;
+    chSysUnlock();
+
+    for (size_t i = 0; i < words && ok; i++) {
+        ok = dst[i] == data[i];
+    }
+    return ok;
+}
@@ -24,9 +24,12 @@
 #include "usbh/debug.h" /* for usbDbgPuts/usbDbgPrintf */
 #include <string.h>
 
+#include "console.h"
 #include "events.h"
 #include "led_manager.h"
+#include "poll.h"
 #include "scope.h"
+#include "trace.h"
 #include "usbh_usbtmc.h"
 #include "ws2812.h"
 #include "image_header.h"
@@ -96,6 +99,7 @@ static THD_FUNCTION(ThreadLed, arg) {
     runLedManager(&led_config);
 }
 
+/* Called with led_mutex held */
 static void update_leds(scope_state_t state) {
     switch (state) {
         case SCOPE_STATE_RUNNING:
@@ -119,94 +123,687 @@ static void update_leds(scope_state_t state) {
     }
 }
 
+/* Every Nth poll is a full state query rather than a status byte read */
+#define FULL_POLL_EVERY 5
+
+/* With group mode every press goes to all connected scopes, following the
+ * first one. Otherwise footswitch 2 drives the second scope and the rest
+ * drive the first. */
+#define FOOTSW_GROUP_MODE TRUE
+
+typedef struct {
+    const scope_config_t *cfg;
+    scope_frames_t        frames; /* cfg's state commands, ready to send */
+    scope_cache_key_t     key;
+    scope_state_t         state;
+    /* Connection steps still to do, one transaction each, so that a press
+     * can go out between them */
+    bool                  lookup_due; /* reconnect cache lookup */
+    bool                  identify;   /* *IDN?, for cfg or to confirm it */
+    bool                  setup_due;  /* status setup for cfg */
+    bool                  poll_pending;
+    bool                  poll_idn; /* the pending ask is the *IDN? */
+    bool                  srq_armed;
+    volatile bool         srq_pending; /* state change latched, see srq_cb */
+    bool                  clear_due;   /* latched state change to clear */
+    bool                  query_due;   /* full state query needed */
+    bool                  status_ready;
+    unsigned              poll_count;
+
+    /* State poll or *IDN? handed to usbhtmcAskAsync, completed from the USB
+     * ISR */
+    char            poll_buf[SCOPE_IDN_BUF_SIZE];
+    volatile bool   poll_done;
+    volatile size_t poll_len;
+} scope_ctx_t;
+
+static scope_ctx_t scopes[USBH_TMC_MAX_INSTANCES];
+
+/* Work for ThreadUsb, which does every USB transfer: presses from ThreadMain,
+ * posted ahead of everything else, EVT_STATE_CHANGE, EVT_POLL_DONE and
+ * EVT_SCOPE_CONNECTED from the USB callbacks and main(), and
+ * EVT_LED_CORRECTED from the LED timer */
+#define USB_MAILBOX_SIZE 8
+static msg_t usb_mailbox_buf[USB_MAILBOX_SIZE];
+static MAILBOX_DECL(usb_mailbox, usb_mailbox_buf, USB_MAILBOX_SIZE);
+
+static bool press_waiting(void);
+
+static void poll_done_cb(USBHTmcDriver *tmcp, size_t len) {
+    scope_ctx_t *ctx = &scopes[tmcp->index];
+    ctx->poll_len    = len;
+    ctx->poll_done   = true;
+    /* If the mailbox is full ThreadUsb is awake anyway and collects the
+     * answer on its next pass */
+    chMBPostI(&usb_mailbox, EVT_POLL_DONE);
+}
+
+/* The SRQ stays latched until the poll it triggers clears it, which arms
+ * the next one */
+static void srq_cb(USBHTmcDriver *tmcp, uint8_t status_byte) {
+    (void)status_byte;
+    scopes[tmcp->index].srq_pending = true;
+    chMBPostI(&usb_mailbox, EVT_STATE_CHANGE);
+}
+
+static const USBHTmcConfig tmc_config = {srq_cb};
+
+static bool scope_ready(size_t i) {
+    return USBHTMCD[i].state == USBHTMC_STATE_READY && scopes[i].cfg;
+}
+
+/* Index of the nth ready scope, or -1 */
+static int nth_ready_scope(unsigned n) {
+    for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+        if (scope_ready(i) && n-- == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Every LED change from ThreadMain and ThreadUsb is made under this */
+static MUTEX_DECL(led_mutex);
+
+static void show_error(void) {
+    chMtxLock(&led_mutex);
+    setLedColor(&led_config, 0, WS2812_RED);
+    setLedFlashing(&led_config, TRUE, 0);
+    chMtxUnlock(&led_mutex);
+}
+
+/* Steady status LED color, from ThreadUsb */
+static void show_status(uint32_t color) {
+    chMtxLock(&led_mutex);
+    setLedColor(&led_config, 0, color);
+    setLedTarget(&led_config, TRUE, 0, 5000);
+    chMtxUnlock(&led_mutex);
+}
+
+/* Flash the status LED in its color for a failed press, from ThreadUsb */
+static void show_press_failed(void) {
+    chMtxLock(&led_mutex);
+    setLedFlashing(&led_config, TRUE, 0);
+    chMtxUnlock(&led_mutex);
+}
+
+/* The state the LEDs show. ThreadMain predicts the result of a press and
+ * shows it at once, ThreadUsb settles it once the scope has confirmed a
+ * state that is newer than every queued press. */
+static scope_state_t shown_state = SCOPE_STATE_STOPPED;
+static bool          shown_predicted;
+
+/* Presses only update the state wanted from each scope, which ThreadUsb
+ * converges to. A burst of presses sends just the last state, or nothing if
+ * they cancel out. press_posted is set while a press message is queued. */
+static scope_state_t desired[USBH_TMC_MAX_INSTANCES];
+static bool          desire_pending[USBH_TMC_MAX_INSTANCES];
+static bool          press_posted;
+
+/* How long the status LED flashes yellow after a wrong prediction */
+#define CORRECTED_TIME TIME_MS2I(1000)
+static virtual_timer_t corrected_vt;
+
+/* Hands the end of the yellow flash to ThreadUsb, retrying shortly if its
+ * mailbox is full */
+static void corrected_done_cb(void *arg) {
+    (void)arg;
+    chSysLockFromISR();
+    if (chMBPostI(&usb_mailbox, EVT_LED_CORRECTED) != MSG_OK) {
+        chVTSetI(&corrected_vt, TIME_MS2I(50), corrected_done_cb, NULL);
+    }
+    chSysUnlockFromISR();
+}
+
+static void end_corrected(void) {
+    chMtxLock(&led_mutex);
+    /* Unless something else took over the status LED meanwhile */
+    if (led_config.ws2812s[0].color.raw == WS2812_YELLOW) {
+        setLedColor(&led_config, 0, WS2812_BLUE);
+        setLedTarget(&led_config, TRUE, 0, 5000);
+    }
+    chMtxUnlock(&led_mutex);
+}
+
+static void show_predicted(scope_state_t state) {
+    chMtxLock(&led_mutex);
+    osalSysLock();
+    shown_state     = state;
+    shown_predicted = true;
+    osalSysUnlock();
+    update_leds(state);
+    chMtxUnlock(&led_mutex);
+}
+
+/* Show a state from ThreadUsb. confirmed is false for states assumed from a
+ * command the scope did not confirm, which leave a prediction standing.
+ * failed is true after a failed press, whose cue a correction must not
+ * overwrite. */
+static void show_state(scope_state_t state, bool confirmed, bool failed) {
+    chMtxLock(&led_mutex);
+    osalSysLock();
+    if (shown_predicted && (press_posted || !confirmed)) {
+        osalSysUnlock();
+        chMtxUnlock(&led_mutex);
+        return;
+    }
+    bool wrong      = shown_predicted && shown_state != state && !failed;
+    shown_state     = state;
+    shown_predicted = false;
+    osalSysUnlock();
+    if (wrong) {
+        setLedColor(&led_config, 0, WS2812_YELLOW);
+        setLedFlashing(&led_config, TRUE, 0);
+        chVTSet(&corrected_vt, CORRECTED_TIME, corrected_done_cb, NULL);
+    }
+    update_leds(state);
+    chMtxUnlock(&led_mutex);
+    if (wrong) {
+        usbDbgPrintf("LED prediction corrected to %d", (int)state);
+    }
+}
+
+/* Scope i's state was just read, which counts towards LED staleness if the
+ * LEDs follow it */
+static void mark_fresh(size_t i) {
+    if ((int)i == nth_ready_scope(0)) {
+        poll_fresh();
+    }
+}
+
+/* True if any ready scope is in state */
+static bool any_scope_in(scope_state_t state) {
+    for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+        if (scope_ready(i) && scopes[i].state == state) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Switch the scope to cfg, encoding its state commands up front */
+static void set_profile(scope_ctx_t *ctx, const scope_config_t *cfg) {
+    ctx->cfg = cfg && scope_encode_frames(cfg, &ctx->frames) ? cfg : NULL;
+}
+
+/* Take a *IDN? answer: the profile found replaces a cached one, or is the
+ * first one. Returns true if anything changed that the LEDs should show. */
+static bool collect_idn(size_t i) {
+    scope_ctx_t *         ctx = &scopes[i];
+    const scope_config_t *cfg =
+        ctx->poll_len ? scope_match_idn(ctx->poll_buf, ctx->poll_len) : NULL;
+
+    ctx->identify = false;
+    if (!cfg || cfg == ctx->cfg) {
+        /* A cached profile stays if the scope does not answer */
+        if (!ctx->cfg) {
+            show_error();
+        }
+        return false;
+    }
+    if (ctx->cfg) {
+        usbDbgPrintf("TMC%d: cached profile replaced", (int)i);
+    }
+    set_profile(ctx, cfg);
+    if (!ctx->cfg) {
+        show_error();
+        return true;
+    }
+    ctx->status_ready = false;
+    ctx->srq_armed    = false;
+    ctx->setup_due    = true;
+    scope_cache_store(&ctx->key, ctx->cfg);
+    show_status(WS2812_BLUE);
+    return true;
+}
+
+/* Returns true if the scope's state or profile changed */
+static bool collect_poll(size_t i) {
+    scope_ctx_t *ctx = &scopes[i];
+    if (!ctx->poll_done) {
+        return false;
+    }
+    ctx->poll_done    = false;
+    ctx->poll_pending = false;
+    if (ctx->poll_idn) {
+        ctx->poll_idn = false;
+        return collect_idn(i);
+    }
+
+    scope_state_t newstate;
+    if (!ctx->cfg || !ctx->poll_len ||
+        !scope_parse_state(ctx->cfg, ctx->poll_buf, ctx->poll_len,
+                           &newstate)) {
+        show_error();
+        return false;
+    }
+    mark_fresh(i);
+    if (ctx->state == newstate) {
+        return false;
+    }
+    ctx->state = newstate;
+    return true;
+}
+
+/* Set up newly connected scopes and start polls on ready ones. Sets
+ * *changed if anything changed that the LEDs should show. Checks for a press
+ * before every transaction and, if one is waiting, returns false with the
+ * rest left for the next round. */
+static bool update_scope(size_t i, bool *changed) {
+    USBHTmcDriver *tmcp = &USBHTMCD[i];
+    scope_ctx_t *  ctx  = &scopes[i];
+
+    if (tmcp->state == USBHTMC_STATE_ACTIVE) {
+        if (press_waiting()) {
+            return false;
+        }
+        usbDbgPrintf("TMC: Connected, TMC%d", (int)i);
+        usbhtmcStart(tmcp, &tmc_config);
+        ctx->cfg          = NULL;
+        ctx->state        = SCOPE_STATE_STOPPED;
+        ctx->lookup_due   = true;
+        ctx->identify     = true;
+        ctx->setup_due    = false;
+        ctx->poll_pending = false;
+        ctx->poll_done    = false;
+        ctx->srq_pending  = false;
+        ctx->clear_due    = false;
+        ctx->query_due    = false;
+        ctx->status_ready = false;
+        ctx->srq_armed    = false;
+        *changed          = true;
+    }
+    if (tmcp->state != USBHTMC_STATE_READY || ctx->poll_pending) {
+        return true;
+    }
+    if (ctx->lookup_due) {
+        if (press_waiting()) {
+            return false;
+        }
+        /* A known device is usable straight away, *IDN? confirms its
+         * profile next */
+        ctx->lookup_due = false;
+        set_profile(ctx, scope_cache_lookup(tmcp, &ctx->key));
+        if (ctx->cfg) {
+            ctx->setup_due = true;
+            show_status(WS2812_BLUE);
+            *changed = true;
+        }
+    }
+    if (ctx->setup_due) {
+        if (press_waiting()) {
+            return false;
+        }
+        ctx->setup_due    = false;
+        ctx->status_ready = scope_setup_status(tmcp, ctx->cfg);
+        ctx->srq_armed = ctx->status_ready && usbhtmcHasNotifications(tmcp);
+    }
+    if (ctx->identify) {
+        /* Asked like a poll, so a press cancels it rather than waiting out
+         * its timeout. collect_idn() takes the answer. */
+        if (press_waiting()) {
+            return false;
+        }
+        ctx->poll_idn     = true;
+        ctx->poll_pending = scope_request_idn(
+            tmcp, ctx->poll_buf, sizeof(ctx->poll_buf), poll_done_cb);
+        return true;
+    }
+    if (!ctx->cfg) {
+        return true;
+    }
+
+    /* The status byte only tells that the state changed. A change is read
+     * with a full query, after clearing it so the next one latches again.
+     * Both stay due if a press comes first. */
+    if (press_waiting()) {
+        return false;
+    }
+    osalSysLock();
+    if (ctx->srq_pending) {
+        ctx->clear_due = true;
+        ctx->query_due = true;
+    }
+    ctx->srq_pending = false;
+    osalSysUnlock();
+    if (!ctx->query_due && ctx->status_ready &&
+        (ctx->poll_count++ % FULL_POLL_EVERY) != 0) {
+        bool stb_changed = false;
+        poll_transaction();
+        if (scope_read_status(tmcp, ctx->cfg, &stb_changed) &&
+            !stb_changed) {
+            mark_fresh(i);
+            return true;
+        }
+        ctx->clear_due = stb_changed;
+        ctx->query_due = true;
+    }
+    if (ctx->clear_due) {
+        if (press_waiting()) {
+            return false;
+        }
+        poll_transaction();
+        scope_clear_status(tmcp, ctx->cfg);
+        ctx->clear_due = false;
+    }
+    if (press_waiting()) {
+        return false;
+    }
+    poll_transaction();
+    ctx->poll_idn     = false;
+    ctx->poll_pending = scope_request_state(
+        tmcp, ctx->cfg, ctx->poll_buf, sizeof(ctx->poll_buf), poll_done_cb);
+    ctx->query_due = !ctx->poll_pending;
+    return true;
+}
+
+static scope_state_t next_state(scope_state_t state) {
+    if (state != SCOPE_STATE_STOPPED) {
+        return SCOPE_STATE_STOPPED;
+    }
+    return palReadLine(LINE_MODE) ? SCOPE_STATE_RUNNING : SCOPE_STATE_SINGLE;
+}
+
+/* The scope a press goes to, or -1. With group mode every press goes to
+ * all ready scopes, following the first. */
+static int press_target(msg_t evt) {
+#if FOOTSW_GROUP_MODE
+    (void)evt;
+    return nth_ready_scope(0);
+#else
+    int target = nth_ready_scope(evt == EVT_FOOTSW2_PRESS ? 1 : 0);
+    return target < 0 ? nth_ready_scope(0) : target;
+#endif
+}
+
+#if !FOOTSW_GROUP_MODE
+/* Returns false if the press failed */
+static bool press_scope(size_t i, scope_state_t newstate) {
+    scope_ctx_t *         ctx = &scopes[i];
+    scope_state_t         actual;
+    USBHTmcGroupWrite     write  = {.tmcp = &USBHTMCD[i]};
+    const scope_config_t *cfg    = ctx->cfg;
+    scope_frames_t *      frames = &ctx->frames;
+
+    /* Don't make the press wait out a poll. A group of one, for the write
+     * timestamps. */
+    if (ctx->poll_pending) {
+        usbhtmcAskCancel(&USBHTMCD[i]);
+    }
+    bool ok =
+        scope_set_state_group(&write, &cfg, &frames, 1, newstate, &actual);
+    if (!ok) {
+        show_press_failed();
+    } else {
+        ctx->state = actual;
+    }
+    if (write.ok) {
+        trace_mark(TRACE_SUBMIT, write.start);
+        trace_mark(TRACE_COMPLETE, write.done);
+        if (cfg->confirm != SCOPE_PROFILE_CONFIRM_NONE) {
+            mark_fresh(i);
+        }
+    }
+    /* Any poll answer predates the new state */
+    ctx->poll_done    = false;
+    ctx->poll_pending = false;
+    return ok;
+}
+#else
+/* Send newstate to every ready scope not already in it. Returns false if
+ * the press failed. */
+static bool press_group(scope_state_t newstate) {
+    USBHTmcGroupWrite     writes[USBH_TMC_MAX_INSTANCES];
+    const scope_config_t *cfgs[USBH_TMC_MAX_INSTANCES];
+    scope_frames_t *      frames[USBH_TMC_MAX_INSTANCES];
+    scope_state_t         actual[USBH_TMC_MAX_INSTANCES];
+    size_t                index[USBH_TMC_MAX_INSTANCES];
+    unsigned              count = 0;
+
+    for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+        if (scope_ready(i) && scopes[i].state != newstate) {
+            /* Don't make the press wait out a poll */
+            if (scopes[i].poll_pending) {
+                usbhtmcAskCancel(&USBHTMCD[i]);
+            }
+            writes[count].tmcp = &USBHTMCD[i];
+            cfgs[count]        = scopes[i].cfg;
+            frames[count]      = &scopes[i].frames;
+            index[count++]     = i;
+        }
+    }
+    if (!count) {
+        usbDbgPrintf("TMC: presses cancelled out");
+        return true;
+    }
+    bool ok = scope_set_state_group(writes, cfgs, frames, count, newstate,
+                                    actual) == count;
+    if (!ok) {
+        show_press_failed();
+    }
+
+    rtcnt_t earliest = 0;
+    rtcnt_t latest   = 0;
+    bool    have     = false;
+    for (unsigned n = 0; n < count; n++) {
+        if (!writes[n].ok) {
+            continue;
+        }
+        if (!have || (int32_t)(writes[n].done - earliest) < 0) {
+            earliest = writes[n].done;
+            /* All first URBs go out together, so any start will do */
+            trace_mark(TRACE_SUBMIT, writes[n].start);
+        }
+        if (!have || (int32_t)(writes[n].done - latest) > 0) {
+            latest = writes[n].done;
+        }
+        have = true;
+    }
+    if (have) {
+        trace_mark(TRACE_COMPLETE, earliest);
+        trace_mark(TRACE_LAST, latest);
+    }
+    for (unsigned n = 0; n < count; n++) {
+        scope_ctx_t *ctx = &scopes[index[n]];
+        if (writes[n].ok) {
+            ctx->state = actual[n];
+            if (cfgs[n]->confirm != SCOPE_PROFILE_CONFIRM_NONE) {
+                mark_fresh(index[n]);
+            }
+        }
+        ctx->poll_done    = false;
+        ctx->poll_pending = false;
+    }
+    return ok;
+}
+#endif
+
+/* Take the states wanted since the last call and send those that differ
+ * from the scopes' states. Returns false if any of them failed. */
+static bool press(void) {
+    scope_state_t want[USBH_TMC_MAX_INSTANCES];
+    bool          have[USBH_TMC_MAX_INSTANCES];
+    bool          ok = true;
+
+    osalSysLock();
+    for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+        want[i]           = desired[i];
+        have[i]           = desire_pending[i];
+        desire_pending[i] = false;
+    }
+    press_posted = false;
+    osalSysUnlock();
+
+    for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+        if (!have[i] || !scope_ready(i)) {
+            continue;
+        }
+#if FOOTSW_GROUP_MODE
+        /* Desires are kept against the first scope, the rest follow it,
+         * even when the first is already in the wanted state */
+        ok = press_group(want[i]);
+        break;
+#else
+        if (want[i] == scopes[i].state) {
+            usbDbgPrintf("TMC%d: presses cancelled out", (int)i);
+            continue;
+        }
+        ok = press_scope(i, want[i]) && ok;
+#endif
+    }
+    return ok;
+}
+
+static bool is_press(msg_t evt) {
+    return evt == EVT_FOOTSW1_PRESS || evt == EVT_FOOTSW2_PRESS ||
+           evt == EVT_BTN_CLICK;
+}
+
+/* Work out the state a press asks for, following any earlier press not yet
+ * sent, and show it straight away if the LEDs follow that scope. ThreadUsb
+ * is woken unless a press message is already waiting for it. */
+static void post_press(msg_t evt) {
+    int target = press_target(evt);
+    if (target < 0) {
+        return;
+    }
+    bool primary = target == nth_ready_scope(0);
+
+    osalSysLock();
+    scope_state_t state = primary ? shown_state : scopes[target].state;
+    if (desire_pending[target]) {
+        state = desired[target];
+    }
+    state                  = next_state(state);
+    desired[target]        = state;
+    desire_pending[target] = true;
+    bool post              = !press_posted;
+    press_posted           = true;
+    osalSysUnlock();
+
+    if (primary) {
+        show_predicted(state);
+    }
+    if (post) {
+        chMBPostAheadTimeout(&usb_mailbox, evt, TIME_INFINITE);
+    }
+}
+
+/* True if a press is at the head of the mailbox. Polls check this between
+ * transfers, so a press waits for at most the one already in flight. */
+static bool press_waiting(void) {
+    osalSysLock();
+    bool waiting = chMBGetUsedCountI(&usb_mailbox) > 0 &&
+                   is_press(chMBPeekI(&usb_mailbox));
+    osalSysUnlock();
+    return waiting;
+}
+
+/* Input thread, handing events to ThreadUsb without ever touching USB */
 static THD_WORKING_AREA(waThreadMain, 1024);
 static THD_FUNCTION(ThreadMain, arg) {
 
     (void)arg;
 
     events_init();
-    scope_state_t         scope_state      = SCOPE_STATE_STOPPED;
-    const scope_config_t *cfg              = NULL;
-    systime_t             last_update_time = chVTGetSystemTimeX();
 
     while (true) {
-        // chSemWait(&sem);
-        msg_t evt = iqGetTimeout(&event_queue, TIME_MS2I(100));
-
-        if ((chVTGetSystemTimeX() - last_update_time) > TIME_MS2I(200)) {
-            last_update_time = chVTGetSystemTimeX();
-            if (USBHTMCD[0].state == USBHTMC_STATE_ACTIVE) {
-                usbDbgPrintf("TMC: Connected, TMC%d", 0);
-                usbhtmcStart(&USBHTMCD[0]);
-                cfg = detect_scope(&USBHTMCD[0]);
-                if (!cfg) {
-                    setLedColor(&led_config, 0, WS2812_RED);
-                    setLedFlashing(&led_config, TRUE, 0);
-                } else {
-                    setLedColor(&led_config, 0, WS2812_BLUE);
-                    setLedTarget(&led_config, TRUE, 0, 5000);
+        msg_t evt = iqGet(&event_queue);
+
+        if (is_press(evt)) {
+            trace_mark(TRACE_DEQUEUE, chSysGetRealtimeCounterX());
+            post_press(evt);
+        } else if (evt == EVT_BTN_HOLD) {
+            chMBPostTimeout(&usb_mailbox, evt, TIME_INFINITE);
+        }
+    }
+}
+
+/* USB I/O worker: runs presses and the scope polls */
+static THD_WORKING_AREA(waThreadUsb, 1024);
+static THD_FUNCTION(ThreadUsb, arg) {
+
+    (void)arg;
+
+    systime_t last_update_time = chVTGetSystemTimeX();
+    bool      srq_armed        = false;
+
+    while (true) {
+        sysinterval_t interval = poll_interval();
+        sysinterval_t elapsed  = chVTGetSystemTimeX() - last_update_time;
+        msg_t         evt      = MSG_TIMEOUT;
+        chMBFetchTimeout(&usb_mailbox, &evt,
+                         elapsed < interval ? interval - elapsed
+                                            : TIME_IMMEDIATE);
+
+        bool changed  = false;
+        bool finished = false;
+        bool failed   = false;
+        for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+            changed = collect_poll(i) || changed;
+        }
+
+        if (is_press(evt)) {
+            trace_mark(TRACE_WORKER, chSysGetRealtimeCounterX());
+            failed  = !press();
+            changed = true;
+        } else if (evt == EVT_BTN_HOLD) {
+            for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+                if (scope_ready(i)) {
+                    usbhtmcIndicatorPulse(&USBHTMCD[i], NULL);
+                }
+            }
+        } else if (evt == EVT_LED_CORRECTED) {
+            end_corrected();
+        } else if (evt != EVT_POLL_DONE) {
+            /* Poll due, SRQ or new scope. A press stops the round, which
+             * then runs again once the press is done. */
+            bool connected = false;
+            bool armed     = true;
+            finished       = true;
+            for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+                if (!update_scope(i, &changed)) {
+                    finished = false;
+                    break;
                 }
-                if (evt == MSG_TIMEOUT) {
-                    evt = EVT_NOP;
+                if (USBHTMCD[i].state == USBHTMC_STATE_READY) {
+                    connected = true;
+                    armed     = armed && scopes[i].srq_armed;
                 }
-            } else if (USBHTMCD[0].state == USBHTMC_STATE_READY) {
-                if (cfg) {
-                    scope_state_t newstate;
-                    if (!cfg->get_state(&USBHTMCD[0], &newstate)) {
-                        setLedColor(&led_config, 0, WS2812_RED);
-                        setLedFlashing(&led_config, TRUE, 0);
-                    } else {
-                        if (scope_state != newstate) {
-                            scope_state = newstate;
-                            if (evt == MSG_TIMEOUT) {
-                                evt = EVT_NOP;
-                            }
-                        }
-                    }
+            }
+            if (finished) {
+                last_update_time = chVTGetSystemTimeX();
+                srq_armed        = connected && armed;
+                if (!connected) {
+                    show_status(WS2812_RED);
                 }
-            } else {
-                setLedColor(&led_config, 0, WS2812_RED);
-                setLedTarget(&led_config, TRUE, 0, 5000);
             }
         }
-        if (evt == MSG_TIMEOUT) {
+        if (changed || finished) {
+            poll_next(any_scope_in(SCOPE_STATE_SINGLE),
+                      finished && !changed &&
+                          !any_scope_in(SCOPE_STATE_RUNNING),
+                      srq_armed);
+        }
+        if (evt == MSG_TIMEOUT && !changed) {
             continue;
         }
 
-        chprintf((BaseSequentialStream *)&SD2, "evt = %d\r\n", evt);
-        switch (evt) {
-            case EVT_FOOTSW1_PRESS:
-            case EVT_FOOTSW2_PRESS:
-            case EVT_BTN_CLICK:
-                if (USBHTMCD[0].state == USBHTMC_STATE_READY && cfg) {
-                    scope_state_t newstate = SCOPE_STATE_STOPPED;
-                    if (scope_state == SCOPE_STATE_STOPPED) {
-                        if (palReadLine(LINE_MODE)) {
-                            newstate = SCOPE_STATE_RUNNING;
-                        } else {
-                            newstate = SCOPE_STATE_SINGLE;
-                        }
-                    }
-                    if (!cfg->set_state(&USBHTMCD[0], newstate)) {
-                        setLedFlashing(&led_config, TRUE, 0);
-                    } else {
-                        scope_state = newstate;
-                    }
-                }
-                break;
-            case EVT_BTN_HOLD:
-                usbhtmcIndicatorPulse(&USBHTMCD[0], NULL);
-                break;
-
-            default:
-                break;
-        }
-        update_leds(scope_state);
+        /* The LEDs follow the first connected scope. A press to a scope
+         * that cannot confirm it leaves the prediction for the next poll. */
+        int  primary   = nth_ready_scope(0);
+        bool confirmed = primary < 0 || !is_press(evt) ||
+                         scopes[primary].cfg->confirm !=
+                             SCOPE_PROFILE_CONFIRM_NONE;
+        show_state(primary >= 0 ? scopes[primary].state
+                                : SCOPE_STATE_STOPPED,
+                   confirmed, failed);
     }
 }
 
 
 
+
 const struct image_header __attribute__((section(".header"))) image_header = {
     .magic = IMAGE_HEADER_MAGIC_INIT,
     .version_major = 1,
@@ -224,11 +821,16 @@ int main(void) {
 
     // PA2(TX) and PA3(RX) are routed to USART2
     sdStart(&SD2, NULL);
+    console_init();
+    chVTObjectInit(&corrected_vt);
 
     chThdCreateStatic(waThreadLed, sizeof(waThreadLed), NORMALPRIO, ThreadLed,
                       0);
-    chThdCreateStatic(waThreadMain, sizeof(waThreadMain), NORMALPRIO,
+    /* Input runs above the USB worker so presses are queued at once */
+    chThdCreateStatic(waThreadMain, sizeof(waThreadMain), NORMALPRIO + 1,
                       ThreadMain, 0);
+    chThdCreateStatic(waThreadUsb, sizeof(waThreadUsb), NORMALPRIO, ThreadUsb,
+                      0);
 
     // turn on USB power
     palSetPad(GPIOA, GPIOA_HOST_VBUS_EN);
@@ -236,9 +838,23 @@ int main(void) {
 
     usbhStart(&USBHD1);
 
+    bool announced[USBH_TMC_MAX_INSTANCES] = {false};
     for (;;) {
         usbhMainLoop(&USBHD1);
 
+        /* Have ThreadUsb start new scopes now rather than at its next
+         * poll */
+        for (size_t i = 0; i < USBH_TMC_MAX_INSTANCES; i++) {
+            bool active = USBHTMCD[i].state == USBHTMC_STATE_ACTIVE;
+            if (active && !announced[i]) {
+                osalSysLock();
+                chMBPostI(&usb_mailbox, EVT_SCOPE_CONNECTED);
+                osalOsRescheduleS();
+                osalSysUnlock();
+            }
+            announced[i] = active;
+        }
+
         chThdSleepMilliseconds(100);
     }
 }
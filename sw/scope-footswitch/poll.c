@@ -0,0 +1,99 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "poll.h"
+
+/* Written by ThreadUsb, read by the console under the lock */
+static sysinterval_t interval = POLL_INTERVAL;
+static unsigned      idle_rounds;
+static uint32_t      transactions;
+static systime_t     stats_since;
+static systime_t     fresh_at;
+static sysinterval_t max_stale;
+
+/* Pick the interval to the next round, after a round finished or anything
+ * happened. single is set if a scope waits for a single acquisition, idle
+ * if a round found every scope stopped with nothing changed, which doubles
+ * the interval. Anything else ends the backoff. */
+sysinterval_t poll_next(bool single, bool idle, bool srq_armed) {
+    sysinterval_t next = srq_armed ? SRQ_POLL_INTERVAL : POLL_INTERVAL;
+
+    if (single) {
+        idle_rounds = 0;
+        next        = POLL_FAST_INTERVAL;
+    } else if (idle) {
+        for (unsigned i = 0; i < idle_rounds && next < POLL_MAX_INTERVAL;
+             i++) {
+            next *= 2;
+        }
+        if (next > POLL_MAX_INTERVAL) {
+            next = POLL_MAX_INTERVAL;
+        } else {
+            idle_rounds++;
+        }
+    } else {
+        idle_rounds = 0;
+    }
+    osalSysLock();
+    interval = next;
+    osalSysUnlock();
+    return next;
+}
+
+sysinterval_t poll_interval(void) {
+    return interval;
+}
+
+/* Count one state query or status byte read */
+void poll_transaction(void) {
+    osalSysLock();
+    transactions++;
+    osalSysUnlock();
+}
+
+/* The state the LEDs follow was just read from the scope */
+void poll_fresh(void) {
+    systime_t now = chVTGetSystemTimeX();
+
+    osalSysLock();
+    if (fresh_at && now - fresh_at > max_stale) {
+        max_stale = now - fresh_at;
+    }
+    fresh_at = now;
+    osalSysUnlock();
+}
+
+void poll_get_stats(poll_stats_t *stats, bool clear) {
+    systime_t now = chVTGetSystemTimeX();
+
+    osalSysLock();
+    uint32_t elapsed_ms = TIME_I2MS(now - stats_since);
+    stats->transactions = transactions;
+    stats->per_hour =
+        elapsed_ms ? (uint64_t)transactions * 3600000 / elapsed_ms : 0;
+    stats->interval_ms  = TIME_I2MS(interval);
+    stats->stale_ms     = fresh_at ? TIME_I2MS(now - fresh_at) : 0;
+    stats->max_stale_ms = TIME_I2MS(max_stale);
+    if (clear) {
+        transactions = 0;
+        stats_since  = now;
+        max_stale    = 0;
+    }
+    osalSysUnlock();
+}
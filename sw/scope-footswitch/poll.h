@@ -0,0 +1,52 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef POLL_H
+#define POLL_H
+
+#include "hal.h"
+
+/* Scheduling of the scope state polls. Polls run fast while a single
+ * acquisition waits for its trigger, at the base rate while a scope runs,
+ * and back off exponentially while every scope sits stopped. Any press or
+ * state change ends the backoff. */
+
+/* While a scope waits for a single acquisition to trigger */
+#define POLL_FAST_INTERVAL TIME_MS2I(20)
+/* Base rates, SRQs only hint at state changes so keep a slow poll */
+#define POLL_INTERVAL TIME_MS2I(200)
+#define SRQ_POLL_INTERVAL TIME_MS2I(1000)
+/* Ceiling of the idle backoff */
+#define POLL_MAX_INTERVAL TIME_MS2I(10000)
+
+typedef struct {
+    uint32_t transactions; /* poll exchanges since the stats were cleared */
+    uint32_t per_hour;     /* the same, scaled to an hour */
+    uint32_t interval_ms;  /* current poll interval */
+    uint32_t stale_ms;     /* since the LEDs' scope state was last read */
+    uint32_t max_stale_ms; /* longest gap between reads */
+} poll_stats_t;
+
+sysinterval_t poll_next(bool single, bool idle, bool srq_armed);
+sysinterval_t poll_interval(void);
+void          poll_transaction(void);
+void          poll_fresh(void);
+void          poll_get_stats(poll_stats_t *stats, bool clear);
+
+#endif
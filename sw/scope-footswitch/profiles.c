@@ -0,0 +1,102 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2019 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Default scope profiles. These are linked into the profile flash region and
+ * only ever read back from there (see scope_profiles() in scope.c), so a
+ * table written to the region later replaces them. */
+
+#include "scope_profile.h"
+
+#define KEEP SCOPE_PROFILE_KEEP
+
+#define NUM_DEFAULT_PROFILES 4
+
+const struct scope_profile_table scope_profile_defaults
+    __attribute__((section(".profiles"), used)) = {
+        .magic       = SCOPE_PROFILE_MAGIC_INIT,
+        .version     = SCOPE_PROFILE_VERSION,
+        .count       = NUM_DEFAULT_PROFILES,
+        .record_size = sizeof(struct scope_profile),
+        .profiles    = {
+            /* Answers e.g. "RUNSTOP;1", the stop-after mode then whether
+             * it is acquiring */
+            {
+                .vendor     = "TEKTRONIX",
+                .state_cmds = {"ACQuire:STATE STOP",
+                               "ACQuire:STOPAfter RUNSTOP; STATE RUN",
+                               "ACQuire:STOPAfter SEQUENCE; STATE RUN"},
+                .state_query = "ACQuire:STOPAfter?; STATE?",
+                .confirm     = SCOPE_PROFILE_CONFIRM_STATE,
+                .num_fields  = 2,
+                .num_rules   = 4,
+                .rules       = {{0, SCOPE_PROFILE_RUNNING, "RUNSTop"},
+                                {0, SCOPE_PROFILE_SINGLE, "SEQuence"},
+                                {1, SCOPE_PROFILE_STOPPED, "0"},
+                                {1, KEEP, "1"}},
+            },
+            /* Run bit (3) events of the Operation Status register, on
+             * starting and stopping, summarized into OPER (bit 7) of the
+             * status byte until *CLS. The setup clears any event left from
+             * before. */
+            {
+                .vendor       = "KEYSIGHT",
+                .state_cmds   = {"STOP", "RUN", "SINGle"},
+                .state_query  = "RSTate?",
+                .status_setup = "*CLS;*SRE 128;:OPEE 8;:OPER:PTR 8;:OPER:NTR 8",
+                .stb_run_mask = 0x80,
+                .confirm      = SCOPE_PROFILE_CONFIRM_STATE,
+                .num_fields   = 1,
+                .num_rules    = 3,
+                .rules        = {{0, SCOPE_PROFILE_RUNNING, "RUN"},
+                                 {0, SCOPE_PROFILE_SINGLE, "SINGle"},
+                                 {0, SCOPE_PROFILE_STOPPED, "STOP"}},
+            },
+            /* Answers the trigger status then the sweep mode. The sweep
+             * mode is checked first so a stopped status wins. The trigger
+             * status lags run/stop commands, so those confirm with *OPC?. */
+            {
+                .vendor      = "RIGOL",
+                .state_cmds  = {"STOP", "RUN", "SINGle"},
+                .state_query = "TRIGger:STATus?;SWEep?",
+                .confirm     = SCOPE_PROFILE_CONFIRM_OPC,
+                .num_fields  = 2,
+                .num_rules   = 7,
+                .rules       = {{1, SCOPE_PROFILE_SINGLE, "SINGle"},
+                                {1, SCOPE_PROFILE_RUNNING, SCOPE_PROFILE_ANY},
+                                {0, SCOPE_PROFILE_STOPPED, "STOP"},
+                                {0, KEEP, "RUN"},
+                                {0, KEEP, "TD"},
+                                {0, KEEP, "AUTO"},
+                                {0, KEEP, "WAIT"}},
+            },
+            /* sw/tmcemu, which takes both Tektronix and Keysight commands */
+            {
+                .model      = "TMCEMU",
+                .state_cmds = {"ACQuire:STATE STOP",
+                               "ACQuire:STOPAfter RUNSTOP; STATE RUN",
+                               "ACQuire:STOPAfter SEQUENCE; STATE RUN"},
+                .state_query = "RSTate?",
+                .confirm     = SCOPE_PROFILE_CONFIRM_STATE,
+                .num_fields  = 1,
+                .num_rules   = 3,
+                .rules       = {{0, SCOPE_PROFILE_RUNNING, "RUN"},
+                                {0, SCOPE_PROFILE_SINGLE, "SINGle"},
+                                {0, SCOPE_PROFILE_STOPPED, "STOP"}},
+            },
+        }};
@@ -22,8 +22,10 @@
 #include "ch.h"
 #include "hal.h"
 #include "chprintf.h"
+#include "flash.h"
 #include "usbh_usbtmc.h"
 
+#include <ctype.h>
 #include <string.h>
 
 #define SCOPE_DEBUG_ENABLE_TRACE 0
@@ -63,288 +65,732 @@
     } while (0)
 #endif
 
-#define CMD_TIMEOUT TIME_MS2I(1000)
-const char *strip_chars = " \r\n\t";
+/* Everything else uses usbhtmcTimeout(), which adapts to the instrument's
+ * round trip time; the first query has nothing to go on yet */
+#define IDN_TIMEOUT TIME_MS2I(1000)
+/* Starting or stopping acquisition can take a scope far longer than a query
+ * round trip, so state commands and their confirms wait at least this */
+#define STATE_CMD_TIMEOUT TIME_MS2I(1000)
+/* A field of an SCPI response, not NUL terminated */
+typedef struct {
+    const char *ptr;
+    size_t      len;
+} scpi_span_t;
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
 
-/* remove characters from the ends of string*/
-static char *strstrip(char *str, const char *remove) {
-    /* Trim front */
-    while (strchr(remove, *str) && *str) {
-        str++;
+/* Set field to [start, stop), dropping the quotes around a string */
+static void set_field(scpi_span_t *field, const char *start, const char *stop) {
+    if (!start) {
+        field->ptr = stop;
+        field->len = 0;
+        return;
     }
-    char *end = str + strlen(str) - 1;
-    while (strchr(remove, *end) && end >= str) {
-        *end = 0;
-        end--;
+    if (stop - start >= 2 && (*start == '"' || *start == '\'') &&
+        stop[-1] == *start) {
+        start++;
+        stop--;
     }
-    return str;
+    field->ptr = start;
+    field->len = stop - start;
 }
 
-static size_t tokenize(char *resp, char *elems[], size_t num_elems) {
-    size_t found = 1;
-    elems[0]     = resp;
-    for (size_t i = 1; i < num_elems; i++) {
-        elems[i] = elems[i - 1];
-        while (*elems[i]) {
-            if (*elems[i] == ',' || *elems[i] == ';' || *elems[i] == '\n') {
-                found++;
-                *elems[i] = 0;
+/* Split an SCPI response into at most max fields in one pass. Fields are
+ * separated by ',', ';' or newlines outside of quoted strings and trimmed of
+ * whitespace. Once max - 1 fields are found the last one takes the rest of
+ * the response. Returns the number of fields found. */
+static size_t scpi_split(const char *resp, size_t len, scpi_span_t fields[],
+                         size_t max) {
+    const char *end   = resp + len;
+    const char *start = NULL; /* First non-space character of the field */
+    const char *stop  = resp; /* Just past its last non-space character */
+    size_t      count = 0;
+    char        quote = 0;
+
+    if (!max) {
+        return 0;
+    }
+    /* The message terminator does not start another field */
+    while (end > resp && is_space(end[-1])) {
+        end--;
+    }
+    for (const char *p = resp; p < end; p++) {
+        char c = *p;
+        if (quote) {
+            quote = c == quote ? 0 : quote;
+            stop  = p + 1;
+        } else if ((c == ',' || c == ';' || c == '\n') && count + 1 < max) {
+            set_field(&fields[count++], start, stop);
+            start = NULL;
+            stop  = p + 1;
+        } else if (!is_space(c)) {
+            if (!start) {
+                start = p;
             }
-            elems[i]++;
-            if (found > i) {
-                break;
+            if (c == '"' || c == '\'') {
+                quote = c;
             }
+            stop = p + 1;
         }
-        strstrip(elems[i - 1], strip_chars);
     }
-    strstrip(elems[found - 1], strip_chars);
-    return found;
+    set_field(&fields[count++], start, stop);
+    return count;
+}
+
+/* Case-insensitive match against an SCPI mnemonic such as "SINGle", taking
+ * either the short form (the upper case part, "SING") or the long form */
+static bool scpi_match(const char *mnemonic, scpi_span_t field) {
+    bool short_form = true;
+
+    for (size_t i = 0; i < field.len; i++) {
+        char m = mnemonic[i];
+        if (!m || tolower((unsigned char)m) !=
+                      tolower((unsigned char)field.ptr[i])) {
+            return false;
+        }
+        short_form = short_form && !islower((unsigned char)m);
+    }
+    return !mnemonic[field.len] ||
+           (short_form && islower((unsigned char)mnemonic[field.len]));
 }
 
 static int run_cmd(USBHTmcDriver *tmcp, const char *cmd) {
     sdbgf("Running scope command '%s'\r\n", cmd);
-    if (!usbhtmcWrite(tmcp, cmd, strlen(cmd), CMD_TIMEOUT)) {
+    if (!usbhtmcWrite(tmcp, cmd, strlen(cmd), usbhtmcTimeout(tmcp))) {
         serrf("Scope command '%s' failed\r\n", cmd);
         return 0;
     }
     return 1;
 }
 
-static int run_ask(USBHTmcDriver *tmcp, const char *cmd, char *buf,
-                   size_t buf_len) {
+/* rx must hold USBH_TMC_RX_BUF_SIZE(len) bytes. The answer is received in
+ * place, see usbhtmcRxPayload(), and its length returned, or 0 on failure */
+static size_t run_ask(USBHTmcDriver *tmcp, const char *cmd, uint8_t *rx,
+                      size_t len, systime_t timeout) {
     chDbgAssert(tmcp, "tmcp");
     chDbgAssert(cmd, "tmcp");
-    chDbgAssert(buf, "buf");
-    chDbgAssert(buf_len > 0, "buf_len");
-    size_t len;
+    chDbgAssert(rx, "rx");
+    chDbgAssert(len > 0, "len");
 
     sdbgf("Asking '%s'\r\n", cmd);
-    if (!(len = usbhtmcAsk(tmcp, cmd, strlen(cmd), buf, buf_len - 1,
-                           CMD_TIMEOUT))) {
+    size_t n = usbhtmcAskInPlace(tmcp, cmd, strlen(cmd), rx, len, timeout);
+    if (!n) {
         serrf("State query failed ask '%s'\r\n", cmd);
-        return 0;
     }
-    buf[len] = 0;
+    return n;
+}
 
-    return 1;
+/* Start and end of the profile flash region, from the linker script */
+extern const struct scope_profile_table __profiles_base__;
+extern const uint8_t                    __profiles_end__[];
+
+#define TERMINATED(s) (memchr((s), 0, sizeof(s)) != NULL)
+
+/* The profile table, or NULL if the region holds no usable table */
+static const struct scope_profile_table *scope_profiles(void) {
+    static const uint8_t magic[4] = SCOPE_PROFILE_MAGIC_INIT;
+
+    const struct scope_profile_table *table = &__profiles_base__;
+    size_t size = __profiles_end__ - (const uint8_t *)table -
+                  SCOPE_PROFILE_CACHE_SIZE;
+
+    if (memcmp(table->magic, magic, sizeof(magic)) ||
+        table->version != SCOPE_PROFILE_VERSION ||
+        table->record_size != sizeof(struct scope_profile) ||
+        sizeof(*table) + table->count * sizeof(struct scope_profile) > size) {
+        serrf("No valid scope profile table\r\n");
+        return NULL;
+    }
+    return table;
 }
 
-static int tektronix_set_state(USBHTmcDriver *tmcp, scope_state_t state) {
-    static const char stopcmd[]      = "ACQuire:STATE STOP";
-    static const char runsinglecmd[] = "ACQuire:STOPAfter SEQUENCE; STATE RUN";
-    static const char runstopcmd[]   = "ACQuire:STOPAfter RUNSTOP; STATE RUN";
-    const char *      cmd            = 0;
-    switch (state) {
-        case SCOPE_STATE_SINGLE:
-            cmd = runsinglecmd;
-            break;
-        case SCOPE_STATE_RUNNING:
-            cmd = runstopcmd;
-            break;
-        case SCOPE_STATE_STOPPED:
-        default:
-            cmd = stopcmd;
-            break;
+/* Profiles may come from outside the firmware build, so check everything the
+ * engine relies on before using one */
+static bool profile_valid(const scope_config_t *cfg) {
+    if (!TERMINATED(cfg->vendor) || !TERMINATED(cfg->model) ||
+        !TERMINATED(cfg->fw_min) || !TERMINATED(cfg->fw_max) ||
+        !TERMINATED(cfg->state_query) || !TERMINATED(cfg->status_setup) ||
+        cfg->num_fields == 0 || cfg->num_fields > SCOPE_PROFILE_MAX_FIELDS ||
+        cfg->num_rules > SCOPE_PROFILE_MAX_RULES ||
+        cfg->confirm > SCOPE_PROFILE_CONFIRM_OPC) {
+        return false;
+    }
+    for (size_t i = 0; i < SCOPE_PROFILE_NUM_STATES; i++) {
+        if (!TERMINATED(cfg->state_cmds[i])) {
+            return false;
+        }
     }
+    for (size_t i = 0; i < cfg->num_rules; i++) {
+        const struct scope_profile_rule *rule = &cfg->rules[i];
+        if (rule->field >= cfg->num_fields || !TERMINATED(rule->token) ||
+            (rule->state >= SCOPE_PROFILE_NUM_STATES &&
+             rule->state != SCOPE_PROFILE_KEEP)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    return run_cmd(tmcp, cmd);
+/* Case-insensitive ordering of str against field, for the sorted tables */
+static int span_compare(const char *str, scpi_span_t field) {
+    for (size_t i = 0; i < field.len; i++) {
+        int d = toupper((unsigned char)str[i]) -
+                toupper((unsigned char)field.ptr[i]);
+        if (!str[i] || d) {
+            return d ? d : -1;
+        }
+    }
+    return str[field.len] ? 1 : 0;
 }
 
-static int tektronix_get_state(USBHTmcDriver *tmcp, scope_state_t *state) {
-    static const char allstatecmd[] = "ACQuire:STOPAfter?; STATE?";
-    enum { ELEM_STOPAFTER, ELEM_STATE };
+static scpi_span_t to_span(const char *str) {
+    return (scpi_span_t){str, strlen(str)};
+}
 
-    scope_state_t newstate;
-    char          buf[65];
+/* Manufacturer names scopes report, mapped to the name profiles use. Sorted
+ * by alias for the binary search in canonical_vendor(). */
+static const struct {
+    const char *alias;
+    const char *vendor;
+} vendor_aliases[] = {
+    {"AGILENT", "KEYSIGHT"},
+    {"AGILENT TECHNOLOGIES", "KEYSIGHT"},
+    {"KEYSIGHT TECHNOLOGIES", "KEYSIGHT"},
+    {"RIGOL TECHNOLOGIES", "RIGOL"},
+    {"TEKTRONIX", "TEKTRONIX"},
+};
+
+#define NUM_VENDOR_ALIASES (sizeof(vendor_aliases) / sizeof(vendor_aliases[0]))
+
+static scpi_span_t canonical_vendor(scpi_span_t vendor) {
+    size_t lo = 0, hi = NUM_VENDOR_ALIASES;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int    cmp = span_compare(vendor_aliases[mid].alias, vendor);
+        if (!cmp) {
+            return to_span(vendor_aliases[mid].vendor);
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return vendor;
+}
 
-    if (!run_ask(tmcp, allstatecmd, buf, sizeof(buf))) {
-        return 0;
+/* Case-insensitive glob match of the n character pattern pat, with '*' and
+ * '?', backtracking to the last '*' on a mismatch */
+static bool glob_match(const char *pat, size_t n, scpi_span_t field) {
+    size_t p = 0, i = 0, star = SIZE_MAX, star_i = 0;
+
+    while (i < field.len) {
+        if (p < n && pat[p] == '*') {
+            star   = p++;
+            star_i = i;
+        } else if (p < n && (pat[p] == '?' ||
+                             toupper((unsigned char)pat[p]) ==
+                                 toupper((unsigned char)field.ptr[i]))) {
+            p++;
+            i++;
+        } else if (star != SIZE_MAX) {
+            p = star + 1;
+            i = ++star_i;
+        } else {
+            return false;
+        }
+    }
+    while (p < n && pat[p] == '*') {
+        p++;
     }
+    return p == n;
+}
 
-    size_t count;
-    char * elems[6];
-    if ((count = tokenize(buf, elems, 2)) < 2) {
-        serrf("State query failed tokenize %u\r\n", count);
-        return 0;
+/* globs is a '|' separated list of patterns, empty to match anything */
+static bool match_model(const char *globs, scpi_span_t model) {
+    if (!*globs) {
+        return true;
+    }
+    while (true) {
+        const char *end = strchr(globs, '|');
+        size_t      n   = end ? (size_t)(end - globs) : strlen(globs);
+        if (glob_match(globs, n, model)) {
+            return true;
+        }
+        if (!end) {
+            return false;
+        }
+        globs = end + 1;
+    }
+}
+
+/* Compare version strings, digit runs by value and anything else by
+ * character, so "06.20.01002" < "6.21" < "06.100" */
+static int version_compare(const char *ver, scpi_span_t field) {
+    const char *a = ver, *b = field.ptr, *b_end = field.ptr + field.len;
+
+    while (*a && b < b_end) {
+        if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+            unsigned long va = 0, vb = 0;
+            while (isdigit((unsigned char)*a)) {
+                va = va * 10 + (*a++ - '0');
+            }
+            while (b < b_end && isdigit((unsigned char)*b)) {
+                vb = vb * 10 + (*b++ - '0');
+            }
+            if (va != vb) {
+                return va < vb ? -1 : 1;
+            }
+        } else {
+            int d = toupper((unsigned char)*a++) - toupper((unsigned char)*b++);
+            if (d) {
+                return d;
+            }
+        }
     }
+    return *a ? 1 : (b < b_end ? -1 : 0);
+}
 
-    // First check the mode
-    if (!strcasecmp(elems[ELEM_STOPAFTER], "RUNSTOP")) {
-        newstate = SCOPE_STATE_RUNNING;
-    } else if (!strcasecmp(elems[ELEM_STOPAFTER], "SEQUENCE")) {
-        newstate = SCOPE_STATE_SINGLE;
-    } else {
-        serrf("State query failed to parse STOPAfter\r\n");
+static bool match_firmware(const scope_config_t *cfg, scpi_span_t version) {
+    return (!cfg->fw_min[0] || version_compare(cfg->fw_min, version) <= 0) &&
+           (!cfg->fw_max[0] || version_compare(cfg->fw_max, version) > 0);
+}
+
+static int profile_parse_state(const scope_config_t *cfg, const char *resp,
+                               size_t len, scope_state_t *state) {
+    scpi_span_t fields[SCOPE_PROFILE_MAX_FIELDS];
+    unsigned    matched  = 0;
+    int         newstate = -1;
+
+    size_t count = scpi_split(resp, len, fields, cfg->num_fields);
+    if (count < cfg->num_fields) {
+        serrf("State query failed tokenize %u\r\n", count);
         return 0;
     }
 
-    // Then check the state
-    if (!strcasecmp(elems[ELEM_STATE], "0")) {
-        newstate = SCOPE_STATE_STOPPED;
-    } else if (!strcasecmp(elems[ELEM_STATE], "1")) {
-        /* running*/
-    } else {
-        serrf("State query failed to parse STATE\r\n");
+    for (size_t i = 0; i < cfg->num_rules; i++) {
+        const struct scope_profile_rule *rule = &cfg->rules[i];
+        unsigned                         bit  = 1U << rule->field;
+        bool any = !strcmp(rule->token, SCOPE_PROFILE_ANY);
+
+        if ((matched & bit) ||
+            (!any && !scpi_match(rule->token, fields[rule->field]))) {
+            continue;
+        }
+        matched |= bit;
+        if (rule->state != SCOPE_PROFILE_KEEP) {
+            newstate = rule->state;
+        }
+    }
+    if (matched != (1U << cfg->num_fields) - 1 || newstate < 0) {
+        serrf("State query failed to parse '%.*s'\r\n", (int)len, resp);
         return 0;
     }
     *state = newstate;
     return 1;
 }
 
-static int keysight_set_state(USBHTmcDriver *tmcp, scope_state_t state) {
-    static const char stopcmd[]      = "STOP";
-    static const char runsinglecmd[] = "SINGle";
-    static const char runstopcmd[]   = "RUN";
-    const char *      cmd            = 0;
-    switch (state) {
-        case SCOPE_STATE_SINGLE:
-            cmd = runsinglecmd;
-            break;
-        case SCOPE_STATE_RUNNING:
-            cmd = runstopcmd;
-            break;
-        case SCOPE_STATE_STOPPED:
-        default:
-            cmd = stopcmd;
-            break;
+/* Valid profiles sorted by vendor, keeping table order within a vendor, so
+ * a lookup is a binary search plus a scan of that vendor's profiles. Built
+ * on first use; the table does not change while running. */
+static const struct scope_profile_table *profile_table;
+static uint8_t                           profile_order[UINT8_MAX];
+static size_t                            profile_count;
+
+#define PROFILE(i) (&profile_table->profiles[profile_order[i]])
+
+static bool load_profiles(void) {
+    if (profile_table) {
+        return true;
+    }
+    const struct scope_profile_table *table = scope_profiles();
+    if (!table) {
+        return false;
+    }
+    for (size_t i = 1; i < NUM_VENDOR_ALIASES; i++) {
+        chDbgAssert(span_compare(vendor_aliases[i - 1].alias,
+                                 to_span(vendor_aliases[i].alias)) < 0,
+                    "vendor_aliases order");
     }
 
-    return run_cmd(tmcp, cmd);
+    size_t n = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        const scope_config_t *cfg = &table->profiles[i];
+        if (!profile_valid(cfg)) {
+            swarnf("Skipping invalid scope profile %u\r\n", i);
+            continue;
+        }
+        /* Insertion sort, stable so table order sets priority */
+        size_t j = n++;
+        while (j > 0 &&
+               span_compare(table->profiles[profile_order[j - 1]].vendor,
+                            to_span(cfg->vendor)) > 0) {
+            profile_order[j] = profile_order[j - 1];
+            j--;
+        }
+        profile_order[j] = i;
+    }
+    profile_table = table;
+    profile_count = n;
+    return true;
+}
+
+/* First matching profile among the sorted ones from start with vendor */
+static const scope_config_t *find_profile(size_t start, scpi_span_t vendor,
+                                          const scpi_span_t fields[]) {
+    enum { ELEM_MODEL = 1, ELEM_FIRMWARE = 3 };
+
+    for (size_t i = start; i < profile_count &&
+                           !span_compare(PROFILE(i)->vendor, vendor);
+         i++) {
+        const scope_config_t *cfg = PROFILE(i);
+        if (match_model(cfg->model, fields[ELEM_MODEL]) &&
+            match_firmware(cfg, fields[ELEM_FIRMWARE])) {
+            return cfg;
+        }
+    }
+    return NULL;
 }
 
-static int keysight_get_state(USBHTmcDriver *tmcp, scope_state_t *state) {
-    static const char rstatecmd[] = "RSTate?";
-    char              buf[65];
+static const scope_config_t *match_profile(const scpi_span_t fields[]) {
+    enum { ELEM_VENDOR = 0 };
 
-    if (!run_ask(tmcp, rstatecmd, buf, sizeof(buf))) {
-        return 0;
+    scpi_span_t vendor = canonical_vendor(fields[ELEM_VENDOR]);
+    size_t      lo = 0, hi = profile_count;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (span_compare(PROFILE(mid)->vendor, vendor) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    const scope_config_t *cfg = find_profile(lo, vendor, fields);
+    if (!cfg) {
+        /* Profiles for any vendor sort first */
+        cfg = find_profile(0, to_span(""), fields);
     }
+    return cfg;
+}
 
-    char *resp = strstrip(buf, strip_chars);
+/* Start the *IDN? whose answer scope_match_idn() takes, without blocking so
+ * that a press can cancel it with usbhtmcAskCancel() */
+int scope_request_idn(USBHTmcDriver *tmcp, char *buf, size_t buf_len,
+                      usbhtmc_ask_cb_t cb) {
+    static const char idncmd[] = "*IDN?";
 
-    // First check the mode
-    if (!strcasecmp(resp, "RUN")) {
-        *state = SCOPE_STATE_RUNNING;
-    } else if (!strcasecmp(resp, "SING")) {
-        *state = SCOPE_STATE_SINGLE;
-    } else if (!strcasecmp(resp, "STOP")) {
-        *state = SCOPE_STATE_STOPPED;
-    } else {
-        serrf("State query failed to parse RSTate: %s\r\n", resp);
-        return 0;
+    chDbgAssert(buf_len > 0, "buf_len");
+
+    sdbgf("Asking '%s' (async)\r\n", idncmd);
+    return usbhtmcAskAsync(tmcp, idncmd, strlen(idncmd), buf, buf_len - 1,
+                           IDN_TIMEOUT, cb);
+}
+
+/* The profile for a scope from its *IDN? answer, or NULL */
+const scope_config_t *scope_match_idn(const char *resp, size_t len) {
+    scpi_span_t fields[4];
+
+    sinfof("Scope *IDN? returns '%.*s'", (int)len, resp);
+
+    if (scpi_split(resp, len, fields, 4) != 4) {
+        serrf("Failed to tokenize IDN");
+        return NULL;
     }
 
-    return 1;
+    if (!load_profiles()) {
+        return NULL;
+    }
+    const scope_config_t *cfg = match_profile(fields);
+    if (!cfg) {
+        serrf("No profile for this scope\r\n");
+    }
+    return cfg;
 }
 
-static int rigol_set_state(USBHTmcDriver *tmcp, scope_state_t state) {
-    static const char stopcmd[]      = "STOP";
-    static const char runsinglecmd[] = "SINGle";
-    static const char runcmd[]       = "RUN";
-    const char *      cmd            = 0;
-    switch (state) {
-        case SCOPE_STATE_SINGLE:
-            cmd = runsinglecmd;
-            break;
-        case SCOPE_STATE_RUNNING:
-            cmd = runcmd;
-            break;
-        case SCOPE_STATE_STOPPED:
-        default:
-            cmd = stopcmd;
+/* Reconnect cache: an append-only log of device to profile entries in the
+ * erased end of the profile region. The newest entry for a device wins.
+ * Writing a profile table erases the sector and with it the cache, so
+ * cached indexes always refer to the table in flash. Once the log is full
+ * new devices go through *IDN? every time. */
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t serial;
+    uint8_t  profile; /* Index in the profile table */
+    uint8_t  check;   /* ~profile */
+    uint16_t marker;  /* CACHE_MARKER, written last */
+} cache_entry_t;
+
+#define CACHE_MARKER 0x5CA5
+#define CACHE_WORDS (sizeof(cache_entry_t) / sizeof(uint32_t))
+#define CACHE_ENTRIES (SCOPE_PROFILE_CACHE_SIZE / sizeof(cache_entry_t))
+
+static const cache_entry_t *cache_entries(void) {
+    return (const cache_entry_t *)(__profiles_end__ - SCOPE_PROFILE_CACHE_SIZE);
+}
+
+static bool cache_entry_free(const cache_entry_t *entry) {
+    const uint32_t *words = (const uint32_t *)entry;
+    for (size_t i = 0; i < CACHE_WORDS; i++) {
+        if (words[i] != 0xFFFFFFFFU) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* FNV-1a, so any serial number string fits the entry */
+static uint32_t hash_serial(const char *str) {
+    uint32_t hash = 2166136261U;
+    while (*str) {
+        hash = (hash ^ (uint8_t)*str++) * 16777619U;
+    }
+    return hash;
+}
+
+/* Newest entry for key, or NULL. Sets *free_slot to the first unused entry,
+ * or NULL if the log is full. */
+static const cache_entry_t *cache_find(const scope_cache_key_t *key,
+                                       const cache_entry_t **free_slot) {
+    const cache_entry_t *entries = cache_entries();
+    const cache_entry_t *found   = NULL;
+
+    *free_slot = NULL;
+    for (size_t i = 0; i < CACHE_ENTRIES; i++) {
+        const cache_entry_t *entry = &entries[i];
+        if (cache_entry_free(entry)) {
+            *free_slot = entry;
             break;
+        }
+        if (entry->marker == CACHE_MARKER &&
+            (uint8_t)(entry->check ^ entry->profile) == 0xFF &&
+            entry->vid == key->vid && entry->pid == key->pid &&
+            entry->serial == key->serial) {
+            found = entry;
+        }
+    }
+    return found;
+}
+
+const scope_config_t *scope_cache_lookup(USBHTmcDriver *tmcp,
+                                         scope_cache_key_t *key) {
+    const usbh_device_t *dev = tmcp->dev;
+    char                 serial[64];
+
+    key->vid    = dev->devDesc.idVendor;
+    key->pid    = dev->devDesc.idProduct;
+    key->serial = 0;
+    if (dev->devDesc.iSerialNumber &&
+        usbhDeviceReadString(tmcp->dev, serial, sizeof(serial),
+                             dev->devDesc.iSerialNumber,
+                             dev->langID0) == HAL_SUCCESS) {
+        key->serial = hash_serial(serial);
     }
 
-    return run_cmd(tmcp, cmd);
+    if (!load_profiles()) {
+        return NULL;
+    }
+    const cache_entry_t *free_slot;
+    const cache_entry_t *entry = cache_find(key, &free_slot);
+    if (!entry || entry->profile >= profile_table->count ||
+        !profile_valid(&profile_table->profiles[entry->profile])) {
+        return NULL;
+    }
+    sinfof("Cached profile %u for %04x:%04x\r\n", entry->profile, key->vid,
+           key->pid);
+    return &profile_table->profiles[entry->profile];
 }
 
-static int rigol_get_state(USBHTmcDriver *tmcp, scope_state_t *state) {
-    static const char cmd[] = "TRIGger:STATus?;SWEep?";
-    char              buf[65];
+void scope_cache_store(const scope_cache_key_t *key,
+                       const scope_config_t *   cfg) {
+    const cache_entry_t *free_slot;
+    const cache_entry_t *entry = cache_find(key, &free_slot);
 
-    if (!run_ask(tmcp, cmd, buf, sizeof(buf))) {
-        return 0;
+    if (!profile_table || !cfg) {
+        return;
+    }
+    uint8_t profile = cfg - profile_table->profiles;
+    if (entry && entry->profile == profile) {
+        return;
+    }
+    if (!free_slot) {
+        swarnf("Profile cache full\r\n");
+        return;
     }
 
-    char *resp = strstrip(buf, strip_chars);
+    cache_entry_t new_entry = {key->vid, key->pid, key->serial, profile,
+                               (uint8_t)~profile, CACHE_MARKER};
+    if (!flash_program(free_slot, (const uint32_t *)&new_entry,
+                       CACHE_WORDS)) {
+        serrf("Profile cache write failed\r\n");
+    }
+}
 
-    sdbgf("State query got '%s'\r\n", resp);
+/* Command a state plus its confirming query */
+#define CONFIRM_CMD_LEN (2 * SCOPE_PROFILE_CMD_LEN + 2)
+
+/* The command entering state, with the profile's confirming query appended
+ * in buf if it has one */
+static const char *state_cmd(const scope_config_t *cfg, scope_state_t state,
+                             char *buf, size_t size) {
+    switch (cfg->confirm) {
+        case SCOPE_PROFILE_CONFIRM_STATE:
+            chsnprintf(buf, size, "%s;:%s", cfg->state_cmds[state],
+                       cfg->state_query);
+            return buf;
+        case SCOPE_PROFILE_CONFIRM_OPC:
+            chsnprintf(buf, size, "%s;*OPC?", cfg->state_cmds[state]);
+            return buf;
+        default:
+            return cfg->state_cmds[state];
+    }
+}
 
-    size_t count;
-    char * elems[2];
-    if ((count = tokenize(resp, elems, 2)) < 2) {
-        serrf("State query failed tokenize %u\r\n", count);
+static systime_t state_cmd_timeout(USBHTmcDriver *tmcp) {
+    systime_t timeout = usbhtmcTimeout(tmcp);
+    return timeout > STATE_CMD_TIMEOUT ? timeout : STATE_CMD_TIMEOUT;
+}
+
+/* Parse the answer to a command from state_cmd() */
+static int parse_confirm(const scope_config_t *cfg, const char *resp,
+                         size_t len, scope_state_t requested,
+                         scope_state_t *state) {
+    scpi_span_t field;
+
+    if (cfg->confirm == SCOPE_PROFILE_CONFIRM_STATE) {
+        return profile_parse_state(cfg, resp, len, state);
+    }
+    if (scpi_split(resp, len, &field, 1) != 1 || !scpi_match("1", field)) {
+        serrf("Unexpected *OPC? answer '%.*s'\r\n", (int)len, resp);
         return 0;
     }
-    sdbgf("tokens  '%s' '%s'\r\n", elems[0], elems[1]);
+    *state = requested;
+    return 1;
+}
 
-    // First check the status
-    if (!strcasecmp(elems[0], "RUN") || !strcasecmp(elems[0], "TD") ||
-        !strcasecmp(elems[0], "AUTO") || !strcasecmp(elems[0], "WAIT")) {
-        // Then check if we are in single sweep
-        if (!strcasecmp(elems[1], "SING")) {
-            *state = SCOPE_STATE_SINGLE;
-        } else {
-            *state = SCOPE_STATE_RUNNING;
+/* Encode the command for every state, see state_cmd(), for use with
+ * scope_set_state_group(). Called once per connection, so the press path does
+ * no formatting or copying. */
+int scope_encode_frames(const scope_config_t *cfg, scope_frames_t *frames) {
+    char cmd[CONFIRM_CMD_LEN];
+
+    for (int i = 0; i < SCOPE_PROFILE_NUM_STATES; i++) {
+        const char *c = state_cmd(cfg, (scope_state_t)i, cmd, sizeof(cmd));
+        if (!usbhtmcEncodeFrame(&frames->state[i], c, strlen(c))) {
+            serrf("Cannot encode state command '%s'\r\n", c);
+            return 0;
         }
-    } else if (!strcasecmp(elems[0], "STOP")) {
-        *state = SCOPE_STATE_STOPPED;
-    } else {
-        serrf("State query failed to parse TRIGger:STATus '%s'\r\n", elems[0]);
-        return 0;
     }
-
     return 1;
 }
 
-static const scope_config_t tektronix_cfg = {tektronix_set_state,
-                                             tektronix_get_state};
-
-static const scope_config_t keysight_cfg = {keysight_set_state,
-                                            keysight_get_state};
+/* Send the command for state, pre-encoded in frames, to every scope in
+ * writes, with the first packet to each submitted back to back. The scopes
+ * then answer their confirming queries in parallel. actual[i] is set for each
+ * successful write to the state the scope reports, or to state for profiles
+ * that cannot confirm it in the same exchange. Returns the number of
+ * successful writes. */
+unsigned scope_set_state_group(USBHTmcGroupWrite *       writes,
+                               const scope_config_t *const cfgs[],
+                               scope_frames_t *const       frames[],
+                               unsigned count, scope_state_t state,
+                               scope_state_t actual[]) {
+    USBH_DEFINE_BUFFER(uint8_t rx[USBH_TMC_RX_BUF_SIZE(SCOPE_STATE_BUF_SIZE)]);
+    systime_t timeout = 0;
+
+    chDbgAssert(count <= USBH_TMC_MAX_INSTANCES, "count");
+    for (unsigned i = 0; i < count; i++) {
+        writes[i].cmd   = NULL;
+        writes[i].frame = &frames[i]->state[state];
+        /* One deadline for the group, long enough for the slowest scope */
+        if (state_cmd_timeout(writes[i].tmcp) > timeout)
+            timeout = state_cmd_timeout(writes[i].tmcp);
+    }
+    unsigned ok = usbhtmcWriteGroup(writes, count, timeout);
+    for (unsigned i = 0; i < count; i++) {
+        actual[i] = state;
+        if (!writes[i].ok || cfgs[i]->confirm == SCOPE_PROFILE_CONFIRM_NONE) {
+            continue;
+        }
+        size_t len =
+            usbhtmcReadInPlace(writes[i].tmcp, rx, SCOPE_STATE_BUF_SIZE - 1,
+                               state_cmd_timeout(writes[i].tmcp));
+        if (!len || !parse_confirm(cfgs[i], usbhtmcRxPayload(rx), len, state,
+                                   &actual[i])) {
+            writes[i].ok = false;
+            ok--;
+        }
+    }
+    if (ok != count) {
+        serrf("Group command failed on %u of %u scopes\r\n", count - ok,
+              count);
+    }
+    return ok;
+}
 
-static const scope_config_t rigol_cfg = {rigol_set_state, rigol_get_state};
+int scope_get_state(USBHTmcDriver *tmcp, const scope_config_t *cfg,
+                    scope_state_t *state) {
+    USBH_DEFINE_BUFFER(uint8_t rx[USBH_TMC_RX_BUF_SIZE(SCOPE_STATE_BUF_SIZE)]);
 
-static const scope_config_t tmcemu_cfg = {tektronix_set_state,
-                                          keysight_get_state};
+    size_t len = run_ask(tmcp, cfg->state_query, rx, SCOPE_STATE_BUF_SIZE - 1,
+                         usbhtmcTimeout(tmcp));
+    if (!len) {
+        return 0;
+    }
+    return profile_parse_state(cfg, usbhtmcRxPayload(rx), len, state);
+}
 
-static const struct {
-    const char *          vendor;
-    const char *          model;
-    const scope_config_t *config;
-} id_table[] = {{"Tektronix", NULL, &tektronix_cfg},
-                {"KEYSIGHT TECHNOLOGIES", NULL, &keysight_cfg},
-                {"Agilent", NULL, &keysight_cfg},
-                {"RIGOL TECHNOLOGIES", NULL, &rigol_cfg},
-                {NULL, "TMCEMU", &tmcemu_cfg}};
-
-const scope_config_t *detect_scope(USBHTmcDriver *tmcp) {
-    static const char idncmd[] = "*IDN?";
+int scope_request_state(USBHTmcDriver *tmcp, const scope_config_t *cfg,
+                        char *buf, size_t buf_len, usbhtmc_ask_cb_t cb) {
+    chDbgAssert(buf_len > 0, "buf_len");
 
-    enum { ELEM_VENDOR = 0, ELEM_MODEL = 1 };
+    sdbgf("Asking '%s' (async)\r\n", cfg->state_query);
+    return usbhtmcAskAsync(tmcp, cfg->state_query, strlen(cfg->state_query),
+                           buf, buf_len - 1, usbhtmcTimeout(tmcp), cb);
+}
 
-    char  buf[256];
-    char *elems[4];
+int scope_parse_state(const scope_config_t *cfg, const char *resp,
+                      size_t len, scope_state_t *state) {
+    return profile_parse_state(cfg, resp, len, state);
+}
 
-    if (!run_ask(tmcp, idncmd, buf, sizeof(buf))) {
+int scope_setup_status(USBHTmcDriver *tmcp, const scope_config_t *cfg) {
+    if (!cfg->status_setup[0] || !usbhtmcHas488_2(tmcp)) {
         return 0;
     }
+    return run_cmd(tmcp, cfg->status_setup);
+}
 
-    sinfof("Scope *IDN? returns '%s'", buf);
+/* Status byte poll, valid once scope_setup_status succeeded. *changed is set
+ * if the run state changed since the last scope_clear_status(). The status
+ * byte cannot tell to what, so a change needs a full state query. */
+int scope_read_status(USBHTmcDriver *tmcp, const scope_config_t *cfg,
+                      bool *changed) {
+    uint8_t stb;
 
-    if (tokenize(buf, elems, 4) != 4) {
-        serrf("Failed to tokenize IDN");
-        return NULL;
+    if (!cfg->stb_run_mask || !usbhtmcHas488_2(tmcp)) {
+        return 0;
     }
-
-    for (size_t i = 0; i < sizeof(id_table) / sizeof(id_table[0]); i++) {
-        if ((!id_table[i].vendor ||
-             !strcasecmp(id_table[i].vendor, elems[ELEM_VENDOR])) &&
-            (!id_table[i].model ||
-             !strcasecmp(id_table[i].model, elems[ELEM_MODEL]))) {
-            return id_table[i].config;
-        }
+    if (usbhtmcReadStatusByte(tmcp, &stb, usbhtmcTimeout(tmcp)) !=
+        USBH_URBSTATUS_OK) {
+        serrf("Status byte read failed\r\n");
+        return 0;
     }
+    sdbgf("Status byte %02x\r\n", stb);
 
-    return NULL;
+    *changed = (stb & cfg->stb_run_mask) != 0;
+    return 1;
+}
+
+/* Clear the latched state change so the next one sets the status byte again.
+ * Send before the state query, so a change during the query is not lost. */
+int scope_clear_status(USBHTmcDriver *tmcp, const scope_config_t *cfg) {
+    if (!cfg->stb_run_mask || !usbhtmcHas488_2(tmcp)) {
+        return 0;
+    }
+    return run_cmd(tmcp, "*CLS");
 }
@@ -20,7 +20,8 @@
 #ifndef _SCOPE_H
 #define _SCOPE_H
 
-typedef struct USBHTmcDriver USBHTmcDriver;
+#include "scope_profile.h"
+#include "usbh_usbtmc.h"
 
 // typedef struct USBHTmcDriver;
 
@@ -30,11 +31,48 @@ typedef enum {
     SCOPE_STATE_SINGLE
 } scope_state_t;
 
+/* A profile from the flash profile table, see scope_profile.h */
+typedef struct scope_profile scope_config_t;
+
+/* Identifies a device for the reconnect cache */
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t serial; /* Hash of the iSerialNumber string, 0 without one */
+} scope_cache_key_t;
+
+/* The profile's state commands, with any confirming query, encoded once so
+ * that a press only has to tag and submit one, see usbhtmcEncodeFrame() */
 typedef struct {
-    int (*set_state)(USBHTmcDriver *tmcp, scope_state_t state);
-    int (*get_state)(USBHTmcDriver *tmcp, scope_state_t *state);
-} scope_config_t;
+    USBHTmcFrame state[SCOPE_PROFILE_NUM_STATES];
+} scope_frames_t;
+
+/* Size of the response buffer to pass to scope_request_state */
+#define SCOPE_STATE_BUF_SIZE 65
+/* Size of the response buffer to pass to scope_request_idn */
+#define SCOPE_IDN_BUF_SIZE 256
 
-const scope_config_t *detect_scope(USBHTmcDriver *tmcp);
+int scope_request_idn(USBHTmcDriver *tmcp, char *buf, size_t buf_len,
+                      usbhtmc_ask_cb_t cb);
+const scope_config_t *scope_match_idn(const char *resp, size_t len);
+const scope_config_t *scope_cache_lookup(USBHTmcDriver *    tmcp,
+                                         scope_cache_key_t *key);
+void scope_cache_store(const scope_cache_key_t *key, const scope_config_t *cfg);
+int  scope_encode_frames(const scope_config_t *cfg, scope_frames_t *frames);
+unsigned scope_set_state_group(USBHTmcGroupWrite *       writes,
+                               const scope_config_t *const cfgs[],
+                               scope_frames_t *const       frames[],
+                               unsigned count, scope_state_t state,
+                               scope_state_t actual[]);
+int scope_get_state(USBHTmcDriver *tmcp, const scope_config_t *cfg,
+                    scope_state_t *state);
+int scope_request_state(USBHTmcDriver *tmcp, const scope_config_t *cfg,
+                        char *buf, size_t buf_len, usbhtmc_ask_cb_t cb);
+int scope_parse_state(const scope_config_t *cfg, const char *resp,
+                      size_t len, scope_state_t *state);
+int scope_setup_status(USBHTmcDriver *tmcp, const scope_config_t *cfg);
+int scope_read_status(USBHTmcDriver *tmcp, const scope_config_t *cfg,
+                      bool *changed);
+int scope_clear_status(USBHTmcDriver *tmcp, const scope_config_t *cfg);
 
 #endif /* _SCOPE_H */
@@ -0,0 +1,102 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+typedef struct {
+    rtcnt_t t[TRACE_NUM_POINTS];
+    uint8_t marked; /* bit per point stamped */
+} trace_record_t;
+
+static trace_record_t ring[TRACE_RING_SIZE];
+static size_t         ring_head;  /* next record to open */
+static size_t         ring_count; /* records opened, up to the ring size */
+static uint32_t       scratch[TRACE_RING_SIZE];
+
+/* Open a record for a press seen at when, from the pin interrupt */
+void trace_startI(rtcnt_t when) {
+    trace_record_t *rec = &ring[ring_head];
+
+    rec->t[TRACE_EXTI] = when;
+    rec->marked        = 1U << TRACE_EXTI;
+    ring_head          = (ring_head + 1) % TRACE_RING_SIZE;
+    if (ring_count < TRACE_RING_SIZE) {
+        ring_count++;
+    }
+}
+
+/* Stamp point into the newest record, unless it already has it. A press
+ * overtaken by another is left incomplete rather than mixed up with it. */
+void trace_mark(trace_point_t point, rtcnt_t when) {
+    osalSysLock();
+    if (ring_count) {
+        trace_record_t *rec =
+            &ring[(ring_head + TRACE_RING_SIZE - 1) % TRACE_RING_SIZE];
+        if (!(rec->marked & (1U << point))) {
+            rec->t[point] = when;
+            rec->marked |= 1U << point;
+        }
+    }
+    osalSysUnlock();
+}
+
+static void sort(uint32_t *v, size_t n) {
+    for (size_t i = 1; i < n; i++) {
+        uint32_t x = v[i];
+        size_t   j = i;
+        for (; j > 0 && v[j - 1] > x; j--) {
+            v[j] = v[j - 1];
+        }
+        v[j] = x;
+    }
+}
+
+/* Not reentrant, only the console calls this */
+void trace_stats(trace_point_t from, trace_point_t to, trace_stats_t *stats) {
+    const uint8_t want  = (1U << from) | (1U << to);
+    size_t        n     = 0;
+    uint64_t      total = 0;
+
+    osalSysLock();
+    for (size_t i = 0; i < ring_count; i++) {
+        if ((ring[i].marked & want) == want) {
+            scratch[n++] = ring[i].t[to] - ring[i].t[from];
+        }
+    }
+    osalSysUnlock();
+
+    for (size_t i = 0; i < n; i++) {
+        scratch[i] = RTC2US(STM32_HCLK, scratch[i]);
+        total += scratch[i];
+    }
+    sort(scratch, n);
+
+    stats->count  = n;
+    stats->min_us = n ? scratch[0] : 0;
+    stats->avg_us = n ? total / n : 0;
+    stats->p99_us = n ? scratch[(n * 99 + 99) / 100 - 1] : 0;
+    stats->max_us = n ? scratch[n - 1] : 0;
+}
+
+void trace_clear(void) {
+    osalSysLock();
+    ring_head  = 0;
+    ring_count = 0;
+    osalSysUnlock();
+}
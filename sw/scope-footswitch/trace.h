@@ -0,0 +1,57 @@
+/*
+ * This file is part of the scope-footswitch project.
+ *
+ * Copyright (C) 2018 Paul Roukema <paul@paulroukema.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "hal.h"
+
+/* Latency tracing of footswitch presses, from the pin interrupt to the
+ * command reaching the scope. Each press opens a record in a RAM ring and
+ * later points are stamped into the newest record as the press moves
+ * through the firmware. */
+
+#define TRACE_RING_SIZE 64
+
+/* Points along a press, in order */
+typedef enum {
+    TRACE_EXTI = 0, /* pal_event_cb() saw the press */
+    TRACE_DEQUEUE,  /* ThreadMain took it off event_queue */
+    TRACE_WORKER,   /* ThreadUsb took it from its mailbox */
+    TRACE_SUBMIT,   /* command URB submitted */
+    TRACE_COMPLETE, /* command URB completed */
+    TRACE_LAST,     /* last group scope's command URB completed */
+    TRACE_NUM_POINTS
+} trace_point_t;
+
+/* Times in us between two points over the records having both */
+typedef struct {
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} trace_stats_t;
+
+void trace_startI(rtcnt_t when);
+void trace_mark(trace_point_t point, rtcnt_t when);
+void trace_stats(trace_point_t from, trace_point_t to, trace_stats_t *stats);
+void trace_clear(void);
+
+#endif
@@ -74,24 +74,36 @@
     } while (0)
 #endif
 
-#define USBTMC_INTERFACE_CLASS 0xFE
-#define USBTMC_INTERFACE_SUBCLASS 0x03
-#define USBTMC_INTERFACE_PROTOCOL_USBTMC 0x0
-#define USBTMC_INTERFACE_PROTOCOL_USB488 0x1
+enum {
+    USBH_TMC_REQ_INITIATE_ABORT_BULK_OUT     = 1,
+    USBH_TMC_REQ_CHECK_ABORT_BULK_OUT_STATUS = 2,
+    USBH_TMC_REQ_INITIATE_ABORT_BULK_IN      = 3,
+    USBH_TMC_REQ_CHECK_ABORT_BULK_IN_STATUS  = 4,
+    USBH_TMC_REQ_INITIATE_CLEAR              = 5,
+    USBH_TMC_REQ_CHECK_CLEAR_STATUS          = 6,
+    USBH_TMC_REQ_GET_CAPABILITIES            = 7,
+    USBH_TMC_REQ_INDICATOR_PULSE             = 64,
+    USBH_TMC_REQ_READ_STATUS_BYTE            = 128,
+    USBH_TMC_REQ_REN_CONTROL                 = 160,
+    USBH_TMC_REQ_GO_TO_LOCAL                 = 161,
+};
 
+/* Directions needing an abort before the next transfer */
 enum {
-    USBH_TMC_REQ_GET_CAPABILITIES = 7,
-    USBH_TMC_REQ_INDICATOR_PULSE  = 64,
+    TMC_RECOVER_OUT = 1,
+    TMC_RECOVER_IN  = 2,
 };
 
 enum {
     USBH_TMC_MSGID_DEV_DEP_MSG_OUT        = 1,
     USBH_TMC_MSGID_REQUEST_DEV_DEP_MSG_IN = 2,
     USBH_TMC_MSGID_DEV_DEP_MSG_IN         = 2,
+    USBH_TMC_MSGID_TRIGGER                = 128,
 };
 
 enum {
-    USBH_TMC_ATTRIBUTE_EOM = 1,
+    USBH_TMC_ATTRIBUTE_EOM      = 1,
+    USBH_TMC_ATTRIBUTE_TERMCHAR = 2,
 };
 
 struct dev_dep_msg_out_hdr {
@@ -132,8 +144,14 @@ struct dev_dep_request_msg_in_hdr {
 
 static USBH_DEFINE_BUFFER(
     uint8_t inbuf[USBH_TMC_MAX_INSTANCES][USBH_TMC_BUF_SIZE]);
+/* Second receive bank, so _read_locked can queue the next chunk while the
+ * previous one is copied out */
+static USBH_DEFINE_BUFFER(
+    uint8_t inbuf_alt[USBH_TMC_MAX_INSTANCES][USBH_TMC_BUF_SIZE]);
 static USBH_DEFINE_BUFFER(
     uint8_t outbuf[USBH_TMC_MAX_INSTANCES][USBH_TMC_BUF_SIZE]);
+static USBH_DEFINE_BUFFER(
+    uint8_t intbuf[USBH_TMC_MAX_INSTANCES][USBH_TMC_INT_BUF_SIZE]);
 USBHTmcDriver USBHTMCD[USBH_TMC_MAX_INSTANCES];
 
 static void                    _tmc_init(void);
@@ -141,6 +159,7 @@ static usbh_baseclassdriver_t *_load(usbh_device_t *dev,
                                      const uint8_t *descriptor, uint16_t rem);
 static void                    _unload(usbh_baseclassdriver_t *drv);
 static void                    _stop_locked(USBHTmcDriver *tmcp);
+static void                    _load_capabilities(USBHTmcDriver *tmcp);
 
 static const usbh_classdriver_vmt_t class_driver_vmt = {_tmc_init, _load,
                                                         _unload};
@@ -183,6 +202,7 @@ alloc_ok:
     tmcp->epout.status = USBH_EPSTATUS_UNINITIALIZED;
     tmcp->epint.status = USBH_EPSTATUS_UNINITIALIZED;
     tmcp->ifnum        = ifdesc->bInterfaceNumber;
+    tmcp->protocol     = ifdesc->bInterfaceProtocol;
     usbhEPSetName(&dev->ctrl, "TMC[CTRL]");
 
     /* parse the configuration descriptor */
@@ -257,10 +277,50 @@ static void _stop_locked(USBHTmcDriver *tmcp) {
     if (tmcp->epint.status != USBH_EPSTATUS_UNINITIALIZED) {
         usbhEPClose(&tmcp->epint);
     }
+    tmcp->recover = 0;
     tmcp->state = USBHTMC_STATE_ACTIVE;
 }
 
-void usbhtmcStart(USBHTmcDriver *tmcp) {
+enum {
+    USBH_TMC_NOTIFY1_FLAG     = 0x80,
+    USBH_TMC_NOTIFY1_SRQ      = 0x81,
+    USBH_TMC_NOTIFY1_TAG_MASK = 0x7F,
+};
+
+static void _int_cb(usbh_urb_t *urb) {
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)urb->userData;
+    const uint8_t *      buf  = (const uint8_t *)urb->buff;
+
+    switch (urb->status) {
+        case USBH_URBSTATUS_OK:
+            if (urb->actualLength < 2 || !(buf[0] & USBH_TMC_NOTIFY1_FLAG)) {
+                uwarnf("[TMC] Unexpected interrupt IN data, len=%u",
+                       urb->actualLength);
+            } else if (buf[0] == USBH_TMC_NOTIFY1_SRQ) {
+                udbgf("[TMC] SRQ, status byte %02x", buf[1]);
+                if (tmcp->config && tmcp->config->srq_cb) {
+                    tmcp->config->srq_cb(tmcp, buf[1]);
+                }
+            } else if ((buf[0] & USBH_TMC_NOTIFY1_TAG_MASK) == tmcp->stb_tag) {
+                tmcp->stb_value = buf[1];
+                tmcp->stb_ready = true;
+                osalThreadResumeI(&tmcp->stb_thread, MSG_OK);
+            }
+            break;
+        case USBH_URBSTATUS_DISCONNECTED:
+        case USBH_URBSTATUS_CANCELLED:
+            return;
+        case USBH_URBSTATUS_TIMEOUT:
+            break;
+        default:
+            uerrf("[TMC] Interrupt IN status = %d (!= OK)", urb->status);
+            break;
+    }
+    usbhURBObjectResetI(urb);
+    usbhURBSubmitI(urb);
+}
+
+void usbhtmcStart(USBHTmcDriver *tmcp, const USBHTmcConfig *cfg) {
     osalDbgCheck(tmcp);
 
     chSemWait(&tmcp->sem);
@@ -273,8 +333,22 @@ void usbhtmcStart(USBHTmcDriver *tmcp) {
     /* open the int IN/OUT endpoints */
     usbhEPOpen(&tmcp->epin);
     usbhEPOpen(&tmcp->epout);
+    tmcp->config = cfg;
+    memset(&tmcp->stats, 0, sizeof(tmcp->stats));
+    tmcp->srtt_us = 0;
+    _load_capabilities(tmcp);
     if (tmcp->epint.status == USBH_EPSTATUS_CLOSED) {
         usbhEPOpen(&tmcp->epint);
+
+        /* Keep a notification URB armed for as long as the driver is ready */
+        uint32_t len = tmcp->epint.wMaxPacketSize;
+        if (len > USBH_TMC_INT_BUF_SIZE)
+            len = USBH_TMC_INT_BUF_SIZE;
+        usbhURBObjectInit(&tmcp->int_urb, &tmcp->epint, _int_cb, tmcp,
+                          intbuf[tmcp->index], len);
+        osalSysLock();
+        usbhURBSubmitI(&tmcp->int_urb);
+        osalSysUnlock();
     }
 
     tmcp->state = USBHTMC_STATE_READY;
@@ -291,155 +365,897 @@ static uint8_t _get_next_tag(USBHTmcDriver *tmcp) {
     return (tmcp->last_btag = (tmcp->last_btag % 255) + 1);
 }
 
-static size_t _write_locked(USBHTmcDriver *tmcp, const char *data, size_t n,
-                            systime_t timeout) {
-    if (n + sizeof(struct dev_dep_msg_out_hdr) > tmcp->epout.wMaxPacketSize) {
-        uerrf(
-            "Message size %u exceeds, max packet size %u. Multi-transfer "
-            "packets not yet implemented",
-            n, tmcp->epout.wMaxPacketSize);
-        return 0;
+const uint32_t usbhtmcHistBounds[USBH_TMC_HIST_BUCKETS - 1] = {
+    100, 200, 500, 1000, 2000, 5000, 10000};
+
+/* A timed out command may just have been slower than the deadline allowed,
+ * so back off like TCP does */
+static void _rtt_backoff(USBHTmcDriver *tmcp) {
+    const uint32_t max_us =
+        USBH_TMC_TIMEOUT_MAX_MS * 1000 / USBH_TMC_TIMEOUT_RTT_FACTOR;
+    if (tmcp->srtt_us) {
+        tmcp->srtt_us = tmcp->srtt_us < max_us / 2 ? tmcp->srtt_us * 2 : max_us;
     }
-    if (tmcp->state != USBHTMC_STATE_READY) {
-        uinfo("[TMC] Aborted write due to driver not ready");
-        return 0;
+}
+
+/* Smoothed ask round trip time, an EWMA with gain 1/8 */
+static void _rtt_sample(USBHTmcDriver *tmcp, uint32_t us) {
+    if (!us)
+        us = 1;
+    if (!tmcp->srtt_us) {
+        tmcp->srtt_us = us;
+    } else {
+        tmcp->srtt_us += ((int32_t)us - (int32_t)tmcp->srtt_us) / 8;
     }
+}
+
+/* Account one completed transfer. Only ever called by the current owner of
+ * the semaphore (or its URB callbacks), so needs no locking of its own. */
+static void _stat_latency(USBHTmcDriver *tmcp, usbhtmc_lat_t kind,
+                          rtcnt_t start, rtcnt_t end) {
+    usbhtmc_hist_t *h  = &tmcp->stats.lat[kind];
+    uint32_t        us = RTC2US(STM32_HCLK, end - start);
+    unsigned        b  = 0;
+    while (b < USBH_TMC_HIST_BUCKETS - 1 && us > usbhtmcHistBounds[b])
+        b++;
+    h->buckets[b]++;
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us)
+        h->max_us = us;
+    if (kind == USBHTMC_LAT_ASK)
+        _rtt_sample(tmcp, us);
+}
+
+static usbh_urbstatus_t _stat_status(USBHTmcDriver *tmcp,
+                                     usbh_urbstatus_t status) {
+    switch (status) {
+        case USBH_URBSTATUS_OK:
+        case USBH_URBSTATUS_CANCELLED:
+            break;
+        case USBH_URBSTATUS_TIMEOUT:
+            tmcp->stats.timeouts++;
+            _rtt_backoff(tmcp);
+            break;
+        case USBH_URBSTATUS_STALL:
+            tmcp->stats.stalls++;
+            break;
+        default:
+            tmcp->stats.errors++;
+            break;
+    }
+    return status;
+}
+
+/* usbhBulkTransfer, accounted under kind */
+static usbh_urbstatus_t _bulk_xfer(USBHTmcDriver *tmcp, usbhtmc_lat_t kind,
+                                   usbh_ep_t *ep, void *buf, uint32_t len,
+                                   uint32_t *actual, systime_t timeout) {
+    rtcnt_t          start  = chSysGetRealtimeCounterX();
+    usbh_urbstatus_t status = usbhBulkTransfer(ep, buf, len, actual, timeout);
+    if (status == USBH_URBSTATUS_OK) {
+        _stat_latency(tmcp, kind, start, chSysGetRealtimeCounterX());
+    }
+    return _stat_status(tmcp, status);
+}
+
+/* Completion stamps for URBs submitted without a state machine behind them */
+static void _out_done_cb(usbh_urb_t *urb) {
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)urb->userData;
+    tmcp->out_done            = chSysGetRealtimeCounterX();
+}
 
+static void _in_done_cb(usbh_urb_t *urb) {
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)urb->userData;
+    tmcp->in_done             = chSysGetRealtimeCounterX();
+}
+
+/* A DEV_DEP_MSG_OUT transfer is sent as up to three bulk URBs: the first
+ * packet (header plus the start of the payload), whole packets streamed
+ * straight out of the caller's buffer, and the zero padded tail. Only the
+ * first and last are staged in outbuf, which must hold two packets. */
+static size_t _out_segments(USBHTmcDriver *tmcp, const uint8_t *data, size_t n,
+                            uint8_t attributes, usbhtmc_seg_t *segs) {
     uint8_t *                  buf = outbuf[tmcp->index];
+    const size_t               mps = tmcp->epout.wMaxPacketSize;
     struct dev_dep_msg_out_hdr hdr = {};
     hdr.bMsgId                     = USBH_TMC_MSGID_DEV_DEP_MSG_OUT;
     hdr.bTag                       = _get_next_tag(tmcp);
     hdr.bTagInverse                = ~hdr.bTag & 0xFF;
     hdr.dwTransferSize             = n;
-    hdr.bmTransferAttributes       = USBH_TMC_ATTRIBUTE_EOM;
+    tmcp->out_tag                  = hdr.bTag;
+    hdr.bmTransferAttributes       = attributes;
 
     memcpy(buf, &hdr, sizeof(hdr));
-    memcpy(buf + sizeof(hdr), data, n);
 
-    size_t len = sizeof(hdr) + ((n + 3) / 4) * 4;
+    size_t padded = ((n + 3) / 4) * 4;
+    if (sizeof(hdr) + padded <= mps) {
+        memcpy(buf + sizeof(hdr), data, n);
+        memset(buf + sizeof(hdr) + n, 0, padded - n);
+        segs[0].buf = buf;
+        segs[0].len = sizeof(hdr) + padded;
+        return 1;
+    }
 
-    usbh_urbstatus_t status =
-        usbhBulkTransfer(&tmcp->epout, buf, len, NULL, timeout);
+    size_t count = 0;
+    size_t head  = mps - sizeof(hdr);
+    memcpy(buf + sizeof(hdr), data, head);
+    segs[count].buf   = buf;
+    segs[count++].len = mps;
+
+    size_t middle = ((n - head) / mps) * mps;
+    if (middle) {
+        /* The host controller only reads from OUT buffers */
+        segs[count].buf   = (uint8_t *)data + head;
+        segs[count++].len = middle;
+    }
 
-    if (status == USBH_URBSTATUS_TIMEOUT) {
-        uinfo("[TMC] Write timeout");
+    size_t tail = n - head - middle;
+    if (tail) {
+        padded = ((tail + 3) / 4) * 4;
+        memcpy(buf + mps, data + head + middle, tail);
+        memset(buf + mps + tail, 0, padded - tail);
+        segs[count].buf   = buf + mps;
+        segs[count++].len = padded;
     }
+    return count;
+}
 
-    if (status != USBH_URBSTATUS_OK) {
-        uerrf("[TMC] Write status = %d (!= OK)", status);
+static size_t _write_locked(USBHTmcDriver *tmcp, const char *data, size_t n,
+                            systime_t timeout) {
+    if (tmcp->state != USBHTMC_STATE_READY) {
+        uinfo("[TMC] Aborted write due to driver not ready");
+        return 0;
+    }
+    if (tmcp->caps.bInterfaceCapabilities & USBH_TMC_CAP_TALK_ONLY) {
+        uwarn("[TMC] Write to talk-only device");
+        return 0;
+    }
+    if (2 * tmcp->epout.wMaxPacketSize > USBH_TMC_BUF_SIZE) {
+        uerrf("[TMC] Max packet size %u too large for buffer",
+              tmcp->epout.wMaxPacketSize);
         return 0;
     }
+
+    usbhtmc_seg_t segs[USBH_TMC_MAX_OUT_SEGS];
+    size_t        count = _out_segments(tmcp, (const uint8_t *)data, n,
+                                 USBH_TMC_ATTRIBUTE_EOM, segs);
+
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    for (size_t i = 0; i < count; i++) {
+        usbh_urbstatus_t status = _stat_status(
+            tmcp, usbhBulkTransfer(&tmcp->epout, segs[i].buf, segs[i].len,
+                                   NULL, timeout));
+
+        if (status == USBH_URBSTATUS_TIMEOUT) {
+            uinfo("[TMC] Write timeout");
+        }
+
+        if (status != USBH_URBSTATUS_OK) {
+            uerrf("[TMC] Write status = %d (!= OK)", status);
+            tmcp->recover |= TMC_RECOVER_OUT;
+            return 0;
+        }
+    }
+    _stat_latency(tmcp, USBHTMC_LAT_WRITE, start, chSysGetRealtimeCounterX());
     return n;
 }
 
-static usbh_urbstatus_t _dev_dep_request_msg_in(USBHTmcDriver *tmcp, size_t len,
-                                                systime_t timeout) {
+/* Stamp a fresh bTag into a frame from usbhtmcEncodeFrame() */
+static void _frame_tag(USBHTmcDriver *tmcp, USBHTmcFrame *frame) {
+    tmcp->out_tag = _get_next_tag(tmcp);
+    frame->buf[1] = tmcp->out_tag;
+    frame->buf[2] = ~tmcp->out_tag & 0xFF;
+}
 
-    uint8_t *                         buf     = outbuf[tmcp->index];
+/* With term set, devices supporting TermChar end the transfer after '\n'.
+ * Only the text answer paths (usbhtmcReadInPlace, usbhtmcAskInPlace and
+ * usbhtmcAskAsync) ask for it, as binary or multi-line answers may hold
+ * '\n' anywhere. Either way an answer is only complete once EOM is set. */
+static size_t _build_request_msg_in(USBHTmcDriver *tmcp, size_t len,
+                                    bool term) {
     struct dev_dep_request_msg_in_hdr req_hdr = {};
     req_hdr.bMsgId               = USBH_TMC_MSGID_REQUEST_DEV_DEP_MSG_IN;
     req_hdr.bTag                 = _get_next_tag(tmcp);
     req_hdr.bTagInverse          = ~req_hdr.bTag & 0xFF;
     req_hdr.dwTransferSize       = len;
     req_hdr.bmTransferAttributes = 0;
+    tmcp->in_tag                 = req_hdr.bTag;
+    /* The request goes out on bulk OUT too, so an abort of a failed request
+     * must name it */
+    tmcp->out_tag = req_hdr.bTag;
+    if (term && usbhtmcHasTermChar(tmcp)) {
+        req_hdr.bmTransferAttributes = USBH_TMC_ATTRIBUTE_TERMCHAR;
+        req_hdr.bTermChar            = '\n';
+    }
+
+    memcpy(outbuf[tmcp->index], &req_hdr, sizeof(req_hdr));
+    return sizeof(req_hdr);
+}
+
+static usbh_urbstatus_t _dev_dep_request_msg_in(USBHTmcDriver *tmcp, size_t len,
+                                                bool term, systime_t timeout) {
+    size_t req_len = _build_request_msg_in(tmcp, len, term);
+    return _bulk_xfer(tmcp, USBHTMC_LAT_REQUEST, &tmcp->epout,
+                      outbuf[tmcp->index], req_len, NULL, timeout);
+}
+
+static size_t _msg_in_xfer_len(size_t len) {
+    return sizeof(struct dev_dep_msg_in_hdr) + ((len + 3) / 4) * 4;
+}
+
+static bool _check_msg_in_hdr(USBHTmcDriver *                  tmcp,
+                              const struct dev_dep_msg_in_hdr *hdr) {
+    if (hdr->bMsgId != USBH_TMC_MSGID_DEV_DEP_MSG_IN) {
+        uerrf("Unexpected read MsgId %u, expected %u", hdr->bMsgId,
+              USBH_TMC_MSGID_DEV_DEP_MSG_IN);
+        return false;
+    }
+#pragma GCC diagnostic ignored "-Wsign-compare"
+    if (hdr->bTagInverse != (uint8_t)(~hdr->bTag)) {
+#pragma GCC diagnostic pop
+        uerrf("Bad read tag %02x, inverse %02x", hdr->bTag, hdr->bTagInverse);
+        tmcp->stats.bad_tags++;
+        return false;
+    }
+    if (hdr->bTag != tmcp->in_tag) {
+        uerrf("Read tag %02x, expected %02x", hdr->bTag, tmcp->in_tag);
+        tmcp->stats.stale++;
+        return false;
+    }
+    return true;
+}
+
+/* True if buf holds the start of a DEV_DEP_MSG_IN answering some earlier
+ * request than the outstanding one, typically one that timed out */
+static bool _is_stale(USBHTmcDriver *tmcp, const uint8_t *buf, uint32_t len) {
+    struct dev_dep_msg_in_hdr hdr;
+    if (len < sizeof(hdr))
+        return false;
+    memcpy(&hdr, buf, sizeof(hdr));
+    return hdr.bMsgId == USBH_TMC_MSGID_DEV_DEP_MSG_IN &&
+           (uint8_t)(hdr.bTag ^ hdr.bTagInverse) == 0xFF &&
+           hdr.bTag != tmcp->in_tag;
+}
+
+/* Drop stale DEV_DEP_MSG_IN transfers, including any packets beyond the
+ * first, and read again until the outstanding request's answer shows up in
+ * buf. *len is the length of the bulk IN read of want bytes that produced
+ * buf. The tail of a stale transfer is read off through inbuf, as buf may be
+ * the caller's. */
+static bool _skip_stale(USBHTmcDriver *tmcp, uint8_t *buf, uint32_t *len,
+                        uint32_t want, systime_t timeout) {
+    const size_t mps = tmcp->epin.wMaxPacketSize;
+
+    for (unsigned i = 0; _is_stale(tmcp, buf, *len); i++) {
+        struct dev_dep_msg_in_hdr hdr;
+        memcpy(&hdr, buf, sizeof(hdr));
+        uwarnf("[TMC] Dropping stale answer, tag %02x, expected %02x",
+               hdr.bTag, tmcp->in_tag);
+        tmcp->stats.stale++;
+        if (i == USBH_TMC_MAX_STALE) {
+            return false;
+        }
+
+        /* A short packet already ended the stale transfer */
+        size_t left = _msg_in_xfer_len(hdr.dwTransferSize);
+        left        = (*len == want && left > *len) ? left - *len : 0;
+        while (left) {
+            uint32_t chunk = ((left + mps - 1) / mps) * mps;
+            uint32_t n     = 0;
+            if (chunk > USBH_TMC_BUF_SIZE)
+                chunk = USBH_TMC_BUF_SIZE;
+            if (_stat_status(tmcp, usbhBulkTransfer(&tmcp->epin,
+                                                    inbuf[tmcp->index], chunk,
+                                                    &n, timeout)) !=
+                USBH_URBSTATUS_OK)
+                return false;
+            if (n >= left || n < chunk)
+                break;
+            left -= n;
+        }
+
+        *len = 0;
+        if (_bulk_xfer(tmcp, USBHTMC_LAT_BULK_IN, &tmcp->epin, buf, want, len,
+                       timeout) != USBH_URBSTATUS_OK)
+            return false;
+    }
+    return true;
+}
+
+/* Validate a DEV_DEP_MSG_IN header against the received length and the space
+ * left in the caller's buffer */
+static bool _check_msg_in(USBHTmcDriver *                  tmcp,
+                          const struct dev_dep_msg_in_hdr *hdr, uint32_t len,
+                          size_t n) {
+    if (!_check_msg_in_hdr(tmcp, hdr)) {
+        return false;
+    }
+    if (hdr->dwTransferSize > n) {
+        uerrf("Read size %u larger than request %u", hdr->dwTransferSize, n);
+        return false;
+    }
+    if (len < hdr->dwTransferSize + sizeof(*hdr)) {
+        uerrf("Received data length %u less than indicated %u", len,
+              hdr->dwTransferSize + sizeof(*hdr));
+        return false;
+    }
+    return true;
+}
+
+static void _submit_urb(USBHTmcDriver *tmcp, usbh_urb_t *urb, usbh_ep_t *ep,
+                        usbh_completion_cb cb, void *buf, uint32_t len) {
+    usbhURBObjectInit(urb, ep, cb, tmcp, buf, len);
+    osalSysLock();
+    usbhURBSubmitI(urb);
+    osalSysUnlock();
+}
+
+static usbh_urbstatus_t _wait_urb(usbh_urb_t *urb, systime_t timeout) {
+    osalSysLock();
+    msg_t msg = usbhURBWaitTimeoutS(urb, timeout);
+    if (msg == MSG_TIMEOUT) {
+        usbhURBCancelAndWaitS(urb);
+    }
+    osalSysUnlock();
+    return msg == MSG_TIMEOUT ? USBH_URBSTATUS_TIMEOUT : urb->status;
+}
+
+/* Queue a REQUEST_DEV_DEP_MSG_IN together with the bulk IN URB for its
+ * answer. The IN URB just NAKs until the device has the data ready. */
+static void _start_chunk(USBHTmcDriver *tmcp, uint8_t *buf, size_t read_len,
+                         bool term) {
+    size_t req_len     = _build_request_msg_in(tmcp, read_len, term);
+    tmcp->chunk_start = chSysGetRealtimeCounterX();
+    _submit_urb(tmcp, &tmcp->out_urb, &tmcp->epout, _out_done_cb,
+                outbuf[tmcp->index], req_len);
+    _submit_urb(tmcp, &tmcp->in_urb, &tmcp->epin, _in_done_cb, buf,
+                _msg_in_xfer_len(read_len));
+}
+
+static usbh_urbstatus_t _finish_chunk(USBHTmcDriver *tmcp, uint32_t *len,
+                                      systime_t timeout) {
+    usbh_urbstatus_t status =
+        _stat_status(tmcp, _wait_urb(&tmcp->out_urb, timeout));
+    if (status != USBH_URBSTATUS_OK) {
+        uerrf("[TMC] Read request status = %d (!= OK)", status);
+        osalSysLock();
+        usbhURBCancelAndWaitS(&tmcp->in_urb);
+        osalSysUnlock();
+        tmcp->recover |= TMC_RECOVER_OUT;
+        return status;
+    }
 
-    memcpy(buf, &req_hdr, sizeof(req_hdr));
-    return usbhBulkTransfer(&tmcp->epout, buf, sizeof(req_hdr), NULL, timeout);
+    _stat_latency(tmcp, USBHTMC_LAT_REQUEST, tmcp->chunk_start,
+                  tmcp->out_done);
+
+    status = _stat_status(tmcp, _wait_urb(&tmcp->in_urb, timeout));
+    if (status != USBH_URBSTATUS_OK) {
+        uerrf("[TMC] Read in status = %d (!= OK)", status);
+        tmcp->recover |= TMC_RECOVER_IN;
+        return status;
+    }
+    /* Bulk IN latency runs from the device seeing the request, as the IN
+     * URB itself was queued up front */
+    _stat_latency(tmcp, USBHTMC_LAT_BULK_IN, tmcp->out_done, tmcp->in_done);
+    *len = tmcp->in_urb.actualLength;
+    return status;
 }
 
+/* Reads are double buffered: once a chunk's header has been checked, the
+ * request and bulk IN for the next chunk are queued into the other bank
+ * before this one is copied out, so long responses don't pay a full
+ * turnaround per chunk. */
 static size_t _read_locked(USBHTmcDriver *tmcp, char *data, size_t n,
-                           systime_t timeout) {
+                           bool term, systime_t timeout) {
     if (tmcp->state != USBHTMC_STATE_READY) {
         uinfo("[TMC] Aborted read due to driver not ready");
         return 0;
     }
+    if (tmcp->caps.bInterfaceCapabilities & USBH_TMC_CAP_LISTEN_ONLY) {
+        uwarn("[TMC] Read from listen-only device");
+        return 0;
+    }
 
-    size_t read_len = USBH_TMC_BUF_SIZE - sizeof(struct dev_dep_msg_in_hdr);
+    const size_t   chunk_len =
+        USBH_TMC_BUF_SIZE - sizeof(struct dev_dep_msg_in_hdr);
+    uint8_t *const bank[2] = {inbuf[tmcp->index], inbuf_alt[tmcp->index]};
+    unsigned       cur     = 0;
+    size_t         bytes_received = 0;
+
+    _start_chunk(tmcp, bank[cur], n < chunk_len ? n : chunk_len, term);
+    for (;;) {
+        uint32_t len = 0;
+        if (_finish_chunk(tmcp, &len, timeout) != USBH_URBSTATUS_OK) {
+            return 0;
+        }
+        if (!_skip_stale(tmcp, bank[cur], &len, tmcp->in_urb.requestedLength,
+                         timeout)) {
+            tmcp->recover |= TMC_RECOVER_IN;
+            return 0;
+        }
 
-    bool   eom            = FALSE;
-    size_t bytes_received = 0;
+        struct dev_dep_msg_in_hdr hdr;
+        memcpy(&hdr, bank[cur], sizeof(hdr));
 
-    while (!eom) {
-        if (n - bytes_received < read_len)
-            read_len = n - bytes_received;
+        if (!_check_msg_in(tmcp, &hdr, len, n - bytes_received)) {
+            tmcp->recover |= TMC_RECOVER_IN;
+            return 0;
+        }
 
-        usbh_urbstatus_t status =
-            _dev_dep_request_msg_in(tmcp, read_len, timeout);
-        if (status == USBH_URBSTATUS_TIMEOUT) {
-            uinfo("[TMC] Read request timeout");
+        const uint8_t *payload = bank[cur] + sizeof(hdr);
+        const size_t   left    = n - bytes_received - hdr.dwTransferSize;
+        bool           more    = left > 0 &&
+                      !(hdr.bmTransferAttributes & USBH_TMC_ATTRIBUTE_EOM);
+        if (more) {
+            _start_chunk(tmcp, bank[cur ^ 1],
+                         left < chunk_len ? left : chunk_len, term);
+        }
+
+        memcpy(data + bytes_received, payload, hdr.dwTransferSize);
+        bytes_received += hdr.dwTransferSize;
+        data[bytes_received] = 0;
+        if (!more)
+            break;
+        cur ^= 1;
+    }
+
+    return bytes_received;
+}
+
+/* Zero-copy read: each DEV_DEP_MSG_IN transfer is received straight into the
+ * caller's buffer, its header landing in the prefix in front of the payload.
+ * Should the device split the answer, the next header overwrites the last
+ * bytes already received, which are saved and put back. Unaligned buffers,
+ * and continuations that would put a header at an unaligned offset, go
+ * through the bounce buffers instead. */
+static size_t _read_in_place_locked(USBHTmcDriver *tmcp, uint8_t *buf,
+                                    size_t n, systime_t timeout) {
+    char *const data = (char *)buf + USBH_TMC_RX_PREFIX;
+
+    if ((uintptr_t)buf & 3) {
+        return _read_locked(tmcp, data, n, true, timeout);
+    }
+    if (tmcp->state != USBHTMC_STATE_READY) {
+        uinfo("[TMC] Aborted read due to driver not ready");
+        return 0;
+    }
+    if (tmcp->caps.bInterfaceCapabilities & USBH_TMC_CAP_LISTEN_ONLY) {
+        uwarn("[TMC] Read from listen-only device");
+        return 0;
+    }
+
+    size_t received = 0;
+    for (;;) {
+        struct dev_dep_msg_in_hdr hdr;
+        uint8_t                   saved[sizeof(hdr)];
+        uint8_t *const            dst  = buf + received;
+        const uint32_t            want = _msg_in_xfer_len(n - received);
+
+        if (received) {
+            memcpy(saved, dst, sizeof(saved));
         }
+
+        usbh_urbstatus_t status =
+            _dev_dep_request_msg_in(tmcp, n - received, true, timeout);
         if (status != USBH_URBSTATUS_OK) {
             uerrf("[TMC] Read request status = %d (!= OK)", status);
+            tmcp->recover |= TMC_RECOVER_OUT;
             return 0;
         }
 
         uint32_t len = 0;
-        status       = usbhBulkTransfer(&tmcp->epin, inbuf[tmcp->index],
-                                  sizeof(struct dev_dep_msg_in_hdr) +
-                                      ((read_len + 3) / 4) * 4,
-                                  &len, timeout);
-
-        if (status == USBH_URBSTATUS_TIMEOUT) {
-            uinfo("[TMC] Read in timeout");
-        }
+        status = _bulk_xfer(tmcp, USBHTMC_LAT_BULK_IN, &tmcp->epin, dst, want,
+                            &len, timeout);
         if (status != USBH_URBSTATUS_OK) {
             uerrf("[TMC] Read in status = %d (!= OK)", status);
+            tmcp->recover |= TMC_RECOVER_IN;
             return 0;
         }
-
-        struct dev_dep_msg_in_hdr hdr;
-        memcpy(&hdr, inbuf[tmcp->index], sizeof(hdr));
-
-        if (hdr.bMsgId != USBH_TMC_MSGID_DEV_DEP_MSG_IN) {
-            uerrf("Unexpected read MsgId %u, expected %u", hdr.bMsgId,
-                  USBH_TMC_MSGID_DEV_DEP_MSG_IN);
+        if (!_skip_stale(tmcp, dst, &len, want, timeout)) {
+            tmcp->recover |= TMC_RECOVER_IN;
             return 0;
         }
-#pragma GCC diagnostic ignored "-Wsign-compare"
-        if (hdr.bTagInverse != (uint8_t)(~hdr.bTag)) {
-#pragma GCC diagnostic pop
-            uerrf("Bad read tag %02x, inverse %02x", hdr.bTag, hdr.bTagInverse);
-            return 0;
+
+        memcpy(&hdr, dst, sizeof(hdr));
+        if (received) {
+            memcpy(dst, saved, sizeof(saved));
         }
-        eom = (hdr.bmTransferAttributes & USBH_TMC_ATTRIBUTE_EOM);
-        if (hdr.dwTransferSize > n) {
-            uerrf("Read size %u larger than request %u", hdr.dwTransferSize, n);
+        if (!_check_msg_in(tmcp, &hdr, len, n - received)) {
+            tmcp->recover |= TMC_RECOVER_IN;
             return 0;
         }
-        if (len < hdr.dwTransferSize + sizeof(hdr)) {
-            uerrf("Received data length %u less than indicated %u", len,
-                  hdr.dwTransferSize + sizeof(hdr));
+
+        received += hdr.dwTransferSize;
+        data[received] = 0;
+        if ((hdr.bmTransferAttributes & USBH_TMC_ATTRIBUTE_EOM) ||
+            received >= n)
+            break;
+        if (received & 3) {
+            size_t more = _read_locked(tmcp, data + received, n - received,
+                                       true, timeout);
+            if (!more)
+                return 0;
+            received += more;
+            break;
+        }
+    }
+    return received;
+}
+
+/* Incremental parser for IEEE 488.2 block data, #<n><length><data> or the
+ * indefinite #0<data> form. Anything before the '#' (e.g. a command header)
+ * is skipped, as is anything after a definite length block. */
+enum {
+    TMC_BLOCK_HASH = 0,
+    TMC_BLOCK_NDIGITS,
+    TMC_BLOCK_LENGTH,
+    TMC_BLOCK_DATA,
+    TMC_BLOCK_INDEFINITE,
+    TMC_BLOCK_DONE,
+};
+
+typedef struct {
+    uint8_t            state;
+    uint8_t            digits;
+    uint32_t           remaining;
+    size_t             delivered;
+    usbhtmc_block_cb_t cb;
+    void *             user;
+} tmc_block_parser_t;
+
+static bool _block_feed(tmc_block_parser_t *p, const uint8_t *data,
+                        size_t n) {
+    while (n) {
+        size_t chunk = 1;
+        switch (p->state) {
+            case TMC_BLOCK_HASH:
+                if (*data == '#') {
+                    p->state = TMC_BLOCK_NDIGITS;
+                }
+                break;
+            case TMC_BLOCK_NDIGITS:
+                if (*data < '0' || *data > '9') {
+                    uerrf("[TMC] Bad block header digit count '%c'", *data);
+                    return false;
+                }
+                p->digits = *data - '0';
+                p->state  = p->digits ? TMC_BLOCK_LENGTH : TMC_BLOCK_INDEFINITE;
+                break;
+            case TMC_BLOCK_LENGTH:
+                if (*data < '0' || *data > '9') {
+                    uerrf("[TMC] Bad block length digit '%c'", *data);
+                    return false;
+                }
+                p->remaining = p->remaining * 10 + (*data - '0');
+                if (--p->digits == 0) {
+                    p->state = p->remaining ? TMC_BLOCK_DATA : TMC_BLOCK_DONE;
+                }
+                break;
+            case TMC_BLOCK_DATA:
+                chunk = n < p->remaining ? n : p->remaining;
+                if (!p->cb(p->user, data, chunk)) {
+                    return false;
+                }
+                p->delivered += chunk;
+                p->remaining -= chunk;
+                if (!p->remaining) {
+                    p->state = TMC_BLOCK_DONE;
+                }
+                break;
+            case TMC_BLOCK_INDEFINITE:
+                chunk = n;
+                if (!p->cb(p->user, data, chunk)) {
+                    return false;
+                }
+                p->delivered += chunk;
+                break;
+            case TMC_BLOCK_DONE:
+            default:
+                return true;
+        }
+        data += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+/* Read a response as a stream of DEV_DEP_MSG_IN transfers, each spanning as
+ * many bulk IN URBs as the device likes, until EOM. Only the first URB of a
+ * transfer carries a header; the payload goes straight from inbuf to the
+ * block parser. */
+static size_t _read_block_locked(USBHTmcDriver *tmcp, usbhtmc_block_cb_t cb,
+                                 void *user, systime_t timeout) {
+    if (tmcp->state != USBHTMC_STATE_READY) {
+        uinfo("[TMC] Aborted read due to driver not ready");
+        return 0;
+    }
+    if (tmcp->caps.bInterfaceCapabilities & USBH_TMC_CAP_LISTEN_ONLY) {
+        uwarn("[TMC] Read from listen-only device");
+        return 0;
+    }
+
+    const size_t       mps = tmcp->epin.wMaxPacketSize;
+    tmc_block_parser_t p   = {};
+    p.cb                   = cb;
+    p.user                 = user;
+    bool eom               = false;
+
+    while (!eom) {
+        usbh_urbstatus_t status = _dev_dep_request_msg_in(
+            tmcp, USBH_TMC_STREAM_XFER_SIZE, false, timeout);
+        if (status != USBH_URBSTATUS_OK) {
+            uerrf("[TMC] Read request status = %d (!= OK)", status);
+            tmcp->recover |= TMC_RECOVER_OUT;
             return 0;
         }
-        memcpy(data + bytes_received, inbuf[tmcp->index] + sizeof(hdr),
-               hdr.dwTransferSize);
-        bytes_received += hdr.dwTransferSize;
-        data[bytes_received] = 0;
-        if (n - bytes_received <= 0)
+
+        bool   first     = true;
+        size_t data_left = 0; /* payload bytes left in this transfer */
+        size_t xfer_left = 0; /* payload and alignment bytes left */
+        do {
+            uint32_t want = USBH_TMC_BUF_SIZE;
+            if (!first && xfer_left < want) {
+                want = ((xfer_left + mps - 1) / mps) * mps;
+            }
+
+            uint32_t len = 0;
+            status = _bulk_xfer(tmcp, USBHTMC_LAT_BULK_IN, &tmcp->epin,
+                                inbuf[tmcp->index], want, &len, timeout);
+            if (status != USBH_URBSTATUS_OK) {
+                uerrf("[TMC] Read in status = %d (!= OK)", status);
+                tmcp->recover |= TMC_RECOVER_IN;
+                return 0;
+            }
+            if (first &&
+                !_skip_stale(tmcp, inbuf[tmcp->index], &len, want, timeout)) {
+                tmcp->recover |= TMC_RECOVER_IN;
+                return 0;
+            }
+
+            const uint8_t *payload = inbuf[tmcp->index];
+            size_t         n       = len;
+            if (first) {
+                struct dev_dep_msg_in_hdr hdr;
+                if (len < sizeof(hdr)) {
+                    uerrf("[TMC] Short block transfer %u", len);
+                    tmcp->recover |= TMC_RECOVER_IN;
+                    return 0;
+                }
+                memcpy(&hdr, payload, sizeof(hdr));
+                if (!_check_msg_in_hdr(tmcp, &hdr)) {
+                    tmcp->recover |= TMC_RECOVER_IN;
+                    return 0;
+                }
+                eom       = (hdr.bmTransferAttributes & USBH_TMC_ATTRIBUTE_EOM);
+                data_left = hdr.dwTransferSize;
+                xfer_left = ((data_left + 3) / 4) * 4;
+                payload += sizeof(hdr);
+                n -= sizeof(hdr);
+                first = false;
+            }
+
+            size_t data_n = n < data_left ? n : data_left;
+            if (!_block_feed(&p, payload, data_n)) {
+                /* Whatever the device still has queued must be flushed */
+                tmcp->recover |= TMC_RECOVER_IN;
+                return 0;
+            }
+            data_left -= data_n;
+            xfer_left -= n < xfer_left ? n : xfer_left;
+
+            if (len < want) {
+                break; /* short packet ends the transfer */
+            }
+        } while (xfer_left);
+    }
+
+    if (p.state != TMC_BLOCK_DONE && p.state != TMC_BLOCK_INDEFINITE) {
+        uerrf("[TMC] Block ended early, %u bytes missing", p.remaining);
+        return 0;
+    }
+    return p.delivered;
+}
+
+/* Discard anything the device still has queued on bulk IN, up to the next
+ * short packet */
+static void _drain_in(USBHTmcDriver *tmcp) {
+    uint32_t len;
+    do {
+        len = 0;
+        if (usbhBulkTransfer(&tmcp->epin, inbuf[tmcp->index],
+                             USBH_TMC_BUF_SIZE, &len,
+                             TIME_MS2I(USBH_TMC_DRAIN_TIMEOUT_MS)) !=
+            USBH_URBSTATUS_OK)
+            break;
+    } while (len == USBH_TMC_BUF_SIZE);
+}
+
+static usbh_urbstatus_t _tmc_request(USBHTmcDriver *tmcp, uint8_t recip,
+                                     uint8_t req, uint16_t wValue,
+                                     uint16_t wIndex, uint16_t len,
+                                     uint8_t *buf) {
+    return usbhControlRequest(tmcp->dev, USBH_REQTYPE_CLASSIN(recip), req,
+                              wValue, wIndex, len, buf);
+}
+
+/* INITIATE_ABORT_BULK_OUT for the last DEV_DEP_MSG_OUT or
+ * REQUEST_DEV_DEP_MSG_IN, then clear the halt it leaves on the endpoint.
+ * False means the device wants an INITIATE_CLEAR instead. */
+static bool _abort_bulk_out(USBHTmcDriver *tmcp) {
+    USBH_DEFINE_BUFFER(uint8_t buf[8]);
+
+    if (_tmc_request(tmcp, USBH_REQTYPE_RECIP_ENDPOINT,
+                     USBH_TMC_REQ_INITIATE_ABORT_BULK_OUT, tmcp->out_tag,
+                     tmcp->epout.address, 2, buf) != USBH_URBSTATUS_OK)
+        return false;
+    if (buf[0] == USBH_TMC_STATUS_TRANSFER_NOT_IN_PROGRESS)
+        return true;
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS)
+        return false;
+
+    for (unsigned i = 0; i < USBH_TMC_RECOVER_POLLS; i++) {
+        if (_tmc_request(tmcp, USBH_REQTYPE_RECIP_ENDPOINT,
+                         USBH_TMC_REQ_CHECK_ABORT_BULK_OUT_STATUS, 0,
+                         tmcp->epout.address, 8, buf) != USBH_URBSTATUS_OK)
+            return false;
+        if (buf[0] != USBH_TMC_STATUS_PENDING)
             break;
+        osalThreadSleepMilliseconds(1);
     }
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS)
+        return false;
 
-    return bytes_received;
+    return usbhEPReset(&tmcp->epout) == HAL_SUCCESS;
+}
+
+/* INITIATE_ABORT_BULK_IN for the last REQUEST_DEV_DEP_MSG_IN, reading off
+ * whatever the device had already queued, then clear any halt left on the
+ * endpoint by a stalled read */
+static bool _abort_bulk_in(USBHTmcDriver *tmcp) {
+    USBH_DEFINE_BUFFER(uint8_t buf[8]);
+    const uint8_t address = tmcp->epin.address | 0x80;
+
+    if (_tmc_request(tmcp, USBH_REQTYPE_RECIP_ENDPOINT,
+                     USBH_TMC_REQ_INITIATE_ABORT_BULK_IN, tmcp->in_tag,
+                     address, 2, buf) != USBH_URBSTATUS_OK)
+        return false;
+    if (buf[0] == USBH_TMC_STATUS_TRANSFER_NOT_IN_PROGRESS)
+        return usbhEPReset(&tmcp->epin) == HAL_SUCCESS;
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS)
+        return false;
+
+    for (unsigned i = 0; i < USBH_TMC_RECOVER_POLLS; i++) {
+        _drain_in(tmcp);
+        if (_tmc_request(tmcp, USBH_REQTYPE_RECIP_ENDPOINT,
+                         USBH_TMC_REQ_CHECK_ABORT_BULK_IN_STATUS, 0, address,
+                         8, buf) != USBH_URBSTATUS_OK)
+            return false;
+        if (buf[0] != USBH_TMC_STATUS_PENDING)
+            break;
+        /* bmAbortBulkIn.D0 set means more data is waiting to be read */
+        if (!(buf[1] & 1))
+            osalThreadSleepMilliseconds(1);
+    }
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS)
+        return false;
+
+    return usbhEPReset(&tmcp->epin) == HAL_SUCCESS;
+}
+
+/* INITIATE_CLEAR: flush both bulk FIFOs and reset the device's message
+ * state */
+static usbh_urbstatus_t _clear_locked(USBHTmcDriver *tmcp) {
+    USBH_DEFINE_BUFFER(uint8_t buf[2]);
+
+    if (tmcp->state != USBHTMC_STATE_READY) {
+        return USBH_URBSTATUS_ERROR;
+    }
+
+    usbh_urbstatus_t status = _tmc_request(
+        tmcp, USBH_REQTYPE_RECIP_INTERFACE, USBH_TMC_REQ_INITIATE_CLEAR, 0,
+        tmcp->ifnum, 1, buf);
+    if (status != USBH_URBSTATUS_OK)
+        return status;
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS) {
+        uwarnf("[TMC] INITIATE_CLEAR status %02x", buf[0]);
+        return USBH_URBSTATUS_ERROR;
+    }
+
+    for (unsigned i = 0; i < USBH_TMC_RECOVER_POLLS; i++) {
+        status = _tmc_request(tmcp, USBH_REQTYPE_RECIP_INTERFACE,
+                              USBH_TMC_REQ_CHECK_CLEAR_STATUS, 0, tmcp->ifnum,
+                              2, buf);
+        if (status != USBH_URBSTATUS_OK)
+            return status;
+        if (buf[0] != USBH_TMC_STATUS_PENDING)
+            break;
+        /* bmClear.D0 set means the device wants bulk IN read off first */
+        if (buf[1] & 1)
+            _drain_in(tmcp);
+        else
+            osalThreadSleepMilliseconds(1);
+    }
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS) {
+        uwarnf("[TMC] CHECK_CLEAR_STATUS status %02x", buf[0]);
+        return USBH_URBSTATUS_ERROR;
+    }
+
+    tmcp->recover = 0;
+    /* USBTMC has the host clear the halt on both bulk endpoints */
+    if (usbhEPReset(&tmcp->epout) != HAL_SUCCESS ||
+        usbhEPReset(&tmcp->epin) != HAL_SUCCESS)
+        return USBH_URBSTATUS_ERROR;
+    return USBH_URBSTATUS_OK;
+}
+
+/* Bring the device back in step after a failed transfer, so the next
+ * command doesn't pick up a stale answer: abort whichever direction failed,
+ * falling back to INITIATE_CLEAR */
+static void _recover_locked(USBHTmcDriver *tmcp) {
+    const uint8_t recover = tmcp->recover;
+    tmcp->recover         = 0;
+    if (!recover || tmcp->state != USBHTMC_STATE_READY)
+        return;
+
+    bool ok = true;
+    tmcp->stats.aborts++;
+    if (recover & TMC_RECOVER_OUT)
+        ok = _abort_bulk_out(tmcp);
+    if (ok && (recover & TMC_RECOVER_IN))
+        ok = _abort_bulk_in(tmcp);
+    if (!ok) {
+        uinfo("[TMC] Abort failed, clearing device");
+        tmcp->stats.clears++;
+        _clear_locked(tmcp);
+    }
 }
 
 size_t usbhtmcWrite(USBHTmcDriver *tmcp, const char *data, size_t n,
                     systime_t timeout) {
     osalDbgCheck(tmcp);
     chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
 
     size_t len = _write_locked(tmcp, data, n, timeout);
 
+    _recover_locked(tmcp);
     chSemSignal(&tmcp->sem);
     return len;
 }
 
+/* Build the whole DEV_DEP_MSG_OUT transfer for a command that will be sent
+ * repeatedly, so that usbhtmcWriteGroup() only has to tag and submit it.
+ * Returns the frame length, or 0 if the command does not fit. */
+size_t usbhtmcEncodeFrame(USBHTmcFrame *frame, const char *data, size_t n) {
+    struct dev_dep_msg_out_hdr hdr = {};
+    size_t                     padded = ((n + 3) / 4) * 4;
+
+    osalDbgCheck(frame && data);
+    frame->len = 0;
+    if (sizeof(hdr) + padded > sizeof(frame->buf)) {
+        uerrf("[TMC] Frame of %u bytes too large", (unsigned)n);
+        return 0;
+    }
+    hdr.bMsgId               = USBH_TMC_MSGID_DEV_DEP_MSG_OUT;
+    hdr.dwTransferSize       = n;
+    hdr.bmTransferAttributes = USBH_TMC_ATTRIBUTE_EOM;
+    memcpy(frame->buf, &hdr, sizeof(hdr));
+    memcpy(frame->buf + sizeof(hdr), data, n);
+    memset(frame->buf + sizeof(hdr) + n, 0, padded - n);
+    frame->len = sizeof(hdr) + padded;
+    return frame->len;
+}
+
 size_t usbhtmcRead(USBHTmcDriver *tmcp, char *data, size_t n,
                    systime_t timeout) {
     osalDbgCheck(tmcp);
     chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
 
-    size_t len = _read_locked(tmcp, data, n, timeout);
+    size_t len = _read_locked(tmcp, data, n, false, timeout);
 
+    _recover_locked(tmcp);
     chSemSignal(&tmcp->sem);
     return len;
 }
@@ -448,13 +1264,407 @@ size_t usbhtmcAsk(USBHTmcDriver *tmcp, const char *query, size_t querylen,
                   char *answer, size_t answerlen, systime_t timeout) {
     osalDbgCheck(tmcp);
     chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
 
-    size_t len = _write_locked(tmcp, query, querylen, timeout);
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    size_t  len   = _write_locked(tmcp, query, querylen, timeout);
     if (len == querylen) {
-        len = _read_locked(tmcp, answer, answerlen, timeout);
+        len = _read_locked(tmcp, answer, answerlen, false, timeout);
     } else {
         len = 0;
     }
+    if (len) {
+        _stat_latency(tmcp, USBHTMC_LAT_ASK, start,
+                      chSysGetRealtimeCounterX());
+    }
+    _recover_locked(tmcp);
+    chSemSignal(&tmcp->sem);
+    return len;
+}
+
+/* Read an answer into buf, laid out as USBH_TMC_RX_BUF_SIZE(n) bytes. Up to
+ * n bytes land NUL terminated at usbhtmcRxPayload(buf), without a copy. */
+size_t usbhtmcReadInPlace(USBHTmcDriver *tmcp, uint8_t *buf, size_t n,
+                          systime_t timeout) {
+    osalDbgCheck(tmcp && buf);
+    chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
+
+    size_t len = _read_in_place_locked(tmcp, buf, n, timeout);
+
+    _recover_locked(tmcp);
+    chSemSignal(&tmcp->sem);
+    return len;
+}
+
+size_t usbhtmcAskInPlace(USBHTmcDriver *tmcp, const char *query,
+                         size_t querylen, uint8_t *buf, size_t n,
+                         systime_t timeout) {
+    osalDbgCheck(tmcp && buf);
+    chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
+
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    size_t  len   = 0;
+    if (_write_locked(tmcp, query, querylen, timeout) == querylen) {
+        len = _read_in_place_locked(tmcp, buf, n, timeout);
+    }
+    if (len) {
+        _stat_latency(tmcp, USBHTMC_LAT_ASK, start,
+                      chSysGetRealtimeCounterX());
+    }
+    _recover_locked(tmcp);
+    chSemSignal(&tmcp->sem);
+    return len;
+}
+
+/* Bring the device's USBTMC state back to idle, discarding any queued input
+ * and output */
+usbh_urbstatus_t usbhtmcClear(USBHTmcDriver *tmcp) {
+    osalDbgCheck(tmcp);
+    chSemWait(&tmcp->sem);
+
+    usbh_urbstatus_t status = _clear_locked(tmcp);
+
+    chSemSignal(&tmcp->sem);
+    return status;
+}
+
+/* Write one command to each of several instruments with as little skew as
+ * possible: every message is framed up front, unless it comes pre-encoded,
+ * then the first URB of each is submitted back to back under a single lock.
+ * Returns the number of successful writes. Drivers are locked in array order,
+ * so concurrent group writes must use a consistent order. */
+unsigned usbhtmcWriteGroup(USBHTmcGroupWrite *writes, unsigned count,
+                           systime_t timeout) {
+    usbhtmc_seg_t segs[USBH_TMC_MAX_INSTANCES][USBH_TMC_MAX_OUT_SEGS];
+    size_t        nsegs[USBH_TMC_MAX_INSTANCES];
+    unsigned      i, ok = 0;
+
+    osalDbgCheck(writes && count <= USBH_TMC_MAX_INSTANCES);
+
+    for (i = 0; i < count; i++) {
+        USBHTmcDriver *tmcp = writes[i].tmcp;
+        writes[i].ok        = false;
+        chSemWait(&tmcp->sem);
+        _recover_locked(tmcp);
+        if (tmcp->state != USBHTMC_STATE_READY) {
+            nsegs[i] = 0;
+            continue;
+        }
+        if (writes[i].frame) {
+            _frame_tag(tmcp, writes[i].frame);
+            segs[i][0].buf = writes[i].frame->buf;
+            segs[i][0].len = writes[i].frame->len;
+            nsegs[i]       = 1;
+        } else if (2 * tmcp->epout.wMaxPacketSize > USBH_TMC_BUF_SIZE) {
+            nsegs[i] = 0;
+            continue;
+        } else {
+            nsegs[i] = _out_segments(
+                tmcp, (const uint8_t *)writes[i].cmd, strlen(writes[i].cmd),
+                USBH_TMC_ATTRIBUTE_EOM, segs[i]);
+        }
+        usbhURBObjectInit(&tmcp->out_urb, &tmcp->epout, _out_done_cb, tmcp,
+                          segs[i][0].buf, segs[i][0].len);
+    }
+
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    osalSysLock();
+    for (i = 0; i < count; i++) {
+        if (nsegs[i]) {
+            usbhURBSubmitI(&writes[i].tmcp->out_urb);
+        }
+    }
+    osalSysUnlock();
+
+    for (i = 0; i < count; i++) {
+        USBHTmcDriver *tmcp = writes[i].tmcp;
+        if (nsegs[i]) {
+            osalSysLock();
+            if (usbhURBWaitTimeoutS(&tmcp->out_urb, timeout) == MSG_TIMEOUT) {
+                usbhURBCancelAndWaitS(&tmcp->out_urb);
+            }
+            osalSysUnlock();
+
+            bool sent = _stat_status(tmcp, tmcp->out_urb.status) ==
+                        USBH_URBSTATUS_OK;
+            for (size_t s = 1; sent && s < nsegs[i]; s++) {
+                sent = _stat_status(tmcp,
+                                    usbhBulkTransfer(&tmcp->epout,
+                                                     segs[i][s].buf,
+                                                     segs[i][s].len, NULL,
+                                                     timeout)) ==
+                       USBH_URBSTATUS_OK;
+            }
+            if (sent) {
+                writes[i].ok    = true;
+                writes[i].start = start;
+                writes[i].done  = tmcp->out_done;
+                _stat_latency(tmcp, USBHTMC_LAT_WRITE, start,
+                              nsegs[i] > 1 ? chSysGetRealtimeCounterX()
+                                           : tmcp->out_done);
+                ok++;
+            } else {
+                uerrf("[TMC] Group write to TMC%u failed", tmcp->index);
+                tmcp->recover |= TMC_RECOVER_OUT;
+                _recover_locked(tmcp);
+            }
+        }
+        chSemSignal(&tmcp->sem);
+    }
+    return ok;
+}
+
+enum {
+    TMC_ASK_IDLE = 0,
+    TMC_ASK_WRITE,
+    TMC_ASK_REQUEST,
+    TMC_ASK_READ,
+};
+
+static void _ask_out_cb(usbh_urb_t *urb);
+static void _ask_in_cb(usbh_urb_t *urb);
+
+static void _ask_finishI(USBHTmcDriver *tmcp, size_t len) {
+    if (chVTIsArmedI(&tmcp->ask_vt))
+        chVTResetI(&tmcp->ask_vt);
+    if (len) {
+        _stat_latency(tmcp, USBHTMC_LAT_ASK, tmcp->ask_start,
+                      chSysGetRealtimeCounterX());
+    }
+    tmcp->ask_stage = TMC_ASK_IDLE;
+    if (tmcp->ask_cb)
+        tmcp->ask_cb(tmcp, len);
+    chSemSignalI(&tmcp->sem);
+}
+
+static void _ask_submit_outI(USBHTmcDriver *tmcp, uint8_t *buf, uint32_t len) {
+    usbhURBObjectInit(&tmcp->out_urb, &tmcp->epout, _ask_out_cb, tmcp, buf,
+                      len);
+    usbhURBSubmitI(&tmcp->out_urb);
+}
+
+static void _ask_request_inI(USBHTmcDriver *tmcp) {
+    size_t read_len = USBH_TMC_BUF_SIZE - sizeof(struct dev_dep_msg_in_hdr);
+    if (tmcp->ask_buflen - tmcp->ask_len < read_len)
+        read_len = tmcp->ask_buflen - tmcp->ask_len;
+
+    tmcp->ask_stage    = TMC_ASK_REQUEST;
+    tmcp->ask_read_len = read_len;
+    _ask_submit_outI(tmcp, outbuf[tmcp->index],
+                     _build_request_msg_in(tmcp, read_len, true));
+}
+
+static void _ask_out_cb(usbh_urb_t *urb) {
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)urb->userData;
+
+    if (_stat_status(tmcp, urb->status) != USBH_URBSTATUS_OK) {
+        uerrf("[TMC] Async out status = %d (!= OK)", urb->status);
+        tmcp->recover |= TMC_RECOVER_OUT;
+        _ask_finishI(tmcp, 0);
+        return;
+    }
+
+    rtcnt_t now = chSysGetRealtimeCounterX();
+    if (tmcp->ask_stage == TMC_ASK_WRITE) {
+        if (++tmcp->ask_seg < tmcp->ask_nsegs) {
+            _ask_submit_outI(tmcp, tmcp->ask_segs[tmcp->ask_seg].buf,
+                             tmcp->ask_segs[tmcp->ask_seg].len);
+        } else {
+            _stat_latency(tmcp, USBHTMC_LAT_WRITE, tmcp->chunk_start, now);
+            tmcp->chunk_start = now;
+            _ask_request_inI(tmcp);
+        }
+        return;
+    }
+
+    _stat_latency(tmcp, USBHTMC_LAT_REQUEST, tmcp->chunk_start, now);
+    tmcp->chunk_start = now;
+    tmcp->ask_stage   = TMC_ASK_READ;
+    usbhURBObjectInit(&tmcp->in_urb, &tmcp->epin, _ask_in_cb, tmcp,
+                      inbuf[tmcp->index], _msg_in_xfer_len(tmcp->ask_read_len));
+    usbhURBSubmitI(&tmcp->in_urb);
+}
+
+static void _ask_in_cb(usbh_urb_t *urb) {
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)urb->userData;
+
+    if (_stat_status(tmcp, urb->status) != USBH_URBSTATUS_OK) {
+        uerrf("[TMC] Async in status = %d (!= OK)", urb->status);
+        tmcp->recover |= TMC_RECOVER_IN;
+        _ask_finishI(tmcp, 0);
+        return;
+    }
+
+    struct dev_dep_msg_in_hdr hdr;
+    memcpy(&hdr, inbuf[tmcp->index], sizeof(hdr));
+
+    /* A stale answer that fit in this URB is simply dropped and the read
+     * retried; anything longer is left to the abort after failing */
+    if (_is_stale(tmcp, inbuf[tmcp->index], urb->actualLength) &&
+        (urb->actualLength >= _msg_in_xfer_len(hdr.dwTransferSize) ||
+         urb->actualLength < urb->requestedLength)) {
+        uwarnf("[TMC] Dropping stale async answer, tag %02x", hdr.bTag);
+        tmcp->stats.stale++;
+        usbhURBObjectResetI(urb);
+        usbhURBSubmitI(urb);
+        return;
+    }
+
+    rtcnt_t now = chSysGetRealtimeCounterX();
+    _stat_latency(tmcp, USBHTMC_LAT_BULK_IN, tmcp->chunk_start, now);
+    tmcp->chunk_start = now;
+    if (!_check_msg_in(tmcp, &hdr, urb->actualLength,
+                       tmcp->ask_buflen - tmcp->ask_len)) {
+        tmcp->recover |= TMC_RECOVER_IN;
+        _ask_finishI(tmcp, 0);
+        return;
+    }
+
+    memcpy(tmcp->ask_buf + tmcp->ask_len, inbuf[tmcp->index] + sizeof(hdr),
+           hdr.dwTransferSize);
+    tmcp->ask_len += hdr.dwTransferSize;
+    tmcp->ask_buf[tmcp->ask_len] = 0;
+
+    if ((hdr.bmTransferAttributes & USBH_TMC_ATTRIBUTE_EOM) ||
+        tmcp->ask_len >= tmcp->ask_buflen) {
+        _ask_finishI(tmcp, tmcp->ask_len);
+    } else {
+        _ask_request_inI(tmcp);
+    }
+}
+
+static void _ask_timeout_cb(void *arg) {
+    USBHTmcDriver *const tmcp = (USBHTmcDriver *)arg;
+
+    uinfo("[TMC] Async ask timeout");
+    osalSysLockFromISR();
+    tmcp->stats.timeouts++;
+    _rtt_backoff(tmcp);
+    /* The cancelled URB completes through its callback, which finishes the
+     * ask */
+    if (tmcp->ask_stage == TMC_ASK_READ) {
+        usbhURBCancelI(&tmcp->in_urb);
+    } else if (tmcp->ask_stage != TMC_ASK_IDLE) {
+        usbhURBCancelI(&tmcp->out_urb);
+    }
+    osalSysUnlockFromISR();
+}
+
+/* Start a query without blocking. Returns false if the driver is busy or not
+ * ready; otherwise cb is called once the answer is in (or the ask failed).
+ * query and answer must stay valid until then. As with usbhtmcRead, answer
+ * needs room for a terminating NUL after answerlen bytes. */
+bool usbhtmcAskAsync(USBHTmcDriver *tmcp, const char *query, size_t querylen,
+                     char *answer, size_t answerlen, systime_t timeout,
+                     usbhtmc_ask_cb_t cb) {
+    osalDbgCheck(tmcp && query && answer);
+    if (chSemWaitTimeout(&tmcp->sem, TIME_IMMEDIATE) != MSG_OK) {
+        return false;
+    }
+    /* A failed async ask leaves its recovery to the next caller */
+    _recover_locked(tmcp);
+    if (tmcp->state != USBHTMC_STATE_READY ||
+        2 * tmcp->epout.wMaxPacketSize > USBH_TMC_BUF_SIZE ||
+        (tmcp->caps.bInterfaceCapabilities &
+         (USBH_TMC_CAP_LISTEN_ONLY | USBH_TMC_CAP_TALK_ONLY))) {
+        chSemSignal(&tmcp->sem);
+        return false;
+    }
+
+    tmcp->ask_cb      = cb;
+    tmcp->ask_buf     = answer;
+    tmcp->ask_buflen  = answerlen;
+    tmcp->ask_len     = 0;
+    tmcp->ask_nsegs   = _out_segments(tmcp, (const uint8_t *)query, querylen,
+                                    USBH_TMC_ATTRIBUTE_EOM, tmcp->ask_segs);
+    tmcp->ask_seg     = 0;
+    tmcp->ask_stage   = TMC_ASK_WRITE;
+    tmcp->ask_start   = chSysGetRealtimeCounterX();
+    tmcp->chunk_start = tmcp->ask_start;
+
+    osalSysLock();
+    chVTSetI(&tmcp->ask_vt, timeout, _ask_timeout_cb, tmcp);
+    _ask_submit_outI(tmcp, tmcp->ask_segs[0].buf, tmcp->ask_segs[0].len);
+    osalSysUnlock();
+    return true;
+}
+
+/* Abandon an in-flight usbhtmcAskAsync(), so a command that must go out now
+ * doesn't wait out a slow poll. The ask's callback is not called. The device
+ * may still hold the answer, so the next caller aborts bulk IN first.
+ * Returns true if an ask was cancelled. */
+bool usbhtmcAskCancel(USBHTmcDriver *tmcp) {
+    osalDbgCheck(tmcp);
+    osalSysLock();
+    if (tmcp->ask_stage == TMC_ASK_IDLE) {
+        osalSysUnlock();
+        return false;
+    }
+    tmcp->ask_cb = NULL;
+    tmcp->recover |= TMC_RECOVER_IN;
+    /* The cancelled URB completes through its callback, which finishes the
+     * ask and releases the driver */
+    if (tmcp->ask_stage == TMC_ASK_READ) {
+        usbhURBCancelI(&tmcp->in_urb);
+    } else {
+        usbhURBCancelI(&tmcp->out_urb);
+    }
+    osalOsRescheduleS();
+    osalSysUnlock();
+    return true;
+}
+
+/* Deadline for one command or query: the smoothed round trip time times
+ * USBH_TMC_TIMEOUT_RTT_FACTOR, clamped. Until the first answer comes back
+ * it is the ceiling. */
+systime_t usbhtmcTimeout(USBHTmcDriver *tmcp) {
+    osalDbgCheck(tmcp);
+    uint32_t ms = USBH_TMC_TIMEOUT_MAX_MS;
+    if (tmcp->srtt_us) {
+        ms = (tmcp->srtt_us * USBH_TMC_TIMEOUT_RTT_FACTOR + 999) / 1000;
+        if (ms < USBH_TMC_TIMEOUT_MIN_MS)
+            ms = USBH_TMC_TIMEOUT_MIN_MS;
+        if (ms > USBH_TMC_TIMEOUT_MAX_MS)
+            ms = USBH_TMC_TIMEOUT_MAX_MS;
+    }
+    return TIME_MS2I(ms);
+}
+
+/* Read an IEEE 488.2 block response in constant memory, handing the payload
+ * to cb as it arrives. Returns the number of payload bytes delivered, or 0 on
+ * failure. */
+size_t usbhtmcReadBlock(USBHTmcDriver *tmcp, usbhtmc_block_cb_t cb,
+                        void *user, systime_t timeout) {
+    osalDbgCheck(tmcp && cb);
+    chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
+
+    size_t len = _read_block_locked(tmcp, cb, user, timeout);
+
+    _recover_locked(tmcp);
+    chSemSignal(&tmcp->sem);
+    return len;
+}
+
+size_t usbhtmcAskBlock(USBHTmcDriver *tmcp, const char *query, size_t querylen,
+                       usbhtmc_block_cb_t cb, void *user, systime_t timeout) {
+    osalDbgCheck(tmcp && cb);
+    chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
+
+    rtcnt_t start = chSysGetRealtimeCounterX();
+    size_t  len   = 0;
+    if (_write_locked(tmcp, query, querylen, timeout) == querylen) {
+        len = _read_block_locked(tmcp, cb, user, timeout);
+    }
+    if (len) {
+        _stat_latency(tmcp, USBHTMC_LAT_ASK, start,
+                      chSysGetRealtimeCounterX());
+    }
+
+    _recover_locked(tmcp);
     chSemSignal(&tmcp->sem);
     return len;
 }
@@ -466,18 +1676,156 @@ usbh_urbstatus_t usbhtmcIndicatorPulse(USBHTmcDriver *tmcp, uint8_t *status) {
     uint8_t *bufp = status;
     if (!status)
         bufp = &buf;
+    if (!(tmcp->caps.bInterfaceCapabilities & USBH_TMC_CAP_INDICATOR_PULSE))
+        return USBH_URBSTATUS_ERROR;
     return usbhControlRequest(
         tmcp->dev, USBH_REQTYPE_CLASSIN(USBH_REQTYPE_RECIP_INTERFACE),
         USBH_TMC_REQ_INDICATOR_PULSE, 0, tmcp->ifnum, 1, bufp);
 }
 
+/* USB488 READ_STATUS_BYTE. Devices with an interrupt endpoint return the
+ * status byte there, tagged with the request's bTag, rather than in the
+ * control response. Not reentrant. */
+usbh_urbstatus_t usbhtmcReadStatusByte(USBHTmcDriver *tmcp, uint8_t *stb,
+                                       systime_t timeout) {
+    osalDbgCheck(tmcp && stb);
+    USBH_DEFINE_BUFFER(uint8_t buf[3]);
+
+    if (!usbhtmcIsUSB488(tmcp) || tmcp->state != USBHTMC_STATE_READY) {
+        return USBH_URBSTATUS_ERROR;
+    }
+
+    /* bTag for READ_STATUS_BYTE must be in the range 2..127 */
+    osalSysLock();
+    tmcp->stb_tag   = (tmcp->stb_tag < 2 || tmcp->stb_tag >= 127)
+                        ? 2
+                        : tmcp->stb_tag + 1;
+    tmcp->stb_ready = false;
+    osalSysUnlock();
+
+    usbh_urbstatus_t status = usbhControlRequest(
+        tmcp->dev, USBH_REQTYPE_CLASSIN(USBH_REQTYPE_RECIP_INTERFACE),
+        USBH_TMC_REQ_READ_STATUS_BYTE, tmcp->stb_tag, tmcp->ifnum,
+        sizeof(buf), buf);
+    if (status != USBH_URBSTATUS_OK) {
+        return status;
+    }
+    if (buf[0] != USBH_TMC_STATUS_SUCCESS) {
+        uwarnf("[TMC] READ_STATUS_BYTE status %02x", buf[0]);
+        return USBH_URBSTATUS_ERROR;
+    }
+
+    if (!usbhtmcHasInterruptIn(tmcp)) {
+        *stb = buf[2];
+        return USBH_URBSTATUS_OK;
+    }
+
+    msg_t msg = MSG_OK;
+    osalSysLock();
+    if (!tmcp->stb_ready) {
+        msg = osalThreadSuspendTimeoutS(&tmcp->stb_thread, timeout);
+    }
+    *stb = tmcp->stb_value;
+    osalSysUnlock();
+
+    return msg == MSG_OK ? USBH_URBSTATUS_OK : USBH_URBSTATUS_TIMEOUT;
+}
+
 usbh_urbstatus_t usbhtmcGetCapabilities(USBHTmcDriver *      tmcp,
                                         USBHTmcCapabilities *capp) {
     osalDbgCheck(tmcp && capp);
-    return usbhControlRequest(
+    USBH_DEFINE_BUFFER(USBHTmcCapabilities caps);
+
+    usbh_urbstatus_t status = usbhControlRequest(
         tmcp->dev, USBH_REQTYPE_CLASSIN(USBH_REQTYPE_RECIP_INTERFACE),
-        USBH_TMC_REQ_GET_CAPABILITIES, 0, tmcp->ifnum, sizeof(*capp),
-        (uint8_t *)capp);
+        USBH_TMC_REQ_GET_CAPABILITIES, 0, tmcp->ifnum, sizeof(caps),
+        (uint8_t *)&caps);
+    if (status == USBH_URBSTATUS_OK && caps.bStatus != USBH_TMC_STATUS_SUCCESS)
+        status = USBH_URBSTATUS_ERROR;
+    if (status == USBH_URBSTATUS_OK)
+        *capp = caps;
+    return status;
+}
+
+/* Fill in the cached capabilities at start. A device that won't report them
+ * is assumed to do what we relied on before asking: indicator pulse, and for
+ * USB488 the 488.2 status model with SRQ notifications. */
+static void _load_capabilities(USBHTmcDriver *tmcp) {
+    if (usbhtmcGetCapabilities(tmcp, &tmcp->caps) == USBH_URBSTATUS_OK) {
+        uinfof("[TMC] Capabilities %02x/%02x, USB488 %02x/%02x",
+               tmcp->caps.bInterfaceCapabilities,
+               tmcp->caps.bDeviceCapabilities,
+               tmcp->caps.bUSB488InterfaceCapabilities,
+               tmcp->caps.bUSB488DeviceCapabilities);
+        return;
+    }
+
+    uwarn("[TMC] GET_CAPABILITIES failed, using defaults");
+    memset(&tmcp->caps, 0, sizeof(tmcp->caps));
+    tmcp->caps.bInterfaceCapabilities = USBH_TMC_CAP_INDICATOR_PULSE;
+    if (usbhtmcIsUSB488(tmcp)) {
+        tmcp->caps.bUSB488InterfaceCapabilities = USBH_TMC_USB488_CAP_488_2;
+        tmcp->caps.bUSB488DeviceCapabilities    = USBH_TMC_USB488_CAP_SR1;
+    }
+}
+
+/* USB488 TRIGGER message, the equivalent of *TRG or a GPIB GET */
+usbh_urbstatus_t usbhtmcTrigger(USBHTmcDriver *tmcp, systime_t timeout) {
+    osalDbgCheck(tmcp);
+    if (!usbhtmcCanTrigger(tmcp))
+        return USBH_URBSTATUS_ERROR;
+
+    chSemWait(&tmcp->sem);
+    _recover_locked(tmcp);
+
+    usbh_urbstatus_t status = USBH_URBSTATUS_ERROR;
+    if (tmcp->state == USBHTMC_STATE_READY) {
+        struct dev_dep_msg_out_hdr hdr = {};
+        hdr.bMsgId                     = USBH_TMC_MSGID_TRIGGER;
+        hdr.bTag                       = _get_next_tag(tmcp);
+        hdr.bTagInverse                = ~hdr.bTag & 0xFF;
+        tmcp->out_tag                  = hdr.bTag;
+        memcpy(outbuf[tmcp->index], &hdr, sizeof(hdr));
+
+        status = _bulk_xfer(tmcp, USBHTMC_LAT_WRITE, &tmcp->epout,
+                            outbuf[tmcp->index], sizeof(hdr), NULL, timeout);
+        if (status != USBH_URBSTATUS_OK) {
+            uerrf("[TMC] Trigger status = %d (!= OK)", status);
+            tmcp->recover |= TMC_RECOVER_OUT;
+            _recover_locked(tmcp);
+        }
+    }
+
+    chSemSignal(&tmcp->sem);
+    return status;
+}
+
+static usbh_urbstatus_t _usb488_request(USBHTmcDriver *tmcp, uint8_t req,
+                                        uint16_t wValue) {
+    USBH_DEFINE_BUFFER(uint8_t buf);
+
+    if (!(tmcp->caps.bUSB488InterfaceCapabilities &
+          USBH_TMC_USB488_CAP_REN_CONTROL))
+        return USBH_URBSTATUS_ERROR;
+
+    usbh_urbstatus_t status = usbhControlRequest(
+        tmcp->dev, USBH_REQTYPE_CLASSIN(USBH_REQTYPE_RECIP_INTERFACE), req,
+        wValue, tmcp->ifnum, 1, &buf);
+    if (status == USBH_URBSTATUS_OK && buf != USBH_TMC_STATUS_SUCCESS)
+        status = USBH_URBSTATUS_ERROR;
+    return status;
+}
+
+/* USB488 REN_CONTROL: assert or release Remote Enable */
+usbh_urbstatus_t usbhtmcRemoteEnable(USBHTmcDriver *tmcp, bool enable) {
+    osalDbgCheck(tmcp);
+    return _usb488_request(tmcp, USBH_TMC_REQ_REN_CONTROL, enable ? 1 : 0);
+}
+
+/* USB488 GO_TO_LOCAL: hand the front panel back to the user */
+usbh_urbstatus_t usbhtmcGoToLocal(USBHTmcDriver *tmcp) {
+    osalDbgCheck(tmcp);
+    return _usb488_request(tmcp, USBH_TMC_REQ_GO_TO_LOCAL, 0);
 }
 
 static void _tmc_object_init(USBHTmcDriver *tmcp, size_t index) {
@@ -486,6 +1834,7 @@ static void _tmc_object_init(USBHTmcDriver *tmcp, size_t index) {
     tmcp->info  = &usbhTmcClassDriverInfo;
     tmcp->index = index;
     chSemObjectInit(&tmcp->sem, 1);
+    chVTObjectInit(&tmcp->ask_vt);
 }
 
 static void _tmc_init(void) {
@@ -26,13 +26,43 @@
 /*===========================================================================*/
 /* Driver pre-compile time settings.                                         */
 /*===========================================================================*/
-#define USBH_TMC_MAX_INSTANCES 1
+#if !defined(USBH_TMC_MAX_INSTANCES)
+#define USBH_TMC_MAX_INSTANCES 3
+#endif
 #define USBH_TMC_BUF_SIZE (1 << 8)
+#define USBH_TMC_MAX_OUT_SEGS 3
+#define USBH_TMC_INT_BUF_SIZE 64
+/* Transfer size asked for by each REQUEST_DEV_DEP_MSG_IN of a block read */
+#define USBH_TMC_STREAM_XFER_SIZE (1UL << 20)
+/* Status polls allowed while an abort or clear completes, ~1 ms apart */
+#define USBH_TMC_RECOVER_POLLS 20
+/* Bulk IN timeout while flushing a device after an abort */
+#define USBH_TMC_DRAIN_TIMEOUT_MS 10
+/* Buffers for usbhtmcReadInPlace() and usbhtmcAskInPlace(): a prefix taking
+ * the transfer header, then n bytes of answer plus alignment padding and the
+ * terminating NUL. Should be 4 byte aligned, see USBH_DEFINE_BUFFER. */
+#define USBH_TMC_RX_PREFIX 12
+#define USBH_TMC_RX_BUF_SIZE(n) (USBH_TMC_RX_PREFIX + (n) + 4)
+/* Stale answers dropped per read before giving up */
+#define USBH_TMC_MAX_STALE 4
+/* Adaptive command deadlines, see usbhtmcTimeout() */
+#define USBH_TMC_TIMEOUT_RTT_FACTOR 8
+#define USBH_TMC_TIMEOUT_MIN_MS 30
+#define USBH_TMC_TIMEOUT_MAX_MS 1000
+/* Latency histogram buckets, bounds in usbhtmcHistBounds */
+#define USBH_TMC_HIST_BUCKETS 8
+/* Largest DEV_DEP_MSG_OUT built by usbhtmcEncodeFrame(), header included */
+#define USBH_TMC_FRAME_SIZE 128
 
 /*===========================================================================*/
 /* Derived constants and error checks.                                       */
 /*===========================================================================*/
 
+#define USBTMC_INTERFACE_CLASS 0xFE
+#define USBTMC_INTERFACE_SUBCLASS 0x03
+#define USBTMC_INTERFACE_PROTOCOL_USBTMC 0x0
+#define USBTMC_INTERFACE_PROTOCOL_USB488 0x1
+
 typedef enum {
     USBH_TMC_STATUS_SUCCESS                  = 0x01,
     USBH_TMC_STATUS_PENDING                  = 0x02,
@@ -55,6 +85,111 @@ typedef enum {
 
 typedef struct USBHTmcDriver USBHTmcDriver;
 
+/* GET_CAPABILITIES response, including the USB488 subclass fields */
+typedef struct USBHTmcCapabilities USBHTmcCapabilities;
+
+struct USBHTmcCapabilities {
+    uint8_t  bStatus;
+    uint8_t  bReserved0;
+    uint16_t bcdUSBTMC;
+    uint8_t  bInterfaceCapabilities;
+    uint8_t  bDeviceCapabilities;
+    uint8_t  bReserved1[6];
+    uint16_t bcdUSB488;
+    uint8_t  bUSB488InterfaceCapabilities;
+    uint8_t  bUSB488DeviceCapabilities;
+    uint8_t  bReserved2[8];
+};
+
+/* bInterfaceCapabilities */
+enum {
+    USBH_TMC_CAP_LISTEN_ONLY     = 0x01,
+    USBH_TMC_CAP_TALK_ONLY       = 0x02,
+    USBH_TMC_CAP_INDICATOR_PULSE = 0x04,
+};
+
+/* bDeviceCapabilities */
+enum {
+    USBH_TMC_CAP_TERMCHAR = 0x01,
+};
+
+/* bUSB488InterfaceCapabilities and bUSB488DeviceCapabilities */
+enum {
+    USBH_TMC_USB488_CAP_TRIGGER     = 0x01,
+    USBH_TMC_USB488_CAP_REN_CONTROL = 0x02,
+    USBH_TMC_USB488_CAP_488_2       = 0x04,
+
+    USBH_TMC_USB488_CAP_DT1  = 0x01,
+    USBH_TMC_USB488_CAP_RL1  = 0x02,
+    USBH_TMC_USB488_CAP_SR1  = 0x04,
+    USBH_TMC_USB488_CAP_SCPI = 0x08,
+};
+
+/* Completion callback for usbhtmcAskAsync(), called from ISR context with the
+ * system locked. len is the answer length, or 0 on failure. */
+typedef void (*usbhtmc_ask_cb_t)(USBHTmcDriver *tmcp, size_t len);
+
+/* Called from ISR context with the system locked when a USB488 device sends
+ * an SRQ notification on the interrupt IN endpoint. */
+typedef void (*usbhtmc_srq_cb_t)(USBHTmcDriver *tmcp, uint8_t status_byte);
+
+/* Receives consecutive pieces of block data from usbhtmcReadBlock, in thread
+ * context. Return false to abort the read. */
+typedef bool (*usbhtmc_block_cb_t)(void *user, const uint8_t *data, size_t n);
+
+typedef struct {
+    usbhtmc_srq_cb_t srq_cb;
+} USBHTmcConfig;
+
+typedef enum {
+    USBHTMC_LAT_WRITE = 0, /* complete DEV_DEP_MSG_OUT */
+    USBHTMC_LAT_REQUEST,   /* REQUEST_DEV_DEP_MSG_IN */
+    USBHTMC_LAT_BULK_IN,   /* request sent to DEV_DEP_MSG_IN received */
+    USBHTMC_LAT_ASK,       /* query written to answer complete */
+    USBHTMC_LAT_COUNT
+} usbhtmc_lat_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint64_t total_us;
+    uint32_t buckets[USBH_TMC_HIST_BUCKETS];
+} usbhtmc_hist_t;
+
+/* Per connection transfer statistics, cleared by usbhtmcStart() */
+typedef struct {
+    usbhtmc_hist_t lat[USBHTMC_LAT_COUNT];
+    uint32_t       timeouts;
+    uint32_t       stalls;
+    uint32_t       errors;
+    uint32_t       bad_tags;
+    uint32_t       stale;
+    uint32_t       aborts;
+    uint32_t       clears;
+} USBHTmcStats;
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t len;
+} usbhtmc_seg_t;
+
+/* A complete DEV_DEP_MSG_OUT transfer, padding included, built ahead of time
+ * by usbhtmcEncodeFrame(). Sending it only fills in the bTag. */
+typedef struct {
+    uint32_t len; /* bytes of buf to send */
+    uint8_t  buf[USBH_TMC_FRAME_SIZE];
+} USBHTmcFrame;
+
+typedef struct {
+    USBHTmcDriver *tmcp;
+    const char *   cmd;
+    USBHTmcFrame * frame; /* sent instead of cmd if set */
+    /* Filled in by usbhtmcWriteGroup */
+    bool    ok;
+    rtcnt_t start; /* realtime counter when the first URB was submitted */
+    rtcnt_t done;  /* realtime counter when the first URB completed */
+} USBHTmcGroupWrite;
+
 struct USBHTmcDriver {
     /* inherited from abstract class driver */
     _usbh_base_classdriver_data
@@ -65,54 +200,133 @@ struct USBHTmcDriver {
 
     usbh_urb_t in_urb;
     usbh_urb_t out_urb;
+    usbh_urb_t int_urb;
+
+    const USBHTmcConfig *config;
+
+    /* GET_CAPABILITIES, fetched by usbhtmcStart() */
+    USBHTmcCapabilities caps;
+
+    /* READ_STATUS_BYTE answered over the interrupt endpoint */
+    thread_reference_t stb_thread;
+    uint8_t            stb_tag;
+    uint8_t            stb_value;
+    bool               stb_ready;
+
+    USBHTmcStats stats;
+    rtcnt_t      ask_start;   /* usbhtmcAskAsync() started */
+    rtcnt_t      chunk_start; /* current transfer stage submitted */
+    rtcnt_t      out_done;    /* last stamped OUT URB completed */
+    rtcnt_t      in_done;     /* last stamped IN URB completed */
+    uint32_t     srtt_us;     /* smoothed ask round trip, 0 if unknown */
 
     usbhtmc_state_t state;
 
     semaphore_t sem;
 
+    /* in-flight usbhtmcAskAsync() */
+    virtual_timer_t  ask_vt;
+    usbhtmc_ask_cb_t ask_cb;
+    char *           ask_buf;
+    size_t           ask_buflen;
+    size_t           ask_len;
+    size_t           ask_read_len;
+    usbhtmc_seg_t    ask_segs[USBH_TMC_MAX_OUT_SEGS];
+    uint8_t          ask_nsegs;
+    uint8_t          ask_seg;
+    uint8_t          ask_stage;
+
     uint8_t ifnum;
+    uint8_t protocol;
     uint8_t index;
     uint8_t last_btag;
+    uint8_t out_tag; /* bTag of the last DEV_DEP_MSG_OUT */
+    uint8_t in_tag;  /* bTag of the last REQUEST_DEV_DEP_MSG_IN */
+    uint8_t recover; /* directions to abort before the next transfer */
 };
 
-typedef struct USBHTmcCapabilities USBHTmcCapabilities;
-
-struct USBHTmcCapabilities {
-    uint8_t  bStatus;
-    uint8_t  bReserved0;
-    uint16_t bcdUSBTMC;
-    uint8_t  bInterfaceCapabilities;
-    uint8_t  bDeviceCapabilities;
-    uint32_t dwReserved1;
-    uint32_t dwReserved2;
-};
 
 /*===========================================================================*/
 /* Driver macros.                                                            */
 /*===========================================================================*/
 
+#define usbhtmcIsUSB488(tmcp)                                                  \
+    ((tmcp)->protocol == USBTMC_INTERFACE_PROTOCOL_USB488)
+
+/* The answer inside a buffer filled by usbhtmcReadInPlace() */
+#define usbhtmcRxPayload(buf) ((char *)(buf) + USBH_TMC_RX_PREFIX)
+
+/* Capabilities reported at usbhtmcStart(), valid while the driver is ready */
+#define usbhtmcGetCaps(tmcp) (&(tmcp)->caps)
+
+#define usbhtmcHasTermChar(tmcp)                                               \
+    (((tmcp)->caps.bDeviceCapabilities & USBH_TMC_CAP_TERMCHAR) != 0)
+
+#define usbhtmcCanTrigger(tmcp)                                                \
+    (usbhtmcIsUSB488(tmcp) && ((tmcp)->caps.bUSB488InterfaceCapabilities &    \
+                               USBH_TMC_USB488_CAP_TRIGGER))
+
+/* True if the device implements the IEEE 488.2 status byte model */
+#define usbhtmcHas488_2(tmcp)                                                  \
+    (usbhtmcIsUSB488(tmcp) && ((tmcp)->caps.bUSB488InterfaceCapabilities &    \
+                               USBH_TMC_USB488_CAP_488_2))
+
+/* True if the device has an interrupt IN endpoint. A USB488 device with one
+ * returns READ_STATUS_BYTE results there, whatever its capabilities. */
+#define usbhtmcHasInterruptIn(tmcp)                                            \
+    ((tmcp)->epint.status != USBH_EPSTATUS_UNINITIALIZED)
+
+/* True if the device can deliver USB488 notifications (SRQ) */
+#define usbhtmcHasNotifications(tmcp)                                          \
+    (usbhtmcIsUSB488(tmcp) && usbhtmcHasInterruptIn(tmcp) &&                   \
+     ((tmcp)->caps.bUSB488DeviceCapabilities & USBH_TMC_USB488_CAP_SR1))
+
 /*===========================================================================*/
 /* External declarations.                                                    */
 /*===========================================================================*/
 
 extern USBHTmcDriver USBHTMCD[USBH_TMC_MAX_INSTANCES];
+/* Upper bounds in us of all but the last latency bucket */
+extern const uint32_t usbhtmcHistBounds[USBH_TMC_HIST_BUCKETS - 1];
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 /* API goes here */
-void   usbhtmcStart(USBHTmcDriver *tmcp);
+void   usbhtmcStart(USBHTmcDriver *tmcp, const USBHTmcConfig *cfg);
 void   usbhtmcStop(USBHTmcDriver *tmcp);
 size_t usbhtmcWrite(USBHTmcDriver *tmcp, const char *data, size_t n,
                     systime_t timeout);
 size_t usbhtmcRead(USBHTmcDriver *tmcp, char *data, size_t n,
                    systime_t timeout);
+size_t usbhtmcEncodeFrame(USBHTmcFrame *frame, const char *data, size_t n);
 size_t usbhtmcAsk(USBHTmcDriver *tmcp, const char *query, size_t querylen,
                   char *answer, size_t answerlen, systime_t timeout);
+size_t usbhtmcReadInPlace(USBHTmcDriver *tmcp, uint8_t *buf, size_t n,
+                          systime_t timeout);
+size_t usbhtmcAskInPlace(USBHTmcDriver *tmcp, const char *query,
+                         size_t querylen, uint8_t *buf, size_t n,
+                         systime_t timeout);
+size_t usbhtmcReadBlock(USBHTmcDriver *tmcp, usbhtmc_block_cb_t cb, void *user,
+                        systime_t timeout);
+size_t usbhtmcAskBlock(USBHTmcDriver *tmcp, const char *query, size_t querylen,
+                       usbhtmc_block_cb_t cb, void *user, systime_t timeout);
+bool   usbhtmcAskAsync(USBHTmcDriver *tmcp, const char *query, size_t querylen,
+                       char *answer, size_t answerlen, systime_t timeout,
+                       usbhtmc_ask_cb_t cb);
+bool   usbhtmcAskCancel(USBHTmcDriver *tmcp);
+unsigned usbhtmcWriteGroup(USBHTmcGroupWrite *writes, unsigned count,
+                           systime_t timeout);
 usbh_urbstatus_t usbhtmcClear(USBHTmcDriver *tmcp);
+systime_t        usbhtmcTimeout(USBHTmcDriver *tmcp);
 usbh_urbstatus_t usbhtmcIndicatorPulse(USBHTmcDriver *tmcp, uint8_t *status);
+usbh_urbstatus_t usbhtmcReadStatusByte(USBHTmcDriver *tmcp, uint8_t *stb,
+                                       systime_t timeout);
 usbh_urbstatus_t usbhtmcGetCapabilities(USBHTmcDriver *      tmcp,
                                         USBHTmcCapabilities *capp);
+usbh_urbstatus_t usbhtmcTrigger(USBHTmcDriver *tmcp, systime_t timeout);
+usbh_urbstatus_t usbhtmcRemoteEnable(USBHTmcDriver *tmcp, bool enable);
+usbh_urbstatus_t usbhtmcGoToLocal(USBHTmcDriver *tmcp);
 
 #ifdef __cplusplus
 }
@@ -199,6 +199,109 @@ static scpi_result_t dpo3034_acquire_acquireQ(scpi_t *context) {
     return SCPI_RES_OK;
 }
 
+// Fault injection, for exercising the host driver's error handling. Each
+// DIAGnostic:FAULt command takes a count (or size/delay) and the faults are
+// consumed by the following responses, see USBTMCFaults.
+enum diag_fault {
+    FAULT_BAD_TAG,
+    FAULT_STALE_TAG,
+    FAULT_SHORT,
+    FAULT_STALL,
+    FAULT_FRAGMENT,
+    FAULT_DELAY
+};
+
+static scpi_result_t diag_fault(scpi_t *context) {
+    USBTMCFaults faults;
+    uint32_t     value;
+    uint32_t     limit = UINT8_MAX;
+
+    if (!SCPI_ParamUInt32(context, &value, TRUE)) {
+        return SCPI_RES_ERR;
+    }
+    if (SCPI_CmdTag(context) >= FAULT_FRAGMENT) {
+        limit = UINT16_MAX;
+    }
+    if (value > limit) {
+        SCPI_ErrorPush(context, SCPI_ERROR_DATA_OUT_OF_RANGE);
+        return SCPI_RES_ERR;
+    }
+
+    tmcGetFaults(&TMC1, &faults);
+    switch (SCPI_CmdTag(context)) {
+        case FAULT_BAD_TAG:
+            faults.bad_tag = value;
+            break;
+        case FAULT_STALE_TAG:
+            faults.stale_tag = value;
+            break;
+        case FAULT_SHORT:
+            faults.short_xfer = value;
+            break;
+        case FAULT_STALL:
+            faults.stall = value;
+            break;
+        case FAULT_FRAGMENT:
+            faults.fragment = value;
+            break;
+        case FAULT_DELAY:
+            faults.delay_ms = value;
+            break;
+        default:
+            return SCPI_RES_ERR;
+    }
+    tmcSetFaults(&TMC1, &faults);
+
+    return SCPI_RES_OK;
+}
+
+static scpi_result_t diag_fault_reset(scpi_t *context) {
+    static const USBTMCFaults none = {0};
+    (void)context;
+
+    tmcSetFaults(&TMC1, &none);
+
+    return SCPI_RES_OK;
+}
+
+static scpi_result_t diag_faultQ(scpi_t *context) {
+    USBTMCFaults faults;
+
+    tmcGetFaults(&TMC1, &faults);
+    SCPI_ResultInt32(context, faults.bad_tag);
+    SCPI_ResultInt32(context, faults.stale_tag);
+    SCPI_ResultInt32(context, faults.short_xfer);
+    SCPI_ResultInt32(context, faults.stall);
+    SCPI_ResultInt32(context, faults.fragment);
+    SCPI_ResultInt32(context, faults.delay_ms);
+
+    return SCPI_RES_OK;
+}
+
+// Transfer counters, read before and after a batch of footswitch presses to
+// get the bus transactions per operation. The query itself is counted too.
+static scpi_result_t diag_countQ(scpi_t *context) {
+    USBTMCCounters counters;
+
+    tmcGetCounters(&TMC1, &counters, false);
+    SCPI_ResultInt32(context, counters.msg_out);
+    SCPI_ResultInt32(context, counters.request_in);
+    SCPI_ResultInt32(context, counters.msg_in);
+    SCPI_ResultInt32(context, counters.bytes_in);
+    SCPI_ResultInt32(context, counters.faults);
+
+    return SCPI_RES_OK;
+}
+
+static scpi_result_t diag_count_reset(scpi_t *context) {
+    USBTMCCounters counters;
+    (void)context;
+
+    tmcGetCounters(&TMC1, &counters, true);
+
+    return SCPI_RES_OK;
+}
+
 const scpi_command_t scpi_commands[] = {
     /* IEEE Mandated Commands (SCPI std V1999.0 4.1.1) */
     {
@@ -334,18 +437,88 @@ const scpi_command_t scpi_commands[] = {
         .pattern  = "ACQuire?",
         .callback = dpo3034_acquire_acquireQ,
     },
+
+    /* Fault injection and transfer counters */
+    {
+        .pattern  = "DIAGnostic:FAULt:TAG:CORRupt",
+        .callback = diag_fault,
+        .tag      = FAULT_BAD_TAG,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt:TAG:STALe",
+        .callback = diag_fault,
+        .tag      = FAULT_STALE_TAG,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt:SHORt",
+        .callback = diag_fault,
+        .tag      = FAULT_SHORT,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt:STALl",
+        .callback = diag_fault,
+        .tag      = FAULT_STALL,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt:FRAGment",
+        .callback = diag_fault,
+        .tag      = FAULT_FRAGMENT,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt:DELay",
+        .callback = diag_fault,
+        .tag      = FAULT_DELAY,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt:RESet",
+        .callback = diag_fault_reset,
+    },
+    {
+        .pattern  = "DIAGnostic:FAULt?",
+        .callback = diag_faultQ,
+    },
+    {
+        .pattern  = "DIAGnostic:COUNt?",
+        .callback = diag_countQ,
+    },
+    {
+        .pattern  = "DIAGnostic:COUNt:RESet",
+        .callback = diag_count_reset,
+    },
     SCPI_CMD_LIST_END};
 
+// Bytes queued since the last flush, for DIAGnostic:FAULt:FRAGment
+static size_t fragment_fill;
+
 static size_t SCPI_Write(scpi_t *context, const char *data, size_t len) {
-    (void)context;
+    USBTMCFaults faults;
+    size_t       n = 0;
+
     (void)streamWrite(&SD1, (uint8_t *)data, len);
-    return obqWriteTimeout(&(TMC1.obqueue), (uint8_t *)data, len,
-                           TIME_INFINITE);
+    tmcGetFaults(&TMC1, &faults);
+    while (n < len) {
+        size_t chunk = len - n;
+        if (faults.fragment && chunk > faults.fragment - fragment_fill) {
+            chunk = faults.fragment - fragment_fill;
+        }
+        size_t done = obqWriteTimeout(&(TMC1.obqueue), (uint8_t *)data + n,
+                                      chunk, TIME_INFINITE);
+        n += done;
+        fragment_fill += done;
+        if (done < chunk) {
+            break;
+        }
+        if (faults.fragment && fragment_fill >= faults.fragment) {
+            SCPI_Flush(context);
+        }
+    }
+    return n;
 }
 
 static scpi_result_t SCPI_Flush(scpi_t *context) {
     (void)context;
 
+    fragment_fill = 0;
     obqFlush(&(TMC1.obqueue));
     return SCPI_RES_OK;
 }
@@ -436,6 +609,12 @@ THD_FUNCTION(scpiThread, arg) {
         streamWrite(&SD1, buf, len);
         chprintf((BaseSequentialStream *)&SD1, "\"\r\n");
 
+        USBTMCFaults faults;
+        tmcGetFaults(&TMC1, &faults);
+        if (faults.delay_ms) {
+            chThdSleepMilliseconds(faults.delay_ms);
+        }
+
         scpi_bool_t result = SCPI_Parse(&scpi_context, (char *)buf, len);
 
         chprintf((BaseSequentialStream *)&SD1, "SCPI Parser Result: %d\r\n",
@@ -248,6 +248,8 @@ void tmcObjectInit(USBTMCDriver *tmcp) {
     tmcp->vmt = &vmt;
     osalEventObjectInit(&tmcp->event);
     tmcp->state = TMC_STOP;
+    memset(&tmcp->faults, 0, sizeof tmcp->faults);
+    memset(&tmcp->counters, 0, sizeof tmcp->counters);
     ibqObjectInit(&tmcp->ibqueue, true, tmcp->ib, USB_TMC_BUFFERS_SIZE,
                   USB_TMC_BUFFERS_NUMBER, ibnotify, tmcp);
     obqObjectInit(&tmcp->obqueue, true, tmcp->ob, USB_TMC_BUFFERS_SIZE,
@@ -532,10 +534,35 @@ static int handleMsgOut(USBTMCDriver *tmcp, uint8_t *buf, size_t size) {
 
 static void txDevDepMsgIn(USBTMCDriver *tmcp, uint8_t btag, uint8_t *txbuf,
                           size_t txsize) {
+    USBTMCFaults *faults = &tmcp->faults;
+    uint8_t       tag    = btag;
+    uint8_t       inv    = ~btag;
+    size_t        n      = (txsize + 3) / 4 * 4 + 12;
+
+    if (faults->bad_tag) {
+        faults->bad_tag--;
+        tmcp->counters.faults++;
+        inv ^= 0x01;
+    } else if (faults->stale_tag) {
+        faults->stale_tag--;
+        tmcp->counters.faults++;
+        tag = tmcp->last_btag ? tmcp->last_btag : (uint8_t)(btag + 1);
+        inv = ~tag;
+    }
+    if (faults->short_xfer && txsize > 1) {
+        /* Advertise the whole message but end the transfer halfway.*/
+        faults->short_xfer--;
+        tmcp->counters.faults++;
+        n = txsize / 2 + 12;
+    }
+    tmcp->last_btag = btag;
+    tmcp->counters.msg_in++;
+    tmcp->counters.bytes_in += txsize;
+
     memmove(txbuf + 12, txbuf, txsize);
     txbuf[0]  = MSGID_DEV_DEP_MSG_IN;
-    txbuf[1]  = btag;
-    txbuf[2]  = ~btag;
+    txbuf[1]  = tag;
+    txbuf[2]  = inv;
     txbuf[3]  = 0;
     txbuf[4]  = txsize & 0xFF;
     txbuf[5]  = (txsize >> 8) & 0xFF;
@@ -546,8 +573,7 @@ static void txDevDepMsgIn(USBTMCDriver *tmcp, uint8_t btag, uint8_t *txbuf,
     txbuf[10] = 0;
     txbuf[11] = 0;
 
-    usbStartTransmitI(tmcp->config->usbp, tmcp->config->bulk_in, txbuf,
-                      (txsize + 3) / 4 * 4 + 12);
+    usbStartTransmitI(tmcp->config->usbp, tmcp->config->bulk_in, txbuf, n);
 }
 
 static int handleMsgIn(USBTMCDriver *tmcp, uint8_t *buf, size_t size) {
@@ -565,6 +591,12 @@ static int handleMsgIn(USBTMCDriver *tmcp, uint8_t *buf, size_t size) {
     if (bmTransferAttributes != 0) {
         return -1;
     }
+    if (tmcp->faults.stall) {
+        tmcp->faults.stall--;
+        tmcp->counters.faults++;
+        usbStallTransmitI(tmcp->config->usbp, tmcp->config->bulk_in);
+        return 0;
+    }
     /* Checking if there is a buffer ready for transmission.*/
     size_t   txsize = 0;
     uint8_t *txbuf  = obqGetFullBufferI(&tmcp->obqueue, &txsize);
@@ -607,10 +639,11 @@ void tmcDataReceived(USBDriver *usbp, usbep_t ep) {
         uint8_t *buf = ibqGetEmptyBufferI(&tmcp->ibqueue);
         switch (buf[0]) {
             case MSGID_DEV_DEP_MSG_OUT:
+                tmcp->counters.msg_out++;
                 status = handleMsgOut(tmcp, buf, size);
                 break;
             case MSGID_REQUEST_DEV_DEP_MSG_IN:
-
+                tmcp->counters.request_in++;
                 status = handleMsgIn(tmcp, buf, size);
                 break;
             default:
@@ -662,4 +695,55 @@ msg_t tmcControl(USBDriver *usbp, unsigned int operation, void *arg) {
     return _ctl((void *)usbp, operation, arg);
 }
 
+/**
+ * @brief   Replaces the fault injection settings.
+ *
+ * @param[in] tmcp      pointer to a @p USBTMCDriver object
+ * @param[in] faults    new settings
+ *
+ * @api
+ */
+void tmcSetFaults(USBTMCDriver *tmcp, const USBTMCFaults *faults) {
+
+    osalSysLock();
+    tmcp->faults = *faults;
+    osalSysUnlock();
+}
+
+/**
+ * @brief   Reads the fault injection settings, including the counts of
+ *          faults not yet injected.
+ *
+ * @param[in] tmcp      pointer to a @p USBTMCDriver object
+ * @param[out] faults   current settings
+ *
+ * @api
+ */
+void tmcGetFaults(USBTMCDriver *tmcp, USBTMCFaults *faults) {
+
+    osalSysLock();
+    *faults = tmcp->faults;
+    osalSysUnlock();
+}
+
+/**
+ * @brief   Reads the bulk transfer counters.
+ *
+ * @param[in] tmcp      pointer to a @p USBTMCDriver object
+ * @param[out] counters snapshot of the counters
+ * @param[in] reset     clear the counters after reading them
+ *
+ * @api
+ */
+void tmcGetCounters(USBTMCDriver *tmcp, USBTMCCounters *counters,
+                    bool reset) {
+
+    osalSysLock();
+    *counters = tmcp->counters;
+    if (reset) {
+        memset(&tmcp->counters, 0, sizeof tmcp->counters);
+    }
+    osalSysUnlock();
+}
+
 /** @} */
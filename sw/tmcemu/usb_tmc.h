@@ -86,6 +86,42 @@ typedef struct USBTMCDriver USBTMCDriver;
 
 typedef void (*tmccallback_t)(USBTMCDriver *usbp);
 
+/**
+ * @brief   Fault injection settings.
+ * @details The counters are consumed one per bulk IN response, so a fault
+ *          armed just before a query applies to the answer of that query.
+ */
+typedef struct {
+    /** @brief Responses to send with a corrupt bTagInverse.*/
+    uint8_t bad_tag;
+    /** @brief Responses to send with the bTag of the previous response.*/
+    uint8_t stale_tag;
+    /** @brief Responses to cut short of their advertised TransferSize.*/
+    uint8_t short_xfer;
+    /** @brief REQUEST_DEV_DEP_MSG_IN transfers to answer with a stall.*/
+    uint8_t stall;
+    /** @brief Payload bytes per DEV_DEP_MSG_IN transfer, zero for no limit.*/
+    uint16_t fragment;
+    /** @brief Delay in milliseconds before a command is executed.*/
+    uint16_t delay_ms;
+} USBTMCFaults;
+
+/**
+ * @brief   Bulk transfer counters.
+ */
+typedef struct {
+    /** @brief DEV_DEP_MSG_OUT transfers received.*/
+    uint32_t msg_out;
+    /** @brief REQUEST_DEV_DEP_MSG_IN transfers received.*/
+    uint32_t request_in;
+    /** @brief DEV_DEP_MSG_IN transfers sent.*/
+    uint32_t msg_in;
+    /** @brief Payload bytes sent.*/
+    uint32_t bytes_in;
+    /** @brief Faults injected.*/
+    uint32_t faults;
+} USBTMCCounters;
+
 /**
  * @brief   Serial over USB Driver configuration structure.
  * @details An instance of this structure must be passed to @p sduStart()
@@ -129,7 +165,12 @@ typedef struct {
     /* Output buffer.*/                                                        \
     uint8_t ob[BQ_BUFFER_SIZE(USB_TMC_BUFFERS_NUMBER, USB_TMC_BUFFERS_SIZE)];  \
     uint8_t next_btag;                                                         \
+    uint8_t last_btag;                                                         \
     size_t  in_size;                                                           \
+    /* Fault injection settings.*/                                             \
+    USBTMCFaults faults;                                                       \
+    /* Bulk transfer counters.*/                                               \
+    USBTMCCounters counters;                                                   \
     /* End of the mandatory fields.*/                                          \
     /* Current configuration data.*/                                           \
     const USBTMCConfig *config;
@@ -185,6 +226,10 @@ void  tmcDataTransmitted(USBDriver *usbp, usbep_t ep);
 void  tmcDataReceived(USBDriver *usbp, usbep_t ep);
 void  tmcInterruptTransmitted(USBDriver *usbp, usbep_t ep);
 msg_t tmcControl(USBDriver *usbp, unsigned int operation, void *arg);
+void  tmcSetFaults(USBTMCDriver *tmcp, const USBTMCFaults *faults);
+void  tmcGetFaults(USBTMCDriver *tmcp, USBTMCFaults *faults);
+void  tmcGetCounters(USBTMCDriver *tmcp, USBTMCCounters *counters,
+                     bool reset);
 #ifdef __cplusplus
 }
 #endif